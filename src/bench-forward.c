@@ -0,0 +1,619 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark of forwarding on the loopback interface. Sources send
+ * messages to a proxy, the proxy forwards them to a relay and the relay to
+ * a sink. Each message starts with the time it was written: the sink
+ * computes how long it took to cross. A direct connection from sources to
+ * the sink gives the baseline.
+ *
+ * For each number of connections between proxy and relay, size of
+ * messages and number of clients, one line is displayed with the
+ * throughput (MB/s, and its ratio to the baseline), the CPU time (s) used
+ * by the proxy and the relay and by everything for each GB, their system
+ * calls for each MB and the 50th and 99th percentiles of the time (µs) to
+ * cross. Sources send as fast as they can: this time includes the time
+ * spent waiting in full buffers.
+ *
+ * With `-i`, `ro-ro-impair` is put between the proxy and the relay (and
+ * between sources and sink for the baseline) with the given rules. Its
+ * CPU time and system calls are not counted.
+ *
+ * Arguments of ro-ro-tcp given with `-a` are used by both the proxy and
+ * the relay. Those given with `-p` are only used by the proxy (like
+ * `--pool` or `--parallel`) and those given with `-r` by the relay.
+ *
+ * System calls are counted with the `raw_syscalls:sys_enter` tracepoint:
+ * tracefs should be mounted and tracepoints allowed (root or
+ * CAP_PERFMON), otherwise they are displayed as -1.
+ */
+
+#include "loopback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+
+#define BENCH_LIST 16		/* values for each parameter */
+#define BENCH_ARGS 16		/* extra arguments for ro-ro-tcp */
+#define BENCH_CHUNK (64 << 10)
+#define BENCH_TIMEOUT 10	/* seconds to wait for connections and EOF */
+#define BENCH_SUB 4		/* 2^4 buckets for each power of two */
+#define BENCH_BUCKETS ((40 - BENCH_SUB + 1) << BENCH_SUB) /* up to 2^40 ns */
+
+struct bench_flow {
+	struct bench_run *run;
+	int fd;
+	uint64_t bytes;		/* received by the sink */
+	uint64_t end;		/* when the sink got EOF (ns) */
+	unsigned char stamp[8];	/* time of the current message */
+	uint64_t latency[BENCH_BUCKETS];
+};
+
+struct bench_run {
+	int port;		/* where sources connect */
+	size_t size;		/* size of messages */
+	unsigned long clients;
+	uint64_t deadline;	/* when sources stop (ns) */
+	struct bench_flow *flows;
+};
+
+static const char *bench_tracepoints[] = {
+	"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+	"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+};
+static long bench_tracepoint = -1;
+struct bench_args {
+	char *args[BENCH_ARGS];
+	int count;
+};
+static struct bench_args bench_args, bench_proxy_args, bench_relay_args;
+static char *bench_rules[BENCH_LIST];	/* for ro-ro-impair */
+static int bench_nrules;
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned
+bench_bucket(uint64_t value)
+{
+	if (value >= (1ULL << 40)) value = (1ULL << 40) - 1;
+	if (value < (1 << BENCH_SUB)) return value;
+	unsigned shift = 63 - __builtin_clzll(value) - BENCH_SUB;
+	return ((shift + 1) << BENCH_SUB) +
+	    ((value >> shift) & ((1 << BENCH_SUB) - 1));
+}
+
+/**
+ * Value in the middle of a bucket.
+ */
+static double
+bench_value(unsigned bucket)
+{
+	if (bucket < (1 << BENCH_SUB)) return bucket;
+	unsigned shift = (bucket >> BENCH_SUB) - 1;
+	uint64_t mantissa = bucket & ((1 << BENCH_SUB) - 1);
+	return (((1 << BENCH_SUB) + mantissa) << shift) + (1ULL << shift) / 2.;
+}
+
+static double
+bench_percentile(uint64_t *latency, unsigned percent)
+{
+	uint64_t count = 0, seen = 0;
+	for (unsigned i = 0; i < BENCH_BUCKETS; i++) count += latency[i];
+	if (count == 0) return -1;
+	for (unsigned i = 0; i < BENCH_BUCKETS; i++) {
+		seen += latency[i];
+		if (seen * 100 >= count * percent) return bench_value(i);
+	}
+	return -1;
+}
+
+/**
+ * Count system calls of a process and of the threads it creates.
+ *
+ * @return a file descriptor or -1 if they cannot be counted
+ */
+static int
+bench_syscalls_open(pid_t pid)
+{
+	struct perf_event_attr attr = {
+		.type = PERF_TYPE_TRACEPOINT,
+		.size = sizeof(attr),
+		.inherit = 1
+	};
+	if (bench_tracepoint == -1) return -1;
+	attr.config = bench_tracepoint;
+	return syscall(SYS_perf_event_open, &attr, pid, -1, -1,
+	    PERF_FLAG_FD_CLOEXEC);
+}
+
+static int64_t
+bench_syscalls(int fd)
+{
+	uint64_t count;
+	if (fd == -1 || read(fd, &count, sizeof(count)) != sizeof(count))
+		return -1;
+	return count;
+}
+
+/**
+ * CPU time used by a process (s).
+ */
+static double
+bench_cpu(pid_t pid)
+{
+	char path[64], line[1024], *end;
+	unsigned long utime, stime;
+	FILE *f;
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((f = fopen(path, "r")) == NULL) return 0;
+	if (fgets(line, sizeof(line), f) == NULL ||
+	    (end = strrchr(line, ')')) == NULL ||
+	    sscanf(end + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2)
+		utime = stime = 0;
+	fclose(f);
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static double
+bench_cpu_self(void)
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+	    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/**
+ * Start a program with its system calls counted from the beginning (when
+ * `syscalls` is not NULL).
+ */
+static pid_t
+bench_exec(const char *path, char *argv[], int *syscalls)
+{
+	int ready[2];
+	pid_t pid;
+	char c;
+	if (pipe(ready) == -1 || (pid = fork()) == -1) {
+		perror("unable to start ro-ro-tcp");
+		exit(1);
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDERR_FILENO);
+		close(ready[1]);
+		while (read(ready[0], &c, 1) == -1 && errno == EINTR);
+		execv(path, argv);
+		_exit(1);
+	}
+	close(ready[0]);
+	if (syscalls) *syscalls = bench_syscalls_open(pid);
+	if (write(ready[1], "", 1) != 1) perror("unable to start ro-ro-tcp");
+	close(ready[1]);
+	return pid;
+}
+
+static pid_t
+bench_spawn(const char *role, unsigned long connections, int port, int target,
+    int *syscalls)
+{
+	char listen[32], remote[32], conns[16];
+	char *argv[2 * BENCH_ARGS + 8];
+	struct bench_args *own = (strcmp(role, "-p") == 0)?
+	    &bench_proxy_args:&bench_relay_args;
+	int argc = 0;
+	snprintf(listen, sizeof(listen), "127.0.0.1:%d", port);
+	snprintf(remote, sizeof(remote), "127.0.0.1:%d", target);
+	snprintf(conns, sizeof(conns), "%lu", connections);
+	argv[argc++] = "ro-ro-tcp";
+	argv[argc++] = "-d";
+	for (int i = 0; i < bench_args.count; i++) argv[argc++] = bench_args.args[i];
+	for (int i = 0; i < own->count; i++) argv[argc++] = own->args[i];
+	if (strcmp(role, "-p") == 0) {
+		argv[argc++] = "-z";
+		argv[argc++] = conns;
+		argv[argc++] = "-p";
+		argv[argc++] = listen;
+		argv[argc++] = remote;
+	} else {
+		/* The relay takes the server first */
+		argv[argc++] = "-r";
+		argv[argc++] = remote;
+		argv[argc++] = listen;
+	}
+	argv[argc] = NULL;
+	return bench_exec("./ro-ro-tcp", argv, syscalls);
+}
+
+/**
+ * Start ro-ro-impair in front of a port.
+ */
+static pid_t
+bench_impair(int port, int target)
+{
+	char listen[32], remote[32];
+	char *argv[2 * BENCH_LIST + 4];
+	int argc = 0;
+	snprintf(listen, sizeof(listen), "127.0.0.1:%d", port);
+	snprintf(remote, sizeof(remote), "127.0.0.1:%d", target);
+	argv[argc++] = "ro-ro-impair";
+	for (int i = 0; i < bench_nrules; i++) {
+		argv[argc++] = "-i";
+		argv[argc++] = bench_rules[i];
+	}
+	argv[argc++] = listen;
+	argv[argc++] = remote;
+	argv[argc] = NULL;
+	return bench_exec("./ro-ro-impair", argv, NULL);
+}
+
+static void
+bench_stop(pid_t pid, int syscalls)
+{
+	if (pid == -1) return;
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	if (syscalls != -1) close(syscalls);
+}
+
+static int
+bench_connect(int port)
+{
+	struct timeval timeout = { .tv_sec = BENCH_TIMEOUT };
+	int fd = loopback_connect(port);
+	if (fd == -1) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+/**
+ * Send messages until the deadline, each of them starting with the time
+ * it is written.
+ */
+static void *
+bench_source(void *arg)
+{
+	struct bench_run *run = arg;
+	char *message, buf[256];
+	int fd;
+	if ((fd = bench_connect(run->port)) == -1) {
+		perror("unable to connect");
+		return NULL;
+	}
+	if ((message = calloc(1, run->size)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	while (bench_now() < run->deadline) {
+		uint64_t now = bench_now();
+		size_t sent = 0;
+		memcpy(message, &now, sizeof(now));
+		while (sent < run->size) {
+			ssize_t n = write(fd, message + sent, run->size - sent);
+			if (n <= 0) goto end;
+			sent += n;
+		}
+	}
+end:
+	/* Wait for the sink to close */
+	shutdown(fd, SHUT_WR);
+	while (read(fd, buf, sizeof(buf)) > 0);
+	close(fd);
+	free(message);
+	return NULL;
+}
+
+/**
+ * Find the beginning of messages in what was received.
+ */
+static void
+bench_stamps(struct bench_flow *flow, const unsigned char *buf, size_t n)
+{
+	size_t size = flow->run->size;
+	uint64_t base = flow->bytes, end = base + n, now = 0;
+	for (uint64_t start = base - base % size; start < end; start += size) {
+		for (unsigned i = 0; i < 8; i++)
+			if (start + i >= base && start + i < end)
+				flow->stamp[i] = buf[start + i - base];
+		if (start + 7 < base || start + 7 >= end) continue;
+		uint64_t sent;
+		memcpy(&sent, flow->stamp, sizeof(sent));
+		if (now == 0) now = bench_now();
+		if (sent <= now) flow->latency[bench_bucket(now - sent)]++;
+	}
+	flow->bytes = end;
+}
+
+static void *
+bench_sink(void *arg)
+{
+	struct bench_flow *flow = arg;
+	unsigned char *buf = malloc(BENCH_CHUNK);
+	ssize_t n;
+	while (buf != NULL && (n = read(flow->fd, buf, BENCH_CHUNK)) > 0)
+		bench_stamps(flow, buf, n);
+	flow->end = bench_now();
+	close(flow->fd);
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Run sources for some time, through ro-ro-tcp if `connections` is not 0,
+ * and display the results.
+ *
+ * @return throughput (MB/s) or -1 on error
+ */
+static double
+bench_run(int lfd, int sink, unsigned long connections, size_t size,
+    unsigned long clients, double seconds, double direct)
+{
+	struct bench_run run = { .size = size, .clients = clients };
+	pthread_t sources[clients], sinks[clients];
+	pid_t proxy = -1, relay = -1, impaired = -1;
+	int syscalls[3] = { -1, -1, -1 };
+	int64_t before[3] = {}, after[3] = {};
+	double cpu[3] = {}, mbps = -1;
+	unsigned long accepted = 0, started = 0;
+
+	run.port = sink;
+	if (connections > 0) {
+		int rport = loopback_port(NULL);
+		relay = bench_spawn("-r", 0, rport, sink, &syscalls[1]);
+		if (loopback_listening(rport) == -1) {
+			fprintf(stderr, "relay did not start\n");
+			goto end;
+		}
+		run.port = rport;
+	}
+	if (bench_nrules > 0) {
+		/* Between proxy and relay, or between sources and sink */
+		int iport = loopback_port(NULL);
+		impaired = bench_impair(iport, run.port);
+		if (loopback_listening(iport) == -1) {
+			fprintf(stderr, "ro-ro-impair did not start\n");
+			goto end;
+		}
+		run.port = iport;
+	}
+	if (connections > 0) {
+		int pport = loopback_port(NULL);
+		proxy = bench_spawn("-p", connections, pport, run.port, &syscalls[2]);
+		if (loopback_listening(pport) == -1) {
+			fprintf(stderr, "proxy did not start\n");
+			goto end;
+		}
+		run.port = pport;
+	}
+	if ((run.flows = calloc(clients, sizeof(struct bench_flow))) == NULL)
+		goto end;
+	syscalls[0] = bench_syscalls_open(0);
+	for (int i = 0; i < 3; i++) before[i] = bench_syscalls(syscalls[i]);
+	cpu[0] = bench_cpu_self();
+	if (proxy != -1) cpu[1] = bench_cpu(relay) + bench_cpu(proxy);
+
+	uint64_t start = bench_now();
+	run.deadline = start + seconds * 1e9;
+	for (; started < clients; started++)
+		if (pthread_create(&sources[started], NULL, bench_source, &run) != 0)
+			break;
+	for (; accepted < started; accepted++) {
+		struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+		struct bench_flow *flow = &run.flows[accepted];
+		if (poll(&pfd, 1, BENCH_TIMEOUT * 1000) != 1 ||
+		    (flow->fd = accept(lfd, NULL, NULL)) == -1) {
+			fprintf(stderr, "sink did not get all clients\n");
+			break;
+		}
+		flow->run = &run;
+		if (pthread_create(&sinks[accepted], NULL, bench_sink, flow) != 0) {
+			close(flow->fd);
+			break;
+		}
+	}
+	for (unsigned long i = 0; i < accepted; i++) pthread_join(sinks[i], NULL);
+	for (unsigned long i = 0; i < started; i++) pthread_join(sources[i], NULL);
+	if (accepted < clients) goto end;
+
+	for (int i = 0; i < 3; i++) after[i] = bench_syscalls(syscalls[i]);
+	cpu[0] = bench_cpu_self() - cpu[0];
+	if (proxy != -1) cpu[1] = bench_cpu(relay) + bench_cpu(proxy) - cpu[1];
+	uint64_t bytes = 0, end = start;
+	for (unsigned long i = 0; i < clients; i++) {
+		struct bench_flow *flow = &run.flows[i];
+		bytes += flow->bytes;
+		if (flow->end > end) end = flow->end;
+		if (i == 0) continue;
+		for (unsigned j = 0; j < BENCH_BUCKETS; j++)
+			run.flows[0].latency[j] += flow->latency[j];
+	}
+	if (bytes == 0) goto end;
+
+	double mb = bytes / 1e6;
+	int64_t forwarded = -1, total = -1;
+	mbps = mb / ((end - start) / 1e9);
+	if (before[0] != -1 && after[0] != -1) total = after[0] - before[0];
+	if (connections == 0) forwarded = 0;
+	else if (before[1] != -1 && before[2] != -1 &&
+	    after[1] != -1 && after[2] != -1) {
+		forwarded = after[1] - before[1] + after[2] - before[2];
+		if (total != -1) total += forwarded;
+	}
+	printf("%s %lu %zu %lu %.1f %.3f %.3f %.3f %.1f %.1f %.1f %.1f\n",
+	    connections?"proxy":"direct", connections, size, clients,
+	    mbps, (direct > 0)?(mbps / direct):1,
+	    cpu[1] / (mb / 1000), (cpu[0] + cpu[1]) / (mb / 1000),
+	    (forwarded == -1)?-1:(forwarded / mb),
+	    (total == -1)?-1:(total / mb),
+	    bench_percentile(run.flows[0].latency, 50) / 1000,
+	    bench_percentile(run.flows[0].latency, 99) / 1000);
+	fflush(stdout);
+
+end:
+	if (syscalls[0] != -1) close(syscalls[0]);
+	bench_stop(proxy, syscalls[2]);
+	bench_stop(impaired, -1);
+	bench_stop(relay, syscalls[1]);
+	free(run.flows);
+	return mbps;
+}
+
+static int
+bench_list(char *arg, unsigned long *values)
+{
+	int count = 0;
+	for (char *value = strtok(arg, ","); value != NULL; value = strtok(NULL, ",")) {
+		if (count == BENCH_LIST) return -1;
+		values[count++] = strtoul(value, NULL, 0);
+	}
+	return count;
+}
+
+static void
+bench_tracepoint_find(void)
+{
+	for (size_t i = 0; i < sizeof(bench_tracepoints)/sizeof(*bench_tracepoints); i++) {
+		FILE *f = fopen(bench_tracepoints[i], "r");
+		if (f == NULL) continue;
+		if (fscanf(f, "%ld", &bench_tracepoint) != 1) bench_tracepoint = -1;
+		fclose(f);
+		if (bench_tracepoint != -1) break;
+	}
+	int fd = bench_syscalls_open(0);
+	if (fd == -1) bench_tracepoint = -1;
+	else close(fd);
+}
+
+static void
+bench_usage(void)
+{
+	fprintf(stderr,
+	    "usage: bench-forward [-t seconds] [-z connections,...] [-s bytes,...]\n"
+	    "                     [-c clients,...] [-a \"ro-ro-tcp arguments\"]\n"
+	    "                     [-p \"proxy arguments\"] [-r \"relay arguments\"]\n"
+	    "                     [-i ro-ro-impair rule]...\n");
+	exit(1);
+}
+
+/**
+ * Split arguments of ro-ro-tcp on spaces.
+ */
+static void
+bench_split(struct bench_args *args, char *arg)
+{
+	args->count = 0;
+	for (arg = strtok(arg, " "); arg != NULL; arg = strtok(NULL, " ")) {
+		if (args->count == BENCH_ARGS) bench_usage();
+		args->args[args->count++] = arg;
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long connections[BENCH_LIST] = { 1, 2, 4, 8 };
+	unsigned long sizes[BENCH_LIST] = { 1024, 16384, 262144 };
+	unsigned long clients[BENCH_LIST] = { 1, 8 };
+	int nconnections = 4, nsizes = 3, nclients = 2, lfd, ch;
+	double seconds = 2;
+
+	while ((ch = getopt(argc, argv, "t:z:s:c:a:p:r:i:")) != -1) {
+		switch (ch) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'z':
+			nconnections = bench_list(optarg, connections);
+			break;
+		case 's':
+			nsizes = bench_list(optarg, sizes);
+			break;
+		case 'c':
+			nclients = bench_list(optarg, clients);
+			break;
+		case 'a':
+			bench_split(&bench_args, optarg);
+			break;
+		case 'p':
+			bench_split(&bench_proxy_args, optarg);
+			break;
+		case 'r':
+			bench_split(&bench_relay_args, optarg);
+			break;
+		case 'i':
+			if (bench_nrules == BENCH_LIST) bench_usage();
+			bench_rules[bench_nrules++] = optarg;
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	if (seconds <= 0 || nconnections <= 0 || nsizes <= 0 || nclients <= 0)
+		bench_usage();
+	for (int i = 0; i < nsizes; i++)
+		if (sizes[i] < 8) bench_usage();
+
+	int sink = loopback_port(&lfd);
+	if (listen(lfd, 128) == -1) {
+		perror("unable to start sink");
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	bench_tracepoint_find();
+	if (bench_tracepoint == -1)
+		printf("# system calls are not counted: raw_syscalls:sys_enter is not available\n");
+	printf("# mode connections size clients mb_s ratio "
+	    "cpu_fwd_s_gb cpu_s_gb syscalls_fwd_mb syscalls_mb p50_us p99_us\n");
+	for (int c = 0; c < nclients; c++) {
+		for (int s = 0; s < nsizes; s++) {
+			double direct = bench_run(lfd, sink, 0, sizes[s],
+			    clients[c], seconds, 0);
+			for (int z = 0; z < nconnections; z++) {
+				if (connections[z] == 0) continue;
+				bench_run(lfd, sink, connections[z], sizes[s],
+				    clients[c], seconds, direct);
+			}
+		}
+	}
+	close(lfd);
+	return 0;
+}
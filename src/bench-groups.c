@@ -0,0 +1,126 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark of the index of groups (see `group.c`) against a walk of the
+ * list of local endpoints, as done before. For each number of sessions, it
+ * displays the average time (ns) to find a group and to allocate a new
+ * group ID with both methods.
+ */
+
+#include "ro-ro-tcp.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define BENCH_LOOKUPS 200000
+
+static uint64_t
+bench_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static struct ro_local *
+bench_walk(struct ro_worker *worker, uint32_t id)
+{
+	struct ro_local *local;
+	TAILQ_FOREACH(local, &worker->locals, next)
+	    if (local->group_id == id) return local;
+	return NULL;
+}
+
+static uint32_t
+bench_walk_new(struct ro_worker *worker)
+{
+	uint32_t id;
+	do {
+		id = (++worker->last_group_id << RO_WORKER_BITS) | worker->index;
+	} while (id == 0 || id == RO_POOL_GROUP ||
+	    id == RO_MAGIC || id == RO_MAGIC_KEY ||
+	    bench_walk(worker, id) != NULL);
+	return id;
+}
+
+static void
+bench_run(size_t sessions)
+{
+	struct ro_worker worker = {};
+	struct ro_local *locals, *found;
+	uint32_t *ids;
+	uint64_t start, hash_find, walk_find, hash_new, walk_new;
+	size_t i, walks = BENCH_LOOKUPS;
+	volatile uint32_t sink = 0;
+
+	TAILQ_INIT(&worker.locals);
+	if ((locals = calloc(sessions, sizeof(*locals))) == NULL ||
+	    (ids = calloc(sessions, sizeof(*ids))) == NULL) {
+		fprintf(stderr, "not enough memory for %zu sessions\n", sessions);
+		exit(1);
+	}
+	for (i = 0; i < sessions; i++) {
+		locals[i].worker = &worker;
+		locals[i].group_id = ids[i] = group_new(&worker);
+		TAILQ_INSERT_TAIL(&worker.locals, &locals[i], next);
+		if (group_insert(&worker, &locals[i]) == -1) exit(1);
+	}
+	/* Walking the list is slow, do fewer of them with many sessions */
+	while (walks > 1000 && walks * sessions > 200000000ULL) walks /= 2;
+
+	start = bench_now();
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		found = group_find(&worker, ids[(i * 7919) % sessions]);
+		sink += found->group_id;
+	}
+	hash_find = (bench_now() - start) / BENCH_LOOKUPS;
+	start = bench_now();
+	for (i = 0; i < walks; i++) {
+		found = bench_walk(&worker, ids[(i * 7919) % sessions]);
+		sink += found->group_id;
+	}
+	walk_find = (bench_now() - start) / walks;
+
+	/* Each new ID is checked against the ones in use */
+	start = bench_now();
+	for (i = 0; i < walks; i++) sink += group_new(&worker);
+	hash_new = (bench_now() - start) / walks;
+	start = bench_now();
+	for (i = 0; i < walks; i++) sink += bench_walk_new(&worker);
+	walk_new = (bench_now() - start) / walks;
+
+	printf("%zu %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+	    sessions, hash_find, walk_find, hash_new, walk_new);
+	for (i = 0; i < sessions; i++) group_remove(&locals[i]);
+	group_free(&worker);
+	free(locals);
+	free(ids);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const size_t sessions[] = { 10, 100, 1000, 10000, 50000, 100000 };
+	log_init(1, "bench-groups");
+	printf("# sessions find_hash_ns find_walk_ns new_hash_ns new_walk_ns\n");
+	for (size_t i = 0; i < sizeof(sessions)/sizeof(*sessions); i++)
+		bench_run(sessions[i]);
+	return 0;
+}
@@ -18,16 +18,27 @@
 #include "ro-ro-tcp.h"
 #include "event.h"
 
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <endian.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
 #include <event2/listener.h>
 
 struct incoming_connection {
-	struct ro_cfg *cfg;
+	struct ro_worker *worker;
 	int fd;
 	unsigned id;
+	uint8_t version;	/* Negotiated version of the protocol */
+	bool fresh;		/* Group ID allocated for this connection */
+	bool pooled;		/* Pooled connection waiting for the real hello */
+	bool keyed;		/* Group identified by a key */
+	bool join;		/* Only join an existing group */
+	uint64_t key[RO_KEY_WORDS];
 	struct bufferevent *bev;
 	char addr[INET6_ADDRSTRLEN];
 	char serv[SERVSTRLEN];
@@ -46,43 +57,136 @@ incoming_destroy(struct incoming_connection *connection, bool cl)
 	free(connection);
 }
 
+/**
+ * Encode or decode the group key of a hello (after magic, version and flags).
+ */
+static void
+connection_put_key(char *hello, const uint64_t key[static RO_KEY_WORDS])
+{
+	for (int i = 0; i < RO_KEY_WORDS; i++) {
+		uint64_t word = htobe64(key[i]);
+		memcpy(hello + sizeof(uint32_t) + 2 + i * sizeof(word),
+		    &word, sizeof(word));
+	}
+}
+static void
+connection_get_key(const char *hello, uint64_t key[static RO_KEY_WORDS])
+{
+	for (int i = 0; i < RO_KEY_WORDS; i++) {
+		uint64_t word;
+		memcpy(&word, hello + sizeof(uint32_t) + 2 + i * sizeof(word),
+		    sizeof(word));
+		key[i] = be64toh(word);
+	}
+}
+
+/**
+ * Set the version of the protocol used by a local endpoint and its remotes.
+ */
+static void
+connection_version(struct ro_local *local, uint8_t version)
+{
+	local->event->version = version;
+	local->event->send_next = local->event->receive_next =
+	    frame_first(version);
+}
+
 static void
 incoming_read(struct bufferevent *bev, void *arg)
 {
 	struct incoming_connection *incoming = arg;
-	uint32_t id;
-	size_t len;
-	if ((len = evbuffer_remove(bufferevent_get_input(bev), &id, sizeof(id))) != sizeof(id)) {
+	struct ro_cfg *cfg = incoming->worker->cfg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char hello[RO_KEYED_HELLO_SIZE];
+	uint32_t id, magic;
+	size_t len = evbuffer_get_length(input), size;
+
+	/* Version 1 only sends the group ID while version 2 sends a magic
+	 * number, the highest version supported and the group ID. With
+	 * another magic number, the group ID is replaced by some flags and a
+	 * group key chosen by the proxy. */
+	if (len < sizeof(magic) ||
+	    evbuffer_copyout(input, &magic, sizeof(magic)) != sizeof(magic)) {
 		log_warnx("connection",
 		    "incorrect length for group ID received: %zu != %zu",
 		    len, sizeof(uint32_t));
 		incoming_destroy(incoming, true);
 		return;
 	}
-	id = ntohl(id);
-	if (id == 0) {
-		log_debug("connection",
-		    "incoming connection from [%s]:%s will be attached to group ID #%" PRIu32,
-		    incoming->addr, incoming->serv, id);
-	}
-	while (id == 0) {
-		id = ++incoming->cfg->last_group_id;
-		/* Check it is not already used. */
-		struct ro_local *local;
-		TAILQ_FOREACH(local, &incoming->cfg->locals, next) {
-			if (local->group_id == id) {
-				id = 0;
-				break;
+	size = (ntohl(magic) == RO_MAGIC_KEY)?RO_KEYED_HELLO_SIZE:RO_HELLO_SIZE;
+	if (ntohl(magic) != RO_MAGIC && ntohl(magic) != RO_MAGIC_KEY) {
+		evbuffer_remove(input, &id, sizeof(id));
+		incoming->version = 1;
+	} else if (len < size) {
+		/* Wait for the remaining of the message */
+		bufferevent_setwatermark(bev, EV_READ, size, size);
+		return;
+	} else {
+		evbuffer_remove(input, hello, size);
+		uint8_t version = hello[sizeof(magic)];
+		if (version == 0) {
+			log_warnx("connection",
+			    "[%s]:%s does not support any version of the protocol",
+			    incoming->addr, incoming->serv);
+			incoming_destroy(incoming, true);
+			return;
+		}
+		incoming->version = (version < cfg->protocol)?version:cfg->protocol;
+		if (ntohl(magic) == RO_MAGIC_KEY) {
+			if (incoming->version < 2) {
+				log_warnx("connection",
+				    "[%s]:%s sent a group key, this needs version 2 of the protocol",
+				    incoming->addr, incoming->serv);
+				incoming_destroy(incoming, true);
+				return;
 			}
+			incoming->keyed = true;
+			incoming->pooled = false;
+			incoming->join = (hello[sizeof(magic) + 1] & RO_HELLO_JOIN);
+			connection_get_key(hello, incoming->key);
+			log_debug("connection",
+			    "incoming connection from [%s]:%s for group key %016" PRIx64 "%016" PRIx64
+			    " (protocol version %u)",
+			    incoming->addr, incoming->serv,
+			    incoming->key[0], incoming->key[1], incoming->version);
+			/* Echo it back with the version we use */
+			hello[sizeof(magic)] = incoming->version;
+			goto reply;
 		}
+		memcpy(&id, hello + sizeof(magic) + 1, sizeof(id));
+	}
+	id = ntohl(id);
+	incoming->pooled = false;
+	if (id == RO_POOL_GROUP && ntohl(magic) == RO_MAGIC) {
+		/* Echo it back and wait for the real hello, see `pool.c` */
+		incoming->pooled = true;
 		log_debug("connection",
-		    "incoming connection from [%s]:%s will use group ID #%" PRIu32,
-		    incoming->addr, incoming->serv, id);
+		    "incoming connection from [%s]:%s is pooled",
+		    incoming->addr, incoming->serv);
+	} else if (id == 0) {
+		id = group_new(incoming->worker);
+		incoming->fresh = true;
+		log_debug("connection",
+		    "incoming connection from [%s]:%s will use group ID #%" PRIu32
+		    " (protocol version %u)",
+		    incoming->addr, incoming->serv, id, incoming->version);
 	}
 	incoming->id = id;
 	id = htonl(id);
-	if (bufferevent_write(bev,
-		&id, sizeof(id)) == -1) {
+	if (ntohl(magic) != RO_MAGIC) {
+		memcpy(hello, &id, sizeof(id));
+		size = sizeof(id);
+	} else {
+		magic = htonl(RO_MAGIC);
+		memcpy(hello, &magic, sizeof(magic));
+		hello[sizeof(magic)] = incoming->version;
+		memcpy(hello + sizeof(magic) + 1, &id, sizeof(id));
+		size = RO_HELLO_SIZE;
+	}
+reply:
+	bufferevent_disable(bev, EV_READ);
+	if (bufferevent_write(bev, hello, size) == -1 ||
+	    bufferevent_enable(bev, EV_WRITE) == -1) {
 		log_warnx("connection",
 		    "unable to push group ID to remote");
 		incoming_destroy(incoming, true);
@@ -94,34 +198,128 @@ static void
 incoming_write(struct bufferevent *bev, void *arg)
 {
 	struct incoming_connection *incoming = arg;
-	struct ro_cfg *cfg = incoming->cfg;
+	struct ro_worker *worker = incoming->worker;
+	if (incoming->id == 0 && !incoming->keyed)
+		return;		/* Group ID not received yet */
+	if (incoming->id == RO_POOL_GROUP) {
+		/* Wait for the real hello, up to RO_POOL_IDLE */
+		struct timeval tv = { RO_POOL_IDLE, 0 };
+		incoming->id = 0;
+		bufferevent_setwatermark(bev, EV_READ,
+		    sizeof(uint32_t), sizeof(uint32_t));
+		bufferevent_set_timeouts(bev, &tv, NULL);
+		bufferevent_enable(bev, EV_READ);
+		return;
+	}
+
+	/* The group ID has been echoed back, the connection can now be
+	 * attached to its group by the worker owning it. */
+	int fd = incoming->fd;
+	uint32_t id = incoming->id;
+	uint8_t version = incoming->version;
+	bool keyed = incoming->keyed;
+	bool fresh = keyed?!incoming->join:incoming->fresh;
+	uint64_t key[RO_KEY_WORDS];
+	char addr[INET6_ADDRSTRLEN];
+	char serv[SERVSTRLEN];
+	memcpy(key, incoming->key, sizeof(key));
+	memcpy(addr, incoming->addr, sizeof(addr));
+	memcpy(serv, incoming->serv, sizeof(serv));
+	incoming_destroy(incoming, false);
+
+	unsigned owner = keyed?
+	    RO_KEY_WORKER(key, worker->cfg->workers):RO_GROUP_WORKER(id);
+	if (owner == worker->index)
+		connection_attach(worker, fd, id, keyed?key:NULL,
+		    version, fresh, addr, serv);
+	else
+		event_handoff(worker, fd, id, keyed?key:NULL,
+		    version, fresh, addr, serv);
+}
+
+/**
+ * Attach an incoming connection from the proxy to the local endpoint of
+ * the given group. The local endpoint is created for a fresh group. A
+ * connection for a group we don't know anymore is refused: the session it
+ * belonged to is over.
+ *
+ * @param fd    File descriptor of the connection. We take care of closing it
+ *              on error.
+ * @param key   Group key or NULL to use the group ID.
+ * @param fresh The group can be created. With a group key, the first
+ *              connection to arrive creates it, unless the key has been
+ *              retired.
+ */
+void
+connection_attach(struct ro_worker *worker, int fd, uint32_t id,
+    const uint64_t *key, uint8_t version, bool fresh,
+    char addr[static INET6_ADDRSTRLEN], char serv[static SERVSTRLEN])
+{
+	struct ro_cfg *cfg = worker->cfg;
+	bool created = false;
 
 	/* OK, now, we should find or create the appropriate local connection */
 	struct ro_local *local;
 	int sfd = -1;
-	TAILQ_FOREACH(local, &cfg->locals, next)
-	    if (local->group_id == incoming->id) break;
+	local = key?group_find_key(worker, key):group_find(worker, id);
+	if (local == NULL && fresh && key && group_retired(worker, key)) {
+		log_debug("connection",
+		    "[%s]:%s arrived after the end of group key %016" PRIx64 "%016" PRIx64,
+		    addr, serv, key[0], key[1]);
+		close(fd);
+		return;
+	}
+	if (local == NULL && !fresh) {
+		if (key)
+			log_warnx("connection",
+			    "[%s]:%s wants to join unknown group key %016" PRIx64 "%016" PRIx64,
+			    addr, serv, key[0], key[1]);
+		else
+			log_warnx("connection",
+			    "[%s]:%s wants to join unknown group ID #%" PRIu32,
+			    addr, serv, id);
+		close(fd);
+		return;
+	}
 	if (local == NULL) {
 		char laddr[INET6_ADDRSTRLEN] = {};
 		char lserv[SERVSTRLEN] = {};
 		char raddr[INET6_ADDRSTRLEN] = {};
 		char rserv[SERVSTRLEN] = {};
-		if ((sfd = endpoint_connect(cfg->local, laddr, lserv, raddr, rserv)) == -1 ||
-		    (local = local_init(cfg, sfd, raddr, rserv)) == NULL) {
-			incoming_destroy(incoming, true);
+		if ((sfd = endpoint_connect(cfg->local, false,
+			    laddr, lserv, raddr, rserv)) == -1 ||
+		    (local = local_init(worker, sfd, raddr, rserv)) == NULL) {
+			close(fd);
 			return;
 		}
 		event_add(local->event->write, NULL); /* Check if we are connected */
-		local->group_id = incoming->id;
-		TAILQ_INSERT_TAIL(&cfg->locals, local, next);
+		local->group_id = id;
+		if (key) {
+			local->keyed = true;
+			memcpy(local->group_key, key, sizeof(local->group_key));
+		}
+		connection_version(local, version);
+		TAILQ_INSERT_TAIL(&worker->locals, local, next);
+		if (group_insert(worker, local) == -1) {
+			close(fd);
+			local_destroy(local);
+			return;
+		}
+		created = true;
+	} else if (local->event->version != version) {
+		log_warnx("connection",
+		    "[%s]:%s uses version %u of the protocol while its group"
+		    " uses version %u",
+		    addr, serv, version, local->event->version);
+		close(fd);
+		return;
 	}
 
 	/* And attach a new remote on it. */
 	struct ro_remote *remote = NULL;
-	if ((remote = remote_init(cfg, local, incoming->fd,
+	if ((remote = remote_init(cfg, local, fd,
 		    local->addr, local->serv,
-		    incoming->addr, incoming->serv)) == NULL) {
-		incoming_destroy(incoming, false);
+		    addr, serv)) == NULL) {
 		local_destroy(local);
 		return;
 	}
@@ -130,7 +328,13 @@ incoming_write(struct bufferevent *bev, void *arg)
 	/* See `local_data_cb()` in `forward.c` */
 	if (local->connected) event_add(remote->event->read, NULL);
 
-	bufferevent_free(incoming->bev); free(incoming);
+	/* A replacement may have frames to carry, see `remote_lost()`. With
+	 * a replay buffer, it should carry them before any other frame: we
+	 * wait for the proxy to tell us which losses it knows about. */
+	if (!created && cfg->replay > 0 && local->event->version >= 2)
+		remote->event->joining = true;
+	else if (!created) event_add(remote->event->write, NULL);
+
 	TAILQ_INSERT_TAIL(&local->remotes, remote, next);
 }
 
@@ -138,6 +342,15 @@ static void
 incoming_event(struct bufferevent *bev, short what, void *arg)
 {
 	struct incoming_connection *incoming = arg;
+	if (incoming->pooled && incoming->id == 0 &&
+	    (what & (BEV_EVENT_EOF|BEV_EVENT_TIMEOUT))) {
+		log_debug("connection",
+		    "pooled connection with [%s]:%s %s",
+		    incoming->addr, incoming->serv,
+		    (what & BEV_EVENT_TIMEOUT)?"expired":"closed");
+		incoming_destroy(incoming, true);
+		return;
+	}
 	if (what & (BEV_EVENT_EOF|BEV_EVENT_ERROR|BEV_EVENT_TIMEOUT)) {
 		log_warn("connection",
 		    "incoming connection with [%s]:%s aborted before completion",
@@ -148,7 +361,143 @@ incoming_event(struct bufferevent *bev, short what, void *arg)
 }
 
 /**
- * Open a connection to remote.
+ * Send the group ID to the relay. This is the first step of the
+ * establishment protocol on the proxy side.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+connection_send_group(struct ro_remote *remote)
+{
+	struct ro_cfg *cfg = remote->cfg;
+	struct ro_local *local = remote->local;
+	uint32_t id = htonl(local->group_id);
+	uint32_t magic = htonl(RO_MAGIC);
+	char hello[RO_KEYED_HELLO_SIZE];
+	size_t len = sizeof(id);
+	ssize_t n;
+	if (local->keyed) {
+		/* Once a connection is established, the group exists: the
+		 * other ones should not create it again. */
+		magic = htonl(RO_MAGIC_KEY);
+		memcpy(hello, &magic, sizeof(magic));
+		hello[sizeof(magic)] = cfg->protocol;
+		hello[sizeof(magic) + 1] =
+		    local->event->established?RO_HELLO_JOIN:0;
+		connection_put_key(hello, local->group_key);
+		len = RO_KEYED_HELLO_SIZE;
+	} else if (cfg->protocol >= 2) {
+		/* Tell the highest version we support */
+		memcpy(hello, &magic, sizeof(magic));
+		hello[sizeof(magic)] = cfg->protocol;
+		memcpy(hello + sizeof(magic) + 1, &id, sizeof(id));
+		len = RO_HELLO_SIZE;
+	} else memcpy(hello, &id, sizeof(id));
+	while ((n = write(event_get_fd(remote->event->write), hello, len)) == -1) {
+		if (errno == EINTR) continue;
+		break;
+	}
+	if (n != (ssize_t)len) {
+		/* The socket buffer is empty, a short write is an error */
+		log_warn("connection", "unable to send group ID to [%s]:%s",
+		    remote->raddr, remote->rserv);
+		return -1;
+	}
+	remote->event->hello_bytes = 0;
+	return 0;
+}
+
+/**
+ * Receive the group ID from the relay. This is the second step of the
+ * establishment protocol on the proxy side.
+ *
+ * @return 1 when the group ID has been received and checked, 0 when we need
+ *         to wait for more bytes, -1 on error
+ */
+int
+connection_receive_group(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	struct ro_cfg *cfg = remote->cfg;
+	size_t len = local->keyed?RO_KEYED_HELLO_SIZE:
+	    (cfg->protocol >= 2)?RO_HELLO_SIZE:sizeof(uint32_t);
+	ssize_t n;
+	while (remote->event->hello_bytes < len) {
+		n = read(event_get_fd(remote->event->read),
+		    remote->event->hello + remote->event->hello_bytes,
+		    len - remote->event->hello_bytes);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			log_warn("connection", "unable to receive group ID from [%s]:%s",
+			    remote->raddr, remote->rserv);
+			return -1;
+		}
+		if (n == 0) {
+			log_warnx("connection", "[%s]:%s closed the connection during establishment",
+			    remote->raddr, remote->rserv);
+			return -1;
+		}
+		remote->event->hello_bytes += n;
+	}
+	uint32_t id, magic = RO_MAGIC;
+	uint8_t version = 1;
+	if (local->keyed) {
+		uint64_t key[RO_KEY_WORDS];
+		memcpy(&magic, remote->event->hello, sizeof(magic));
+		version = remote->event->hello[sizeof(magic)];
+		connection_get_key(remote->event->hello, key);
+		if (ntohl(magic) != RO_MAGIC_KEY ||
+		    version < 2 || version > cfg->protocol ||
+		    memcmp(key, local->group_key, sizeof(key)) != 0 ||
+		    (local->event->established && local->event->version != version)) {
+			log_warnx("connection", "[%s]:%s sent an invalid reply (version %u)",
+			    remote->raddr, remote->rserv, version);
+			return -1;
+		}
+		if (!local->event->established) {
+			log_debug("connection", "[%s]:%s attached to group key %016" PRIx64 "%016" PRIx64
+			    " (protocol version %u)",
+			    local->addr, local->serv, key[0], key[1], version);
+			local->event->established = true;
+			connection_version(local, version);
+		}
+		return 1;
+	}
+	if (len == RO_HELLO_SIZE) {
+		memcpy(&magic, remote->event->hello, sizeof(magic));
+		version = remote->event->hello[sizeof(magic)];
+		memcpy(&id, remote->event->hello + sizeof(magic) + 1, sizeof(id));
+		magic = ntohl(magic);
+	} else memcpy(&id, remote->event->hello, sizeof(id));
+	id = ntohl(id);
+	if (magic != RO_MAGIC || version == 0 || version > cfg->protocol) {
+		log_warnx("connection", "[%s]:%s sent an invalid reply (version %u)",
+		    remote->raddr, remote->rserv, version);
+		return -1;
+	}
+	if (id == 0 ||
+	    (local->group_id != 0 && local->group_id != id) ||
+	    (local->group_id != 0 && local->event->version != version)) {
+		log_warnx("connection", "[%s]:%s sent unexpected group ID #%" PRIu32
+		    " (version %u)",
+		    remote->raddr, remote->rserv, id, version);
+		return -1;
+	}
+	if (local->group_id == 0) {
+		log_debug("connection", "[%s]:%s attached to group ID #%" PRIu32
+		    " (protocol version %u)",
+		    local->addr, local->serv, id, version);
+		local->group_id = id;
+		local->event->established = true;
+		connection_version(local, version);
+	}
+	return 1;
+}
+
+/**
+ * Open a connection to remote. A connection from the pool is used when one
+ * is ready. Otherwise, a new one is opened.
  */
 int
 connection_open(struct ro_cfg *cfg, struct ro_local *local)
@@ -159,9 +508,19 @@ connection_open(struct ro_cfg *cfg, struct ro_local *local)
 	char raddr[INET6_ADDRSTRLEN] = {};
 	char rserv[SERVSTRLEN] = {};
 	int sfd;
-	if ((sfd = endpoint_connect(cfg->remote, laddr, lserv, raddr, rserv)) == -1 ||
+	bool pooled = true;
+	if ((sfd = pool_claim(local->worker, laddr, lserv, raddr, rserv)) == -1) {
+		pooled = false;
+		sfd = endpoint_connect(cfg->remote, cfg->fastopen,
+		    laddr, lserv, raddr, rserv);
+	}
+	if (sfd == -1 ||
 	    (remote = remote_init(cfg, local, sfd, laddr, lserv, raddr, rserv)) == NULL)
 		return -1;
+	if (!pooled) {
+		remote->event->timed = true;
+		clock_gettime(CLOCK_MONOTONIC, &remote->event->opened);
+	}
 	event_add(remote->event->write, NULL); /* Check if we are connected */
 	TAILQ_INSERT_TAIL(&local->remotes, remote, next);
 	return 0;
@@ -176,30 +535,48 @@ client_accept_cb(struct evconnlistener *listener,
     evutil_socket_t fd, struct sockaddr *address, int socklen,
     void *arg)
 {
-	struct ro_cfg *cfg = arg;
+	struct ro_worker *worker = arg;
+	struct ro_cfg *cfg = worker->cfg;
 	char addr[INET6_ADDRSTRLEN] = {};
 	char serv[SERVSTRLEN] = {};
 	getnameinfo(address, socklen,
 	    addr, INET6_ADDRSTRLEN,
 	    serv, SERVSTRLEN,
 	    NI_NUMERICHOST | NI_NUMERICSERV);
-	log_info("connection", "accepting connection from [%s]:%s", addr, serv);
+	log_info("connection", "worker %u accepting connection from [%s]:%s",
+	    worker->index, addr, serv);
 
 	struct ro_local  *local  = NULL;
 	struct incoming_connection *incoming = NULL;
+	int n = 1;
 
 	switch (cfg->role) {
 	case ROLE_PROXY:
 		/* We setup this new local endpoint */
-		local = local_init(cfg, fd, addr, serv);
-		local->connected = true;
+		local = local_init(worker, fd, addr, serv);
 		fd = -1;
 		if (local == NULL) goto error;
-		TAILQ_INSERT_TAIL(&cfg->locals, local, next);
+		local->connected = true;
+		connection_version(local, cfg->protocol);
+		TAILQ_INSERT_TAIL(&worker->locals, local, next);
 
-		/* We open the first connection to remote */
-		if (connection_open(cfg, local) == -1)
-			goto error;
+		if (cfg->parallel) {
+			/* We choose the group key. All connections can be
+			 * opened at once. */
+			if (getrandom(local->group_key, sizeof(local->group_key), 0) !=
+			    sizeof(local->group_key)) {
+				log_warn("connection", "unable to choose a group key");
+				goto error;
+			}
+			local->keyed = true;
+			if (!cfg->adaptive) n = cfg->conns;
+		}
+
+		/* We open the first connection(s) to remote */
+		while (n-- > 0) {
+			if (connection_open(cfg, local) == -1)
+				goto error;
+		}
 		return;
 
 	case ROLE_RELAY:
@@ -217,11 +594,11 @@ client_accept_cb(struct evconnlistener *listener,
 			    "unable to allocate memory for incoming connection");
 			goto error;
 		}
-		incoming->cfg = cfg;
+		incoming->worker = worker;
 		incoming->fd = fd;
 		strncpy(incoming->addr, addr, sizeof(addr));
 		strncpy(incoming->serv, serv, sizeof(serv));
-		if ((incoming->bev = bufferevent_socket_new(cfg->event->base,
+		if ((incoming->bev = bufferevent_socket_new(worker->event->base,
 			    incoming->fd,
 			    0)) == NULL) {
 			log_warnx("connection",
@@ -232,7 +609,7 @@ client_accept_cb(struct evconnlistener *listener,
 		    incoming_event, incoming);
 		bufferevent_setwatermark(incoming->bev, EV_READ,
 		    sizeof(uint32_t), sizeof(uint32_t));
-		bufferevent_enable(incoming->bev, EV_READ|EV_WRITE);
+		bufferevent_enable(incoming->bev, EV_READ);
 		return;
 	}
 error:
@@ -254,35 +631,176 @@ client_accept_error_cb(struct evconnlistener *listener,
 
 /**
  * Callback when a remote connection has been established. We need to open the
- * other ones.
+ * other ones, unless they are opened on demand.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
  */
-void
+int
 connection_established(struct ro_local *local, struct ro_remote *remote)
 {
 	struct ro_cfg *cfg = local->cfg;
 	int n = 0;
 	struct ro_remote *other;
+	if (cfg->adaptive) return 0; /* See `connection_adapt_cb()` */
+	if (local->keyed) return 0;  /* Already opened */
 	TAILQ_FOREACH(other, &local->remotes, next) n++;
 	while (cfg->conns > n++) {
 		if (connection_open(cfg, local) == -1) {
 			log_warnx("connection",
 			    "unable to open a new remote connection");
 			local_destroy(local);
-			return;
+			return -1;
 		}
 	}
+	return 0;
+}
+
+/**
+ * Periodically adapt the number of remotes of a local endpoint (proxy only).
+ * When all the remotes were busy during several intervals, a new one is
+ * opened, up to the configured number of connections. A remote which has
+ * been idle for a long time is closed, except the last one.
+ */
+void
+connection_adapt_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_local *local = arg;
+	struct ro_cfg *cfg = local->cfg;
+	struct ro_remote *remote, *idle = NULL;
+	int n = 0, connected = 0;
+	bool pending = false;
+	if (local->event->eof) return; /* Ending */
+
+	if (local->stats.busy != local->event->last_busy)
+		local->event->busy++;
+	else
+		local->event->busy = 0;
+	local->event->last_busy = local->stats.busy;
+
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (remote->event->retiring || remote->event->lost) continue;
+		n++;
+		if (!remote->connected) {
+			pending = true;
+			continue;
+		}
+		connected++;
+		size_t bytes = remote->stats.in + remote->stats.out;
+		if (bytes != remote->event->last_bytes ||
+		    remote->event->send_bytes > 0 ||
+		    remote->event->controls > 0)
+			remote->event->idle = 0;
+		else if (remote->event->idle < RO_ADAPT_IDLE)
+			remote->event->idle++;
+		remote->event->last_bytes = bytes;
+		if (remote->event->idle == RO_ADAPT_IDLE) idle = remote;
+	}
+	if (pending) return;	/* One at a time */
+
+	if (local->event->busy >= RO_ADAPT_BUSY && n < cfg->conns) {
+		log_debug("connection", "[%s]:%s: all %d remote(s) are busy, open a new one",
+		    local->addr, local->serv, n);
+		local->event->busy = 0;
+		if (connection_open(cfg, local) == -1)
+			log_warnx("connection", "unable to open a new remote connection");
+		return;
+	}
+	if (idle != NULL && connected > 1 &&
+	    local->event->version >= 2 &&
+	    !local->event->eof && !local->event->peer_eof) {
+		log_debug("connection", "[%s]:%s: [%s]:%s is idle, close it",
+		    local->addr, local->serv,
+		    idle->raddr, idle->rserv);
+		remote_retire(idle);
+	}
+}
+
+/**
+ * Display the time needed to establish connections to relay.
+ */
+void
+connection_debug(struct ro_worker *worker)
+{
+	size_t *n = worker->stats.connects;
+	uint64_t *total = worker->stats.connect_total;
+	uint64_t *max = worker->stats.connect_max;
+	if (worker->cfg->role != ROLE_PROXY) return;
+	log_info("connection",
+	    "worker %u: connections to relay established in avg %" PRIu64
+	    " µs (max %" PRIu64 " µs, %zu connections) without TCP Fast Open,"
+	    " in avg %" PRIu64 " µs (max %" PRIu64 " µs, %zu connections) with it",
+	    worker->index,
+	    n[0]?(total[0] / n[0]):0, max[0], n[0],
+	    n[1]?(total[1] / n[1]):0, max[1], n[1]);
+}
+
+/**
+ * Check TCP Fast Open is enabled by the system: the relay needs the server
+ * side, the proxy needs both sides.
+ */
+void
+connection_fastopen(struct ro_cfg *cfg)
+{
+	FILE *f;
+	int enabled, needed = (cfg->role == ROLE_PROXY)?3:2;
+	if ((f = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r")) == NULL)
+		return;
+	if (fscanf(f, "%d", &enabled) == 1 && (enabled & needed) != needed)
+		log_warnx("connection",
+		    "TCP Fast Open is partly disabled by the system, set net.ipv4.tcp_fastopen to %d",
+		    enabled | needed);
+	fclose(f);
+}
+
+/**
+ * Create a listening socket. SO_REUSEPORT is set to let each worker have its
+ * own listening socket bound to the same address.
+ */
+static int
+connection_socket(struct ro_cfg *cfg, struct addrinfo *la)
+{
+	int fd, one = 1;
+	if ((fd = socket(la->ai_family, la->ai_socktype, la->ai_protocol)) == -1)
+		return -1;
+	evutil_make_socket_nonblocking(fd);
+	evutil_make_socket_closeonexec(fd);
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+		goto error;
+#ifdef SO_REUSEPORT
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+		goto error;
+#else
+	if (cfg->workers > 1) {
+		log_warnx("connection", "SO_REUSEPORT is not supported");
+		errno = ENOTSUP;
+		goto error;
+	}
+#endif
+	if (cfg->fastopen) {
+		int qlen = RO_FASTOPEN_QUEUE;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
+			log_warn("connection", "unable to enable TCP Fast Open");
+	}
+	if (bind(fd, la->ai_addr, la->ai_addrlen) == -1)
+		goto error;
+	return fd;
+error:
+	close(fd);
+	return -1;
 }
 
 /**
  * Listen for new connections
  */
 int
-connection_listen(struct ro_cfg *cfg)
+connection_listen(struct ro_worker *worker)
 {
+	struct ro_cfg *cfg = worker->cfg;
 	struct addrinfo *listenaddr =
 	    (cfg->role == ROLE_PROXY)?cfg->local:cfg->remote, *la;
 	char addr[INET6_ADDRSTRLEN] = {};
 	char serv[SERVSTRLEN] = {};
+	int fd;
 
 	for (la = listenaddr; la != NULL; la = la->ai_next) {
 		getnameinfo(la->ai_addr, la->ai_addrlen,
@@ -291,24 +809,21 @@ connection_listen(struct ro_cfg *cfg)
 		    NI_NUMERICHOST | NI_NUMERICSERV); /* cannot fail */
 		log_debug("connection", "try to bind and listen to [%s]:%s", addr, serv);
 
-		cfg->event->listener = evconnlistener_new_bind(cfg->event->base,
-		    client_accept_cb, cfg,
-		    LEV_OPT_CLOSE_ON_FREE |
-		    LEV_OPT_CLOSE_ON_EXEC |
-		    LEV_OPT_REUSEABLE,
+		if ((fd = connection_socket(cfg, la)) == -1) continue;
+		worker->event->listener = evconnlistener_new(worker->event->base,
+		    client_accept_cb, worker,
+		    LEV_OPT_CLOSE_ON_FREE,
 		    cfg->backlog,
-		    la->ai_addr, la->ai_addrlen);
-		if (cfg->event->listener) break;
+		    fd);
+		if (worker->event->listener) break;
+		close(fd);
 	}
 	if (la == NULL) {
 		log_warn("connection", "unable to bind to [%s]:%s", addr, serv);
 		return -1;
 	}
-	evconnlistener_set_error_cb(cfg->event->listener, client_accept_error_cb);
-	log_info("connection", "listening to [%s]:%s", addr, serv);
+	evconnlistener_set_error_cb(worker->event->listener, client_accept_error_cb);
+	log_info("connection", "worker %u listening to [%s]:%s",
+	    worker->index, addr, serv);
 	return 0;
 }
-
-
-
-
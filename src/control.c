@@ -0,0 +1,632 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Control socket, served by the first worker. This is a minimal HTTP/1.0
+ * server: one GET request per connection, the connection is closed once
+ * the answer has been sent. The socket is either a UNIX socket (when the
+ * argument contains a slash) or a TCP socket (address:port). Answers are
+ * written with a bufferevent: a slow client never blocks the worker.
+ *
+ * Sessions are dumped as JSON lines. Each worker dumps its own sessions,
+ * RO_CONTROL_BATCH at a time, and gives them to the first worker through
+ * its mailbox. The next batch is only requested once the client has
+ * received most of the previous one. Between two batches, the position of
+ * the dump in the list of sessions is kept up to date by
+ * `control_forget()`.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <event2/bufferevent.h>
+#include <event2/buffer.h>
+#include <event2/listener.h>
+
+struct control_client {
+	TAILQ_ENTRY(control_client) next;
+	struct ro_cfg *cfg;
+	struct bufferevent *bev;
+	char *target;		/* Target of the request, once received */
+	struct control_dump *dump; /* Dump of sessions in progress */
+};
+
+struct control_dump {
+	TAILQ_ENTRY(control_dump) next;	  /* In the dumps of the first worker */
+	LIST_ENTRY(control_dump) cursors; /* In the dumps of the current worker */
+	struct control_client *client;	  /* NULL once the client is gone */
+	struct evbuffer *buffer;	  /* Sessions dumped by the last batch */
+	unsigned worker;		  /* Worker dumping its sessions */
+	bool started;			  /* The worker has started */
+	bool pending;			  /* A worker has the dump */
+	bool retry;			  /* Not given to the worker yet */
+	struct ro_local *cursor;	  /* Next session to examine */
+
+	/* Filters */
+	bool grouped;			  /* Only sessions of this group */
+	uint32_t group_id;
+	char addr[INET6_ADDRSTRLEN];	  /* Only sessions with this address */
+	int stalled;			  /* Only stalled (1) or not stalled (0) sessions */
+	size_t offset;			  /* Matching sessions to skip */
+	size_t limit;			  /* Matching sessions to dump */
+};
+
+static void
+control_dump_free(struct ro_cfg *cfg, struct control_dump *dump)
+{
+	TAILQ_REMOVE(&cfg->event->dumps, dump, next);
+	if (dump->buffer) evbuffer_free(dump->buffer);
+	free(dump);
+}
+
+/**
+ * Give a dump to the worker whose sessions are dumped. On error, the dump
+ * is given again later: once started, it can only be released by this
+ * worker, and its client, not read anymore, would never get an answer.
+ */
+static void
+control_dump_next(struct ro_cfg *cfg, struct control_dump *dump)
+{
+	struct timeval tv = { 0, RO_CONTROL_RETRY * 1000 };
+	dump->pending = true;
+	dump->retry = false;
+	if (event_dump(&cfg->worker[dump->worker], dump, false) == -1) {
+		dump->retry = true;
+		evtimer_add(cfg->event->dump_retry, &tv);
+	}
+}
+
+static void
+control_dump_retry(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_cfg *cfg = arg;
+	struct control_dump *dump;
+	TAILQ_FOREACH(dump, &cfg->event->dumps, next)
+	    if (dump->retry) control_dump_next(cfg, dump);
+}
+
+static void
+control_destroy(struct control_client *client)
+{
+	struct control_dump *dump = client->dump;
+	TAILQ_REMOVE(&client->cfg->event->clients, client, next);
+	if (dump) {
+		dump->client = NULL;
+		if (!dump->pending && !dump->started)
+			control_dump_free(client->cfg, dump);
+		else if (!dump->pending) {
+			/* Let the worker forget about it */
+			dump->limit = 0;
+			control_dump_next(client->cfg, dump);
+		}
+	}
+	bufferevent_free(client->bev);
+	free(client->target);
+	free(client);
+}
+
+static void
+control_sent(struct bufferevent *bev, void *arg)
+{
+	control_destroy(arg);
+}
+
+static void
+control_event(struct bufferevent *bev, short what, void *arg)
+{
+	if (what & BEV_EVENT_ERROR)
+		log_debug("control", "error on control connection: %s",
+		    evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+	control_destroy(arg);
+}
+
+/**
+ * Send an answer and close the connection once it has been sent.
+ */
+static void
+control_reply(struct control_client *client, const char *status,
+    const char *type, struct evbuffer *body)
+{
+	struct evbuffer *output = bufferevent_get_output(client->bev);
+	bufferevent_disable(client->bev, EV_READ);
+	bufferevent_setcb(client->bev, NULL, control_sent, control_event, client);
+	evbuffer_add_printf(output,
+	    "HTTP/1.0 %s\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n\r\n",
+	    status, type, body?evbuffer_get_length(body):0);
+	if (body) evbuffer_add_buffer(output, body);
+	bufferevent_enable(client->bev, EV_WRITE);
+}
+
+/**
+ * Request the next batch of sessions once the client has received most of
+ * the previous one.
+ */
+static void
+control_drained(struct bufferevent *bev, void *arg)
+{
+	struct control_client *client = arg;
+	struct control_dump *dump = client->dump;
+	if (dump && !dump->pending) control_dump_next(client->cfg, dump);
+}
+
+static void
+control_error(struct control_client *client, const char *status)
+{
+	struct evbuffer *body = evbuffer_new();
+	if (body) evbuffer_add_printf(body, "%s\n", status);
+	control_reply(client, status, "text/plain", body);
+	if (body) evbuffer_free(body);
+}
+
+static void
+control_metrics(struct control_client *client, const char *query)
+{
+	struct evbuffer *body = evbuffer_new();
+	if (body == NULL) {
+		control_error(client, "500 Internal Server Error");
+		return;
+	}
+	metrics_write(client->cfg, body);
+	control_reply(client, "200 OK", "text/plain; version=0.0.4", body);
+	evbuffer_free(body);
+}
+
+/**
+ * Parse a decimal number from the query string.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+control_number(const char *value, uint64_t max, uint64_t *result)
+{
+	char *end;
+	if (*value < '0' || *value > '9') return -1;
+	errno = 0;
+	unsigned long long n = strtoull(value, &end, 10);
+	if (errno != 0 || *end != '\0' || n > max) return -1;
+	*result = n;
+	return 0;
+}
+
+/**
+ * Dump sessions as JSON lines, one per session. The query string can
+ * contain `group`, `addr` (of the session or of one of its connections),
+ * `stalled` (0 or 1), `offset` and `limit`.
+ */
+static void
+control_sessions(struct control_client *client, const char *query)
+{
+	struct ro_cfg *cfg = client->cfg;
+	struct control_dump *dump;
+	char *params = NULL, *param, *last;
+	uint64_t n;
+	if ((dump = calloc(1, sizeof(struct control_dump))) == NULL ||
+	    (dump->buffer = evbuffer_new()) == NULL ||
+	    (params = strdup(query)) == NULL) {
+		if (dump && dump->buffer) evbuffer_free(dump->buffer);
+		free(dump);
+		control_error(client, "500 Internal Server Error");
+		return;
+	}
+	TAILQ_INSERT_TAIL(&cfg->event->dumps, dump, next);
+	dump->stalled = -1;
+	dump->limit = SIZE_MAX;
+	for (param = strtok_r(params, "&", &last);
+	     param != NULL;
+	     param = strtok_r(NULL, "&", &last)) {
+		char *value = strchr(param, '=');
+		if (value == NULL) goto invalid;
+		*value++ = '\0';
+		if (strcmp(param, "group") == 0) {
+			if (control_number(value, UINT32_MAX, &n) == -1) goto invalid;
+			dump->grouped = true;
+			dump->group_id = n;
+		} else if (strcmp(param, "addr") == 0) {
+			if (strlen(value) >= sizeof(dump->addr)) goto invalid;
+			strcpy(dump->addr, value);
+		} else if (strcmp(param, "stalled") == 0) {
+			if (control_number(value, 1, &n) == -1) goto invalid;
+			dump->stalled = n;
+		} else if (strcmp(param, "offset") == 0) {
+			if (control_number(value, SIZE_MAX, &n) == -1) goto invalid;
+			dump->offset = n;
+		} else if (strcmp(param, "limit") == 0) {
+			if (control_number(value, SIZE_MAX, &n) == -1) goto invalid;
+			dump->limit = n;
+		} else goto invalid;
+	}
+	free(params);
+
+	/* On the relay, the group ID tells the worker owning the session */
+	if (dump->grouped && cfg->role == ROLE_RELAY)
+		dump->worker = RO_GROUP_WORKER(dump->group_id);
+	if (dump->worker >= (unsigned)cfg->workers || dump->limit == 0) {
+		control_dump_free(cfg, dump);
+		control_reply(client, "200 OK", "application/x-ndjson", NULL);
+		return;
+	}
+
+	dump->client = client;
+	client->dump = dump;
+	bufferevent_disable(client->bev, EV_READ);
+	bufferevent_setcb(client->bev, NULL, control_drained, control_event, client);
+	bufferevent_setwatermark(client->bev, EV_WRITE, RO_CONTROL_WATERMARK, 0);
+	evbuffer_add_printf(bufferevent_get_output(client->bev),
+	    "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: application/x-ndjson\r\n"
+	    "Connection: close\r\n\r\n");
+	bufferevent_enable(client->bev, EV_WRITE);
+	control_dump_next(cfg, dump);
+	return;
+
+invalid:
+	free(params);
+	control_dump_free(cfg, dump);
+	control_error(client, "400 Bad Request");
+}
+
+static bool
+control_match(struct control_dump *dump, struct ro_local *local)
+{
+	struct ro_remote *remote;
+	bool stalled = false, addr = (dump->addr[0] == '\0');
+	if (dump->grouped && local->group_id != dump->group_id)
+		return false;
+	if (!addr && strcmp(local->addr, dump->addr) == 0)
+		addr = true;
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (remote->event->stalled) stalled = true;
+		if (!addr && strcmp(remote->raddr, dump->addr) == 0)
+			addr = true;
+	}
+	if (dump->stalled != -1 && stalled != (dump->stalled == 1))
+		return false;
+	return addr;
+}
+
+static void
+control_dump_local(struct evbuffer *out, struct ro_worker *worker,
+    struct ro_local *local)
+{
+	struct ro_remote *remote;
+	bool stalled = false;
+	TAILQ_FOREACH(remote, &local->remotes, next)
+	    if (remote->event->stalled) stalled = true;
+	evbuffer_add_printf(out,
+	    "{\"worker\":%u,\"group\":%" PRIu32 ",", worker->index, local->group_id);
+	if (local->keyed)
+		evbuffer_add_printf(out, "\"key\":\"%016" PRIx64 "%016" PRIx64 "\",",
+		    local->group_key[0], local->group_key[1]);
+	evbuffer_add_printf(out,
+	    "\"addr\":\"%s\",\"port\":\"%s\",\"connected\":%s,"
+	    "\"version\":%u,\"in\":%zu,\"out\":%zu,"
+	    "\"read_pipe\":%zu,\"write_pipe\":%zu,"
+	    "\"parked\":%zu,\"reordered\":%zu,\"reorder_full\":%zu,"
+	    "\"busy\":%zu,\"lost\":%zu,\"stalled\":%s,"
+	    "\"eof\":%s,\"peer_eof\":%s,\"remotes\":[",
+	    local->addr, local->serv, local->connected?"true":"false",
+	    local->event->version, local->stats.in, local->stats.out,
+	    local->event->pipe.nr, local->event->pipe.nw,
+	    local->event->parked, local->stats.reordered, local->stats.reorder_full,
+	    local->stats.busy, local->stats.lost, stalled?"true":"false",
+	    local->event->eof?"true":"false", local->event->peer_eof?"true":"false");
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		evbuffer_add_printf(out,
+		    "%s{\"laddr\":\"%s\",\"lport\":\"%s\","
+		    "\"raddr\":\"%s\",\"rport\":\"%s\",\"connected\":%s,"
+		    "\"lost\":%s,\"retiring\":%s,\"in\":%zu,\"out\":%zu,"
+		    "\"sending\":%" PRIu32 ",\"parked\":%zu,\"stalled\":%s,"
+		    "\"rtt\":%" PRIu32 ",\"cwnd\":%" PRIu32 ",\"notsent\":%" PRIu32 "}",
+		    (remote == TAILQ_FIRST(&local->remotes))?"":",",
+		    remote->laddr, remote->lserv, remote->raddr, remote->rserv,
+		    remote->connected?"true":"false",
+		    remote->event->lost?"true":"false",
+		    remote->event->retiring?"true":"false",
+		    remote->stats.in, remote->stats.out,
+		    remote->event->send_bytes, remote->event->parked,
+		    remote->event->stalled?"true":"false",
+		    remote->path.rtt, remote->path.cwnd, remote->path.notsent);
+	}
+	evbuffer_add_printf(out, "]");
+	latency_json(out, local);
+	evbuffer_add_printf(out, "}\n");
+}
+
+/**
+ * Dump a batch of our sessions and give the dump back to the first worker.
+ * Run by the worker owning the sessions.
+ */
+void
+control_dump_run(struct ro_worker *worker, struct control_dump *dump)
+{
+	struct ro_cfg *cfg = worker->cfg;
+	struct ro_local *local;
+	if (!dump->started) {
+		dump->started = true;
+		dump->cursor = TAILQ_FIRST(&worker->locals);
+		LIST_INSERT_HEAD(&worker->event->dumps, dump, cursors);
+		if (dump->grouped && cfg->role == ROLE_RELAY) {
+			/* The index of groups gives the session */
+			dump->cursor = NULL;
+			local = group_find(worker, dump->group_id);
+			if (local && control_match(dump, local) && dump->limit > 0 &&
+			    dump->offset == 0)
+				control_dump_local(dump->buffer, worker, local);
+			dump->limit = 0;
+		}
+	}
+	for (int i = 0;
+	     dump->cursor != NULL && dump->limit > 0 && i < RO_CONTROL_BATCH;
+	     i++) {
+		local = dump->cursor;
+		dump->cursor = TAILQ_NEXT(local, next);
+		if (!control_match(dump, local)) continue;
+		if (dump->offset > 0) {
+			dump->offset--;
+			continue;
+		}
+		control_dump_local(dump->buffer, worker, local);
+		dump->limit--;
+	}
+	if (dump->cursor == NULL || dump->limit == 0) {
+		/* Done with this worker */
+		LIST_REMOVE(dump, cursors);
+		dump->cursor = NULL;
+		dump->started = false;
+		dump->worker = (dump->limit == 0)?
+		    (unsigned)cfg->workers:(dump->worker + 1);
+	}
+	if (event_dump(&cfg->worker[0], dump, true) == -1)
+		log_warnx("control", "unable to give back dump of sessions");
+}
+
+/**
+ * Send the sessions dumped by a worker. Run by the first worker.
+ */
+void
+control_dump_ready(struct ro_cfg *cfg, struct control_dump *dump)
+{
+	struct control_client *client = dump->client;
+	bool done = (dump->worker >= (unsigned)cfg->workers);
+	dump->pending = false;
+	if (client == NULL) {
+		/* The client is gone */
+		if (done || !dump->started) control_dump_free(cfg, dump);
+		else {
+			dump->limit = 0;
+			control_dump_next(cfg, dump);
+		}
+		return;
+	}
+	struct evbuffer *output = bufferevent_get_output(client->bev);
+	evbuffer_add_buffer(output, dump->buffer);
+	if (done) {
+		client->dump = NULL;
+		control_dump_free(cfg, dump);
+		if (evbuffer_get_length(output) == 0) {
+			control_destroy(client);
+			return;
+		}
+		bufferevent_setwatermark(client->bev, EV_WRITE, 0, 0);
+		bufferevent_setcb(client->bev, NULL, control_sent, control_event, client);
+		return;
+	}
+	if (evbuffer_get_length(output) <= RO_CONTROL_WATERMARK)
+		control_dump_next(cfg, dump);
+}
+
+/**
+ * Keep the dumps of sessions in progress away from a session about to be
+ * destroyed.
+ */
+void
+control_forget(struct ro_worker *worker, struct ro_local *local)
+{
+	struct control_dump *dump;
+	LIST_FOREACH(dump, &worker->event->dumps, cursors)
+	    if (dump->cursor == local) dump->cursor = TAILQ_NEXT(local, next);
+}
+
+static const struct {
+	const char *path;
+	void (*handle)(struct control_client *, const char *);
+} control_routes[] = {
+	{ "/metrics", control_metrics },
+	{ "/sessions", control_sessions },
+	{ NULL, NULL }
+};
+
+static void
+control_dispatch(struct control_client *client)
+{
+	char *query = strchr(client->target, '?');
+	if (query) *query++ = '\0';
+	log_debug("control", "request for %s", client->target);
+	for (int i = 0; control_routes[i].path; i++) {
+		if (strcmp(control_routes[i].path, client->target) == 0) {
+			control_routes[i].handle(client, query?query:"");
+			return;
+		}
+	}
+	control_error(client, "404 Not Found");
+}
+
+/**
+ * Read the request line, then skip headers until the empty line.
+ */
+static void
+control_read(struct bufferevent *bev, void *arg)
+{
+	struct control_client *client = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	char *line;
+	while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_CRLF)) != NULL) {
+		if (client->target == NULL) {
+			char *method = strtok(line, " "), *target = strtok(NULL, " ");
+			if (method == NULL || target == NULL) {
+				free(line);
+				control_error(client, "400 Bad Request");
+				return;
+			}
+			if (strcmp(method, "GET") != 0) {
+				free(line);
+				control_error(client, "405 Method Not Allowed");
+				return;
+			}
+			client->target = strdup(target);
+			free(line);
+			if (client->target == NULL) {
+				control_error(client, "500 Internal Server Error");
+				return;
+			}
+			continue;
+		}
+		bool end = (*line == '\0');
+		free(line);
+		if (end) {
+			control_dispatch(client);
+			return;
+		}
+	}
+	if (evbuffer_get_length(input) > RO_CONTROL_REQUEST)
+		control_error(client, "413 Request Entity Too Large");
+}
+
+static void
+control_accept(struct evconnlistener *listener,
+    evutil_socket_t fd, struct sockaddr *addr, int len, void *arg)
+{
+	struct ro_cfg *cfg = arg;
+	struct event_base *base = evconnlistener_get_base(listener);
+	struct control_client *client = NULL;
+	struct timeval tv = { RO_CONTROL_TIMEOUT, 0 };
+	if ((client = calloc(1, sizeof(struct control_client))) == NULL ||
+	    (client->bev = bufferevent_socket_new(base, fd,
+		BEV_OPT_CLOSE_ON_FREE)) == NULL) {
+		log_warnx("control", "unable to allocate control connection");
+		free(client);
+		close(fd);
+		return;
+	}
+	client->cfg = cfg;
+	TAILQ_INSERT_TAIL(&cfg->event->clients, client, next);
+	bufferevent_setcb(client->bev, control_read, NULL, control_event, client);
+	bufferevent_set_timeouts(client->bev, &tv, &tv);
+	bufferevent_enable(client->bev, EV_READ);
+}
+
+static void
+control_accept_error(struct evconnlistener *listener, void *arg)
+{
+	int err = EVUTIL_SOCKET_ERROR();
+	log_warnx("control", "unable to accept control connection: %s",
+	    evutil_socket_error_to_string(err));
+}
+
+/**
+ * Listen on the control socket with the event base of the first worker.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+control_listen(struct ro_cfg *cfg)
+{
+	struct sockaddr_storage addr = {};
+	int len = sizeof(addr), fd = -1;
+	bool local = (strchr(cfg->control, '/') != NULL);
+	TAILQ_INIT(&cfg->event->clients);
+	TAILQ_INIT(&cfg->event->dumps);
+	if ((cfg->event->dump_retry = evtimer_new(cfg->worker[0].event->base,
+		    control_dump_retry, cfg)) == NULL) {
+		log_warnx("control", "unable to create timer for dumps of sessions");
+		return -1;
+	}
+	if (local) {
+		struct sockaddr_un *sun = (struct sockaddr_un *)&addr;
+		if (strlen(cfg->control) >= sizeof(sun->sun_path)) {
+			log_warnx("control", "path of control socket %s is too long",
+			    cfg->control);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, cfg->control);
+		len = sizeof(*sun);
+		unlink(cfg->control);	/* Left by a previous instance */
+	} else if (evutil_parse_sockaddr_port(cfg->control,
+		(struct sockaddr *)&addr, &len) == -1) {
+		log_warnx("control", "invalid address for control socket: %s",
+		    cfg->control);
+		return -1;
+	}
+	if ((fd = socket(addr.ss_family, SOCK_STREAM, 0)) == -1 ||
+	    evutil_make_socket_nonblocking(fd) == -1 ||
+	    (!local && evutil_make_listen_socket_reuseable(fd) == -1) ||
+	    bind(fd, (struct sockaddr *)&addr, len) == -1 ||
+	    (local && chmod(cfg->control, S_IRUSR|S_IWUSR) == -1)) {
+		log_warn("control", "unable to bind control socket %s",
+		    cfg->control);
+		if (fd != -1) close(fd);
+		return -1;
+	}
+	if ((cfg->event->control = evconnlistener_new(cfg->worker[0].event->base,
+		    control_accept, cfg,
+		    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC,
+		    cfg->backlog, fd)) == NULL) {
+		log_warn("control", "unable to listen on control socket %s",
+		    cfg->control);
+		close(fd);
+		return -1;
+	}
+	evconnlistener_set_error_cb(cfg->event->control, control_accept_error);
+	log_info("control", "control socket listening on %s", cfg->control);
+	return 0;
+}
+
+/**
+ * Close the control socket and its connections.
+ */
+void
+control_free(struct ro_cfg *cfg)
+{
+	struct control_client *client;
+	struct control_dump *dump;
+	if (cfg->event->dump_retry) {
+		event_free(cfg->event->dump_retry);
+		cfg->event->dump_retry = NULL;
+	}
+	if (cfg->event->control == NULL) return;
+	/* Workers are stopped, dumps can be freed whatever their state */
+	while ((dump = TAILQ_FIRST(&cfg->event->dumps)) != NULL) {
+		if (dump->started) LIST_REMOVE(dump, cursors);
+		if (dump->client) dump->client->dump = NULL;
+		control_dump_free(cfg, dump);
+	}
+	while ((client = TAILQ_FIRST(&cfg->event->clients)) != NULL)
+		control_destroy(client);
+	evconnlistener_free(cfg->event->control);
+	cfg->event->control = NULL;
+	if (strchr(cfg->control, '/') != NULL) unlink(cfg->control);
+}
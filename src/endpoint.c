@@ -21,6 +21,7 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <string.h>
+#include <netinet/tcp.h>
 
 /**
  * Dump information about a remote.
@@ -28,23 +29,40 @@
 void
 remote_debug(struct ro_remote *remote)
 {
+	struct ro_zerocopy *zc = remote->event->send.zerocopy;
 	log_info("endpoint",
 	    "remote [%s]:%s <-> [%s]:%s:\n"
 	    "  connected: %s\n"
 	    "  in:        %-10zu bytes   out: %-10zu bytes\n"
 	    "  read:      %-10s       write: %-10s\n"
-	    "  header: %zu (out of %zu)\n"
-	    "  serial: %"PRIu16"\n"
-	    "  to receive: %"PRIu32" bytes\n",
+	    "  header: %s (%zu bytes)\n"
+	    "  sequence: %"PRIu64"\n"
+	    "  to receive: %"PRIu32" bytes\n"
+	    "  to send: %"PRIu32" bytes (frame of %"PRIu32" bytes, %"PRIu32" not moved yet, sequence %"PRIu64")\n"
+	    "  reorder: %zu bytes parked%s\n"
+	    "  replay: %zu bytes not acknowledged\n"
+	    "  path: rtt %"PRIu32" µs, cwnd %"PRIu32", unacked %"PRIu32", not sent %"PRIu32" bytes\n"
+	    "  zerocopy: %zu bytes (%zu copied by the kernel), %zu bytes pinned\n",
 	    remote->laddr, remote->lserv,
 	    remote->raddr, remote->rserv,
-	    remote->connected?"yes":"no",
+	    remote->connected?(remote->event->retiring?"yes, closing":"yes"):
+	    (remote->event->lost?"no, lost":"no"),
 	    remote->stats.in, remote->stats.out,
 	    event_pending(remote->event->read, EV_READ, NULL)?"wait":"no",
 	    event_pending(remote->event->write, EV_WRITE, NULL)?"wait":"no",
-	    remote->event->partial_bytes, RO_HEADER_SIZE,
-	    remote->event->receive_serial,
-	    remote->event->remaining_bytes);
+	    remote->event->framed?"received":"partial", remote->event->partial_bytes,
+	    remote->event->receive_seq,
+	    remote->event->remaining_bytes,
+	    remote->event->send_bytes,
+	    remote->event->send_frame,
+	    remote->event->send_fill,
+	    remote->event->send_seq,
+	    remote->event->parked,
+	    remote->event->stalled?", stalled":"",
+	    remote->event->replay?remote->event->replay->bytes:0,
+	    remote->path.rtt, remote->path.cwnd,
+	    remote->path.unacked, remote->path.notsent,
+	    zc?zc->sent:0, zc?zc->copied:0, zc?zc->pinned:0);
 }
 
 /**
@@ -53,46 +71,62 @@ remote_debug(struct ro_remote *remote)
 void
 local_debug(struct ro_local *local)
 {
+	struct ro_replay *replay;
+	size_t resend = 0;
+	TAILQ_FOREACH(replay, &local->event->resend, next)
+	    resend += replay->bytes;
 	log_info("endpoint",
 	    "local [%s]:%s:\n"
 	    "  connected: %s\n"
 	    "  in:        %-10zu bytes   out: %-10zu bytes\n"
 	    "\n"
 	    "  socket:     read:  %-7s    write: %-7s\n"
-	    "  read pipe:  bytes: %-10zu\n"
-	    "  write pipe: bytes: %-10zu\n"
+	    "  read pipe:  bytes: %-10zu size: %-10zu\n"
+	    "  write pipe: bytes: %-10zu size: %-10zu\n"
 	    "\n"
-	    "  remote: sending [%s]%s%s <-> [%s]%s%s, receiving [%s]%s%s <-> [%s]%s%s\n"
-	    "  serial: sending %"PRIu16", receiving %"PRIu16"\n"
-	    "  to receive: %"PRIu32" bytes (+ %zu bytes of header)\n",
+	    "  remote: receiving [%s]%s%s <-> [%s]%s%s\n"
+	    "  protocol: version %u%s%s\n"
+	    "  sequence: sending %"PRIu64", receiving %"PRIu64"\n"
+	    "  reorder: %zu bytes parked, %zu frames waited (avg %"PRIu64" µs, max %"PRIu64" µs), full %zu times\n"
+	    "  replay: %zu bytes to send again, %zu connection(s) lost, acknowledged %"PRIu64"\n",
 	    local->addr, local->serv,
 	    local->connected?"yes":"no",
 	    local->stats.in, local->stats.out,
 	    event_pending(local->event->read, EV_READ, NULL)?"wait":"no",
 	    event_pending(local->event->write, EV_WRITE, NULL)?"wait":"no",
 	    local->event->pipe.nr,
+	    local->cfg->engine->capacity(&local->event->pipe.read),
 	    local->event->pipe.nw,
-	    local->event->current_send_remote?local->event->current_send_remote->laddr:"none",
-	    local->event->current_send_remote?":":"",
-	    local->event->current_send_remote?local->event->current_send_remote->lserv:"",
-	    local->event->current_send_remote?local->event->current_send_remote->raddr:"none",
-	    local->event->current_send_remote?":":"",
-	    local->event->current_send_remote?local->event->current_send_remote->rserv:"",
+	    local->cfg->engine->capacity(&local->event->pipe.write),
 	    local->event->current_receive_remote?local->event->current_receive_remote->laddr:"none",
 	    local->event->current_receive_remote?":":"",
 	    local->event->current_receive_remote?local->event->current_receive_remote->lserv:"",
 	    local->event->current_receive_remote?local->event->current_receive_remote->raddr:"none",
 	    local->event->current_receive_remote?":":"",
 	    local->event->current_receive_remote?local->event->current_receive_remote->rserv:"",
-	    local->event->send_serial, local->event->receive_serial,
-	    local->event->remaining_bytes,
-	    RO_HEADER_SIZE - local->event->partial_bytes);
+	    local->event->version,
+	    local->event->close_queued?", CLOSE sent":"",
+	    local->event->peer_eof?", CLOSE received":"",
+	    local->event->send_next, local->event->receive_next,
+	    local->event->parked, local->stats.reordered,
+	    local->stats.reordered?(local->stats.reorder_wait / local->stats.reordered):0,
+	    local->stats.reorder_max, local->stats.reorder_full,
+	    resend, local->stats.lost, local->event->peer_window);
 
 	struct ro_remote *remote;
+	latency_debug(local);
 	TAILQ_FOREACH(remote, &local->remotes, next)
 	    remote_debug(remote);
 }
 
+static void
+endpoint_event_close(struct ro_worker *worker, struct event *event)
+{
+	if (event == NULL) return;
+	close(event_get_fd(event));
+	slab_event_free(worker, event);
+}
+
 /**
  * Destroy a remote endpoint
  */
@@ -101,20 +135,49 @@ remote_destroy(struct ro_remote *remote)
 {
 	if (!remote) return;
 	struct ro_local *local = remote->local;
+	struct ro_worker *worker = local->worker;
 	log_debug("endpoint", "destroy remote [%s]:%s <-> [%s]:%s",
 	    remote->laddr, remote->lserv,
 	    remote->raddr, remote->rserv);
 
 	if (remote->event) {
-		event_close_and_free(remote->event->read);
-		event_close_and_free(remote->event->write);
-		free(remote->event);
+		struct parked_frame *frame;
+		while ((frame = TAILQ_FIRST(&remote->event->frames)) != NULL) {
+			TAILQ_REMOVE(&remote->event->frames, frame, next);
+			free(frame);
+		}
+		struct ro_zerocopy *zc = remote->event->send.zerocopy;
+		if (zc)
+			log_debug("endpoint", "remote [%s]:%s <-> [%s]:%s: "
+			    "%zu bytes sent with zerocopy, %zu copied by the kernel",
+			    remote->laddr, remote->lserv,
+			    remote->raddr, remote->rserv,
+			    zc->sent, zc->copied);
+		/* The socket may be kept for pending zerocopy sends */
+		bool lingering = zerocopy_linger(worker, &remote->event->send);
+		slab_buffer_free(worker, &remote->event->park);
+		slab_buffer_free(worker, &remote->event->send);
+		slab_buffer_free(worker, &remote->event->in);
+		replay_free(worker, remote->event->replay);
+		local->event->parked -= remote->event->parked;
+		slab_event_free(worker, remote->event->write);
+		if (lingering) slab_event_free(worker, remote->event->read);
+		else endpoint_event_close(worker, remote->event->read);
+		slab_put(worker, SLAB_REMOTE_PRIVATE, remote->event);
 	}
 
-	if (remote->next.tqe_prev != NULL &&
-	    remote->next.tqe_next != NULL)
+	/* Don't leave references to this remote */
+	if (local->event) {
+		if (local->event->last_send_remote == remote)
+			local->event->last_send_remote = NULL;
+		if (local->event->filling == remote)
+			local->event->filling = NULL;
+		if (local->event->current_receive_remote == remote)
+			local->event->current_receive_remote = NULL;
+	}
+	if (remote->next.tqe_prev != NULL)
 		TAILQ_REMOVE(&local->remotes, remote, next);
-	free(remote);
+	slab_put(worker, SLAB_REMOTE, remote);
 }
 
 /**
@@ -124,7 +187,7 @@ void
 local_destroy(struct ro_local *local)
 {
 	if (!local) return;
-	struct ro_cfg *cfg = local->cfg;
+	struct ro_worker *worker = local->worker;
 	log_debug("endpoint", "destroy local [%s]:%s",
 	    local->addr, local->serv);
 
@@ -138,28 +201,41 @@ local_destroy(struct ro_local *local)
 	}
 
 	if (local->event) {
-		if (local->event->pipe.read[0] != -1) close(local->event->pipe.read[0]);
-		if (local->event->pipe.read[1] != -1) close(local->event->pipe.read[1]);
-		if (local->event->pipe.write[0] != -1) close(local->event->pipe.write[0]);
-		if (local->event->pipe.write[1] != -1) close(local->event->pipe.write[1]);
-		event_close_and_free(local->event->read);
-		event_close_and_free(local->event->write);
-		free(local->event);
+		struct ro_replay *replay;
+		while ((replay = TAILQ_FIRST(&local->event->resend)) != NULL) {
+			TAILQ_REMOVE(&local->event->resend, replay, next);
+			replay_free(worker, replay);
+		}
+		slab_buffer_free(worker, &local->event->pipe.read);
+		slab_buffer_free(worker, &local->event->pipe.write);
+		slab_event_free(worker, local->event->write);
+		endpoint_event_close(worker, local->event->read);
+		slab_event_free(worker, local->event->sample);
+		slab_event_free(worker, local->event->hold);
+		slab_event_free(worker, local->event->sizing);
+		slab_event_free(worker, local->event->adapt);
+		slab_event_free(worker, local->event->reap);
+		slab_event_free(worker, local->event->ack);
+		slab_event_free(worker, local->event->orphan);
+		slab_put(worker, SLAB_LOCAL_PRIVATE, local->event);
 	}
 
-	if (local->next.tqe_prev != NULL &&
-	    local->next.tqe_prev != NULL)
-		TAILQ_REMOVE(&cfg->locals, local, next);
-	free(local);
+	if (local->next.tqe_prev != NULL) {
+		control_forget(worker, local);
+		TAILQ_REMOVE(&worker->locals, local, next);
+	}
+	group_remove(local);
+	free(local->latency);
+	slab_put(worker, SLAB_LOCAL, local);
 }
 
 int
-endpoint_connect(struct addrinfo *rem,
+endpoint_connect(struct addrinfo *rem, bool fastopen,
     char laddr[static INET6_ADDRSTRLEN], char lserv[static SERVSTRLEN],
     char raddr[static INET6_ADDRSTRLEN], char rserv[static SERVSTRLEN])
 {
 	int sfd = -1;
-	int err;
+	int err, one = 1;
 	struct addrinfo *re;
 	for (re = rem; re != NULL; re = re->ai_next) {
 		getnameinfo(re->ai_addr, re->ai_addrlen,
@@ -170,6 +246,13 @@ endpoint_connect(struct addrinfo *rem,
 		if ((sfd = socket(re->ai_family, re->ai_socktype, re->ai_protocol)) == -1)
 			continue;
 		evutil_make_socket_nonblocking(sfd);
+		/* With a cookie, connect() returns at once and the first
+		 * write is sent with the SYN. */
+		if (fastopen &&
+		    setsockopt(sfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+			&one, sizeof(one)) == -1)
+			log_debug("endpoint", "unable to use TCP Fast Open with [%s]:%s: %s",
+			    raddr, rserv, strerror(errno));
 		while ((err = 0, connect(sfd, re->ai_addr, re->ai_addrlen)) == -1) {
 			if (errno == EINTR) continue;
 			if (errno == EINPROGRESS) break; /* async connect */
@@ -206,14 +289,13 @@ remote_init(struct ro_cfg *cfg, struct ro_local *local, int sfd,
     char laddr[static INET6_ADDRSTRLEN], char lserv[static SERVSTRLEN],
     char raddr[static INET6_ADDRSTRLEN], char rserv[static SERVSTRLEN])
 {
-	struct ro_remote *remote = calloc(1, sizeof(struct ro_remote));
+	struct ro_worker *worker = local->worker;
+	struct ro_remote *remote = slab_get(worker, SLAB_REMOTE);
 	if (remote == NULL) {
 		log_warn("remote", "unable to allocate memory for new remote");
 		goto error;
 	}
 
-	int sfd2 = -1;
-
 	remote->cfg = cfg;
 	remote->local = local;
 	memcpy(remote->laddr, laddr, sizeof(remote->laddr));
@@ -221,21 +303,24 @@ remote_init(struct ro_cfg *cfg, struct ro_local *local, int sfd,
 	memcpy(remote->raddr, raddr, sizeof(remote->raddr));
 	memcpy(remote->rserv, rserv, sizeof(remote->rserv));
 
-	sfd2 = dup(sfd);
-	log_debug("endpoint", "new remote setup (socket=%d/%d)",
-	    sfd, sfd2);
+	log_debug("endpoint", "new remote setup (socket=%d)", sfd);
 
-	if (sfd2 == -1 ||
-	    (remote->event = calloc(1, sizeof(struct remote_private))) == NULL ||
-	    (remote->event->read = event_new(cfg->event->base, sfd,
+	if ((remote->event = slab_get(worker, SLAB_REMOTE_PRIVATE)) == NULL) {
+		log_warn("remote", "unable to allocate memory for new remote");
+		goto error;
+	}
+	TAILQ_INIT(&remote->event->frames);
+	remote->event->joined = local->stats.lost;
+
+	/* Both events share the socket, the read event owns it */
+	if ((remote->event->read = slab_event_new(worker, sfd,
 		EV_READ|EV_PERSIST,
 		remote_data_cb,
 		remote)) == NULL ||
-	    ((sfd = -1, remote->event->write = event_new(cfg->event->base, sfd2,
+	    ((remote->event->write = slab_event_new(worker, sfd,
 		    EV_WRITE|EV_PERSIST,
 		    remote_data_cb,
-		    remote))) == NULL ||
-	    ((sfd2 = -1, 0))) {
+		    remote)), sfd = -1, remote->event->write == NULL)) {
 		log_warnx("remote", "unable to allocate events for new remote");
 		goto error;
 	}
@@ -243,7 +328,6 @@ remote_init(struct ro_cfg *cfg, struct ro_local *local, int sfd,
 
 error:
 	if (sfd != -1) close(sfd);
-	if (sfd2 != -1) close(sfd2);
 	remote_destroy(remote);
 	return NULL;
 }
@@ -255,14 +339,12 @@ error:
  *           file descriptor if needed, even in case of error.
  */
 struct ro_local *
-local_init(struct ro_cfg *cfg, int fd,
+local_init(struct ro_worker *worker, int fd,
     char addr[static INET6_ADDRSTRLEN], char serv[static SERVSTRLEN])
 {
-	int pipe_read[2] = { -1, -1 };
-	int pipe_write[2] = { -1, -1 };
-	int fd2 = -1;
+	struct ro_cfg *cfg = worker->cfg;
 
-	struct ro_local *local = calloc(1, sizeof(struct ro_local));
+	struct ro_local *local = slab_get(worker, SLAB_LOCAL);
 	if (local == NULL) {
 		log_warn("local", "unable to allocate memory for new local endpoint [%s]:%s",
 		    addr, serv);
@@ -270,54 +352,105 @@ local_init(struct ro_cfg *cfg, int fd,
 	}
 	TAILQ_INIT(&local->remotes);
 	local->cfg = cfg;
+	local->worker = worker;
 	memcpy(local->addr, addr, INET6_ADDRSTRLEN);
 	memcpy(local->serv, serv, SERVSTRLEN);
 
-	if (pipe(pipe_read) == -1 ||
-	    pipe(pipe_write) == -1 ||
-	    (fd2 = dup(fd)) == -1) {
-		log_warn("local", "unable to setup additional file descriptors");
+	if ((local->event = slab_get(worker, SLAB_LOCAL_PRIVATE)) == NULL) {
+		log_warn("local", "unable to allocate memory for new local endpoint [%s]:%s",
+		    addr, serv);
+		goto error;
+	}
+	TAILQ_INIT(&local->event->resend);
+	if (slab_buffer_init(worker, &local->event->pipe.read, 0) == -1 ||
+	    slab_buffer_init(worker, &local->event->pipe.write, 0) == -1) {
+		log_warn("local", "unable to setup buffers");
+		goto error;
+	}
+	if (cfg->latency &&
+	    (local->latency = calloc(1, sizeof(struct ro_latency))) == NULL) {
+		log_warn("local", "unable to allocate latency histograms");
 		goto error;
 	}
-	evutil_make_socket_nonblocking(pipe_read[0]);
-	evutil_make_socket_nonblocking(pipe_read[1]);
-	evutil_make_socket_nonblocking(pipe_write[0]);
-	evutil_make_socket_nonblocking(pipe_write[1]);
 
-	log_debug("endpoint", "new local endpoint setup (socket=%d/%d, pipe_read=(%d,%d), pipe_write=(%d, %d))",
-	    fd, fd2, pipe_read[0], pipe_read[1], pipe_write[0], pipe_write[1]);
+	log_debug("endpoint", "new local endpoint setup (socket=%d, engine %s)",
+	    fd, cfg->engine->name);
 
-	if ((local->event = calloc(1, sizeof(struct local_private))) == NULL ||
-	    (local->event->pipe.read[0] = local->event->pipe.read[1] =
-		local->event->pipe.write[0] = local->event->pipe.write[1] = -1, 0) ||
-	    (local->event->read = event_new(cfg->event->base, fd,
+	/* Both events share the socket, the read event owns it */
+	if ((local->event->read = slab_event_new(worker, fd,
 		EV_READ|EV_PERSIST,
 		local_data_cb,
 		local)) == NULL ||
-	    ((fd = -1, local->event->write = event_new(cfg->event->base, fd2,
+	    ((local->event->write = slab_event_new(worker, fd,
 		    EV_WRITE|EV_PERSIST,
 		    local_data_cb,
-		    local))) == NULL ||
-	    ((fd2 = -1, 0))) {
+		    local)), fd = -1, local->event->write == NULL)) {
 		log_warnx("local", "unable to allocate events for new local endpoint [%s]:%s",
 		    addr, serv);
 		goto error;
 	}
 
-	local->event->pipe.read[0] = pipe_read[0];
-	local->event->pipe.read[1] = pipe_read[1];
-	local->event->pipe.write[0] = pipe_write[0];
-	local->event->pipe.write[1] = pipe_write[1];
+	if (cfg->min_frame > 0 && cfg->frame_delay > 0 &&
+	    (local->event->hold = slab_event_new(worker, -1, 0,
+		local_hold_cb, local)) == NULL) {
+		log_warnx("local", "unable to setup hold timer for [%s]:%s",
+		    addr, serv);
+		local_destroy(local);
+		return NULL;
+	}
+	if (cfg->scheduler->sampling) {
+		struct timeval tv = {
+			.tv_sec = RO_SAMPLE_INTERVAL / 1000,
+			.tv_usec = (RO_SAMPLE_INTERVAL % 1000) * 1000
+		};
+		if ((local->event->sample = slab_event_new(worker, -1,
+			    EV_PERSIST,
+			    scheduler_sample_cb,
+			    local)) == NULL ||
+		    event_add(local->event->sample, &tv) == -1) {
+			log_warnx("local", "unable to setup sampling timer for [%s]:%s",
+			    addr, serv);
+			local_destroy(local);
+			return NULL;
+		}
+	}
+	if (cfg->max_pipe > 0 && cfg->engine->resize) {
+		struct timeval tv = {
+			.tv_sec = RO_SIZING_INTERVAL / 1000,
+			.tv_usec = (RO_SIZING_INTERVAL % 1000) * 1000
+		};
+		if ((local->event->sizing = slab_event_new(worker, -1,
+			    EV_PERSIST,
+			    sizing_cb,
+			    local)) == NULL ||
+		    event_add(local->event->sizing, &tv) == -1) {
+			log_warnx("local", "unable to setup sizing timer for [%s]:%s",
+			    addr, serv);
+			local_destroy(local);
+			return NULL;
+		}
+	}
+	if (cfg->role == ROLE_PROXY && cfg->adaptive) {
+		struct timeval tv = {
+			.tv_sec = RO_ADAPT_INTERVAL / 1000,
+			.tv_usec = (RO_ADAPT_INTERVAL % 1000) * 1000
+		};
+		if ((local->event->adapt = slab_event_new(worker, -1,
+			    EV_PERSIST,
+			    connection_adapt_cb,
+			    local)) == NULL ||
+		    event_add(local->event->adapt, &tv) == -1) {
+			log_warnx("local", "unable to setup adaptation timer for [%s]:%s",
+			    addr, serv);
+			local_destroy(local);
+			return NULL;
+		}
+	}
 
 	return local;
 
 error:
 	if (fd != -1) close(fd);
-	if (fd2 != -1) close(fd2);
-	if (pipe_read[0] != -1) close(pipe_read[0]);
-	if (pipe_read[1] != -1) close(pipe_write[1]);
-	if (pipe_write[0] != -1) close(pipe_read[0]);
-	if (pipe_write[1] != -1) close(pipe_write[1]);
 	local_destroy(local);
 	return NULL;
 }
@@ -0,0 +1,744 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+
+/* Engines move bytes between sockets and buffers. The state machine in
+ * `forward.c` only deals with buffers and byte counts.
+ *
+ * All operations return the number of bytes moved or -1 with errno set:
+ *  - EAGAIN: nothing to read from the source (socket or buffer) or the
+ *            destination socket cannot accept more data
+ *  - ENOBUFS: the destination buffer is full
+ * When reading from a socket, 0 means the connection was closed. */
+
+/**
+ * Tell if some data is waiting to be read on a socket. This is used to know
+ * why a splice from a socket to a pipe would block.
+ */
+static bool
+socket_readable(int fd)
+{
+	int avail = 0;
+	return (ioctl(fd, FIONREAD, &avail) == 0 && avail > 0);
+}
+
+/* Splice engine: buffers are pipes, data never goes through userland. */
+
+static int
+splice_init(struct ro_buffer *buffer, size_t size)
+{
+	if (pipe(buffer->pipe) == -1)
+		return -1;
+	evutil_make_socket_nonblocking(buffer->pipe[0]);
+	evutil_make_socket_nonblocking(buffer->pipe[1]);
+#ifdef F_SETPIPE_SZ
+	/* Best effort, callers cope with a smaller pipe */
+	if (size > 0 && fcntl(buffer->pipe[1], F_SETPIPE_SZ, size) == -1)
+		log_debug("engine", "unable to resize pipe to %zu bytes", size);
+#endif
+#ifdef F_GETPIPE_SZ
+	int actual = fcntl(buffer->pipe[0], F_GETPIPE_SZ);
+	buffer->size = (actual > 0)?actual:RO_PIPE_MIN;
+#else
+	buffer->size = RO_PIPE_MIN;
+#endif
+	buffer->ready = true;
+	return 0;
+}
+
+static void
+splice_free(struct ro_buffer *buffer)
+{
+	if (!buffer->ready) return;
+	close(buffer->pipe[0]);
+	close(buffer->pipe[1]);
+	buffer->ready = false;
+}
+
+static size_t
+splice_capacity(struct ro_buffer *buffer)
+{
+	return buffer->size;
+}
+
+/**
+ * Change the size of a pipe. The kernel rounds it up to a power of two
+ * pages and refuses to shrink it below the data it holds (EBUSY).
+ */
+static ssize_t
+splice_resize(struct ro_buffer *buffer, size_t size)
+{
+#ifdef F_SETPIPE_SZ
+	int n = fcntl(buffer->pipe[1], F_SETPIPE_SZ, size);
+	if (n == -1) return -1;
+	buffer->size = n;
+	return n;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static ssize_t
+splice_move_fd(int in, int out, size_t max)
+{
+	ssize_t n;
+	while ((n = splice(in, NULL, out, NULL, max,
+		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK)) == -1 &&
+	    errno == EINTR);
+	if (n == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+	return n;
+}
+
+static ssize_t
+splice_read_in(int fd, struct ro_buffer *to, size_t max)
+{
+	ssize_t n = splice_move_fd(fd, to->pipe[1], max);
+	if (n == -1 && errno == EAGAIN && socket_readable(fd))
+		errno = ENOBUFS;
+	return n;
+}
+
+static ssize_t
+splice_write_out(struct ro_buffer *from, int fd, size_t max)
+{
+	return splice_move_fd(from->pipe[0], fd, max);
+}
+
+static ssize_t
+splice_move(struct ro_buffer *from, struct ro_buffer *to, size_t max)
+{
+	/* The source is never empty when we are called */
+	ssize_t n = splice_move_fd(from->pipe[0], to->pipe[1], max);
+	if (n == -1 && errno == EAGAIN) errno = ENOBUFS;
+	return n;
+}
+
+static ssize_t
+splice_tee(struct ro_buffer *from, struct ro_buffer *to, size_t max)
+{
+	/* The source is never empty when we are called */
+	ssize_t n;
+	while ((n = tee(from->pipe[0], to->pipe[1], max,
+		    SPLICE_F_NONBLOCK)) == -1 && errno == EINTR);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) errno = ENOBUFS;
+	return n;
+}
+
+static int devnull = -1;
+static pthread_once_t devnull_once = PTHREAD_ONCE_INIT;
+
+static void
+devnull_open(void)
+{
+	if ((devnull = open("/dev/null", O_WRONLY|O_CLOEXEC)) == -1)
+		log_warn("engine", "unable to open /dev/null");
+}
+
+static ssize_t
+splice_discard(struct ro_buffer *from, size_t max)
+{
+	pthread_once(&devnull_once, devnull_open);
+	if (devnull == -1) {
+		errno = EBADF;
+		return -1;
+	}
+	return splice_move_fd(from->pipe[0], devnull, max);
+}
+
+static ssize_t
+splice_put(struct ro_buffer *to, const void *buf, size_t len)
+{
+	ssize_t n;
+	while ((n = write(to->pipe[1], buf, len)) == -1 && errno == EINTR);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) errno = ENOBUFS;
+	return n;
+}
+
+static ssize_t
+splice_get(struct ro_buffer *from, void *buf, size_t len)
+{
+	ssize_t n;
+	while ((n = read(from->pipe[0], buf, len)) == -1 && errno == EINTR);
+	if (n == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+	return n;
+}
+
+/* Copy engine: buffers are ring buffers in memory. Sockets are read and
+ * written with readv() and writev(). Input from remotes is read in bulk,
+ * therefore, several frames can be received with a single system call. */
+
+static int
+copy_init(struct ro_buffer *buffer, size_t size)
+{
+	if (size == 0) size = RO_COPY_BUFFER;
+	if ((buffer->data = malloc(size)) == NULL)
+		return -1;
+	buffer->size = size;
+	buffer->start = buffer->len = 0;
+	buffer->ready = true;
+	return 0;
+}
+
+static void zerocopy_free(struct ro_buffer *);
+
+static void
+copy_free(struct ro_buffer *buffer)
+{
+	if (!buffer->ready) return;
+	zerocopy_free(buffer);
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->size = buffer->start = buffer->len = 0;
+	buffer->ready = false;
+}
+
+static size_t
+copy_capacity(struct ro_buffer *buffer)
+{
+	return buffer->size;
+}
+
+/**
+ * Describe the data (or the free space) of a ring buffer with at most two
+ * segments.
+ *
+ * @return the number of segments
+ */
+static int
+copy_segments(struct ro_buffer *buffer, bool data, size_t max,
+    struct iovec iov[static 2])
+{
+	size_t offset, avail;
+	if (data) {
+		offset = buffer->start;
+		avail = buffer->len;
+	} else {
+		offset = (buffer->start + buffer->len) % buffer->size;
+		avail = buffer->size - buffer->len;
+		if (buffer->zerocopy) avail -= buffer->zerocopy->pinned;
+	}
+	if (avail > max) avail = max;
+	if (avail == 0) return 0;
+
+	size_t first = buffer->size - offset;
+	if (first > avail) first = avail;
+	iov[0].iov_base = buffer->data + offset;
+	iov[0].iov_len = first;
+	if (avail == first) return 1;
+	iov[1].iov_base = buffer->data;
+	iov[1].iov_len = avail - first;
+	return 2;
+}
+
+static void
+copy_consume(struct ro_buffer *buffer, size_t len)
+{
+	buffer->start = (buffer->start + len) % buffer->size;
+	if ((buffer->len -= len) == 0 &&
+	    (!buffer->zerocopy || buffer->zerocopy->pinned == 0))
+		buffer->start = 0;
+}
+
+static void zerocopy_room(struct ro_buffer *, size_t);
+static ssize_t zerocopy_write_out(struct ro_buffer *, int, size_t);
+
+static ssize_t
+copy_read_in(int fd, struct ro_buffer *to, size_t max)
+{
+	struct iovec iov[2];
+	zerocopy_room(to, max);
+	int cnt = copy_segments(to, false, max, iov);
+	if (cnt == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	ssize_t n;
+	while ((n = readv(fd, iov, cnt)) == -1 && errno == EINTR);
+	if (n == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+	if (n > 0) to->len += n;
+	return n;
+}
+
+static ssize_t
+copy_write_out(struct ro_buffer *from, int fd, size_t max)
+{
+	if (from->zerocopy) return zerocopy_write_out(from, fd, max);
+	struct iovec iov[2];
+	int cnt = copy_segments(from, true, max, iov);
+	if (cnt == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	ssize_t n;
+	while ((n = writev(fd, iov, cnt)) == -1 && errno == EINTR);
+	if (n == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+	if (n > 0) copy_consume(from, n);
+	return n;
+}
+
+static ssize_t
+copy_put(struct ro_buffer *to, const void *buf, size_t len)
+{
+	struct iovec iov[2];
+	zerocopy_room(to, len);
+	int cnt = copy_segments(to, false, len, iov);
+	if (cnt == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	size_t n = 0;
+	for (int i = 0; i < cnt; i++) {
+		memcpy(iov[i].iov_base, (const char *)buf + n, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+	to->len += n;
+	return n;
+}
+
+static ssize_t
+copy_get(struct ro_buffer *from, void *buf, size_t len)
+{
+	struct iovec iov[2];
+	int cnt = copy_segments(from, true, len, iov);
+	if (cnt == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t n = 0;
+	for (int i = 0; i < cnt; i++) {
+		memcpy((char *)buf + n, iov[i].iov_base, iov[i].iov_len);
+		n += iov[i].iov_len;
+	}
+	copy_consume(from, n);
+	return n;
+}
+
+static ssize_t
+copy_tee(struct ro_buffer *from, struct ro_buffer *to, size_t max)
+{
+	struct iovec iov[2];
+	int cnt = copy_segments(from, true, max, iov);
+	if (cnt == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	zerocopy_room(to, max);
+	size_t n = 0;
+	for (int i = 0; i < cnt; i++) {
+		ssize_t m = copy_put(to, iov[i].iov_base, iov[i].iov_len);
+		if (m == -1) break;
+		n += m;
+		if ((size_t)m < iov[i].iov_len) break;
+	}
+	if (n == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	return n;
+}
+
+static ssize_t
+copy_move(struct ro_buffer *from, struct ro_buffer *to, size_t max)
+{
+	ssize_t n = copy_tee(from, to, max);
+	if (n > 0) copy_consume(from, n);
+	return n;
+}
+
+static ssize_t
+copy_discard(struct ro_buffer *from, size_t max)
+{
+	if (max > from->len) max = from->len;
+	if (max == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	copy_consume(from, max);
+	return max;
+}
+
+/* Zerocopy sends (copy engine). With MSG_ZEROCOPY, the kernel pins the pages
+ * of the ring buffer instead of copying them. The bytes sent are only
+ * released once the completion has been read from the error queue of the
+ * socket. Until then, they stay just before the start of the ring buffer.
+ * When the ring buffer is empty but most of it is still pinned, its memory
+ * is retired and replaced by a fresh one. */
+
+/**
+ * Enable zerocopy sends from a buffer to the given socket.
+ *
+ * @return -1 if zerocopy is not available
+ */
+static int
+zerocopy_init(struct ro_buffer *buffer, int fd)
+{
+#ifdef SO_ZEROCOPY
+	int one = 1;
+	if (buffer->zerocopy) return 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == -1)
+		return -1;
+	if ((buffer->zerocopy = calloc(1, sizeof(struct ro_zerocopy))) == NULL)
+		return -1;
+	buffer->zerocopy->fd = fd;
+	TAILQ_INIT(&buffer->zerocopy->sends);
+	TAILQ_INIT(&buffer->zerocopy->retired);
+	return 0;
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static void
+zerocopy_free(struct ro_buffer *buffer)
+{
+	struct ro_zerocopy *zc = buffer->zerocopy;
+	struct zerocopy_send *send;
+	struct zerocopy_block *block;
+	if (zc == NULL) return;
+	/* No zerocopy send is pending, see `zerocopy_linger()` */
+	while ((send = TAILQ_FIRST(&zc->sends)) != NULL) {
+		TAILQ_REMOVE(&zc->sends, send, next);
+		free(send);
+	}
+	while ((block = TAILQ_FIRST(&zc->retired)) != NULL) {
+		TAILQ_REMOVE(&zc->retired, block, next);
+		free(block->data);
+		free(block);
+	}
+	free(zc);
+	buffer->zerocopy = NULL;
+}
+
+/**
+ * Release the bytes of completed sends, oldest first.
+ */
+static void
+zerocopy_release(struct ro_buffer *buffer)
+{
+	struct ro_zerocopy *zc = buffer->zerocopy;
+	struct zerocopy_send *send;
+	while ((send = TAILQ_FIRST(&zc->sends)) != NULL && send->done) {
+		TAILQ_REMOVE(&zc->sends, send, next);
+		if (send->block == buffer->data) {
+			zc->pinned -= send->bytes;
+			if (zc->pinned == 0 && buffer->len == 0)
+				buffer->start = 0;
+		} else {
+			struct zerocopy_block *block;
+			TAILQ_FOREACH(block, &zc->retired, next)
+			    if (block->data == send->block) break;
+			if (block && (block->pinned -= send->bytes) == 0) {
+				TAILQ_REMOVE(&zc->retired, block, next);
+				free(block->data);
+				free(block);
+			}
+		}
+		free(send);
+	}
+}
+
+/**
+ * Read completions from the error queue of the socket and release the
+ * bytes which are not used by the kernel anymore.
+ */
+static void
+zerocopy_reclaim(struct ro_buffer *buffer)
+{
+	struct ro_zerocopy *zc = buffer->zerocopy;
+	if (zc == NULL) return;
+#ifdef SO_ZEROCOPY
+	while (zc->outstanding > 0) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg = {
+			.msg_control = control,
+			.msg_controllen = sizeof(control)
+		};
+		if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				log_warn("engine", "unable to read zerocopy completions");
+			break;
+		}
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		     cm != NULL;
+		     cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+				(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			struct sock_extended_err *serr =
+			    (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+			    serr->ee_errno != 0)
+				continue;
+			/* Sends from ee_info to ee_data are complete */
+			uint32_t lo = serr->ee_info, hi = serr->ee_data;
+			struct zerocopy_send *send;
+			TAILQ_FOREACH(send, &zc->sends, next) {
+				if (!send->zerocopy || send->done ||
+				    (uint32_t)(send->id - lo) > (uint32_t)(hi - lo))
+					continue;
+				send->done = true;
+				zc->outstanding--;
+				if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+					zc->copied += send->bytes;
+			}
+		}
+	}
+#endif
+	zerocopy_release(buffer);
+}
+
+static void
+zerocopy_linger_arm(struct ro_worker *worker)
+{
+	struct timeval tv = {
+		.tv_sec = 0,
+		.tv_usec = RO_ZEROCOPY_LINGER * 1000
+	};
+	evtimer_add(worker->event->linger, &tv);
+}
+
+static void
+zerocopy_linger_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_worker *worker = arg;
+	struct zerocopy_linger *linger, *linger_next;
+	for (linger = TAILQ_FIRST(&worker->event->lingering);
+	     linger != NULL;
+	     linger = linger_next) {
+		linger_next = TAILQ_NEXT(linger, next);
+		zerocopy_reclaim(&linger->buffer);
+		if (linger->buffer.zerocopy->outstanding > 0) continue;
+		log_debug("engine", "zerocopy sends to fd %d complete, close it",
+		    linger->buffer.zerocopy->fd);
+		TAILQ_REMOVE(&worker->event->lingering, linger, next);
+		close(linger->buffer.zerocopy->fd);
+		copy_free(&linger->buffer);
+		free(linger);
+	}
+	if (!TAILQ_EMPTY(&worker->event->lingering))
+		zerocopy_linger_arm(worker);
+}
+
+/**
+ * Take over the buffer of a remote being destroyed while some zerocopy
+ * sends from it are not complete: after the socket is closed, the kernel
+ * may still send (or send again) bytes from this memory. The socket is
+ * shut down for writing but kept open until the completions are received,
+ * then the socket is closed and the memory freed.
+ *
+ * @return true when the socket was taken over and should not be closed
+ */
+bool
+zerocopy_linger(struct ro_worker *worker, struct ro_buffer *buffer)
+{
+	struct ro_zerocopy *zc = buffer->zerocopy;
+	struct zerocopy_linger *linger;
+	if (zc == NULL) return false;
+	zerocopy_reclaim(buffer);
+	if (zc->outstanding == 0) return false;
+	if (worker->event->linger == NULL &&
+	    (worker->event->linger = evtimer_new(worker->event->base,
+		zerocopy_linger_cb, worker)) == NULL) {
+		log_warnx("engine", "unable to setup timer for zerocopy sends");
+		linger = NULL;
+	} else if ((linger = calloc(1, sizeof(*linger))) == NULL)
+		log_warn("engine", "unable to keep buffer with zerocopy sends");
+	if (linger == NULL) {
+		/* Better leak the memory than reuse it */
+		*buffer = (struct ro_buffer){ .ready = false };
+		return false;
+	}
+	log_debug("engine", "%u zerocopy sends to fd %d not complete, keep it",
+	    zc->outstanding, zc->fd);
+	shutdown(zc->fd, SHUT_WR);
+	linger->buffer = *buffer;
+	*buffer = (struct ro_buffer){ .ready = false };
+	TAILQ_INSERT_TAIL(&worker->event->lingering, linger, next);
+	if (!evtimer_pending(worker->event->linger, NULL))
+		zerocopy_linger_arm(worker);
+	return true;
+}
+
+/**
+ * Close the sockets still waiting for zerocopy completions when the worker
+ * stops. The process exits, its memory is not reused.
+ */
+void
+zerocopy_linger_free(struct ro_worker *worker)
+{
+	struct zerocopy_linger *linger;
+	while ((linger = TAILQ_FIRST(&worker->event->lingering)) != NULL) {
+		TAILQ_REMOVE(&worker->event->lingering, linger, next);
+		close(linger->buffer.zerocopy->fd);
+		copy_free(&linger->buffer);
+		free(linger);
+	}
+	if (worker->event->linger) event_free(worker->event->linger);
+	worker->event->linger = NULL;
+}
+
+/**
+ * Make room in a buffer before putting data into it. When the buffer is
+ * empty and most of it is still pinned by the kernel, its memory is
+ * replaced.
+ */
+static void
+zerocopy_room(struct ro_buffer *buffer, size_t want)
+{
+	struct ro_zerocopy *zc = buffer->zerocopy;
+	if (zc == NULL || zc->pinned == 0) return;
+	size_t avail = buffer->size - buffer->len - zc->pinned;
+	if (avail >= want) return;
+	zerocopy_reclaim(buffer);
+	avail = buffer->size - buffer->len - zc->pinned;
+	if (avail >= want || avail >= RO_ZEROCOPY_MIN || buffer->len > 0 ||
+	    zc->pinned == 0)
+		return;
+
+	struct zerocopy_block *block;
+	char *data;
+	if ((block = calloc(1, sizeof(struct zerocopy_block))) == NULL ||
+	    (data = malloc(buffer->size)) == NULL) {
+		free(block);
+		return;
+	}
+	block->data = buffer->data;
+	block->pinned = zc->pinned;
+	TAILQ_INSERT_TAIL(&zc->retired, block, next);
+	buffer->data = data;
+	buffer->start = 0;
+	zc->pinned = 0;
+}
+
+/**
+ * Account a send from a buffer with zerocopy enabled. The bytes stay pinned
+ * until the completion is received.
+ */
+static int
+zerocopy_account(struct ro_buffer *buffer, size_t n, bool zerocopy)
+{
+	struct ro_zerocopy *zc = buffer->zerocopy;
+	struct zerocopy_send *send = TAILQ_LAST(&zc->sends, zerocopy_sends);
+	if (!zerocopy && send && !send->zerocopy && send->block == buffer->data)
+		/* Merge with the previous regular send */
+		send->bytes += n;
+	else if ((send = calloc(1, sizeof(struct zerocopy_send))) == NULL)
+		return -1;
+	else {
+		send->block = buffer->data;
+		send->bytes = n;
+		send->zerocopy = zerocopy;
+		send->done = !zerocopy;
+		if (zerocopy) {
+			send->id = zc->next_id;
+			zc->outstanding++;
+		}
+		TAILQ_INSERT_TAIL(&zc->sends, send, next);
+	}
+	if (zerocopy) {
+		zc->next_id++;
+		zc->sent += n;
+	}
+	buffer->start = (buffer->start + n) % buffer->size;
+	buffer->len -= n;
+	zc->pinned += n;
+	return 0;
+}
+
+static ssize_t
+zerocopy_write_out(struct ro_buffer *from, int fd, size_t max)
+{
+	struct iovec iov[2];
+	int cnt = copy_segments(from, true, max, iov);
+	if (cnt == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	size_t len = iov[0].iov_len + ((cnt == 2)?iov[1].iov_len:0);
+	bool zerocopy = (len >= RO_ZEROCOPY_MIN);
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = cnt
+	};
+	ssize_t n = -1;
+#ifdef MSG_ZEROCOPY
+	while (zerocopy &&
+	    (n = sendmsg(fd, &msg, MSG_ZEROCOPY)) == -1 &&
+	    errno == EINTR);
+	/* Out of memory for notifications, fallback to a regular send */
+	if (zerocopy && n == -1 && errno == ENOBUFS) zerocopy = false;
+#else
+	zerocopy = false;
+#endif
+	if (!zerocopy)
+		while ((n = sendmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+	if (n == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+	if (n > 0 && zerocopy_account(from, n, zerocopy) == -1) {
+		/* Without tracking, we cannot know when the memory can be
+		 * reused. */
+		log_warnx("engine", "unable to track zerocopy send");
+		errno = ENOMEM;
+		return -1;
+	}
+	return n;
+}
+
+static const struct ro_engine engines[] = {
+	{ .name = "splice", .pipes = true, .staged = false,
+	  .init = splice_init, .free = splice_free,
+	  .capacity = splice_capacity,
+	  .read_in = splice_read_in, .write_out = splice_write_out,
+	  .move = splice_move, .put = splice_put, .get = splice_get,
+	  .tee = splice_tee, .discard = splice_discard,
+	  .resize = splice_resize },
+	{ .name = "copy", .pipes = false, .staged = true,
+	  .init = copy_init, .free = copy_free,
+	  .capacity = copy_capacity,
+	  .read_in = copy_read_in, .write_out = copy_write_out,
+	  .move = copy_move, .put = copy_put, .get = copy_get,
+	  .tee = copy_tee, .discard = copy_discard,
+	  .zerocopy = zerocopy_init, .reclaim = zerocopy_reclaim },
+	{ .name = NULL }
+};
+
+/**
+ * Get an engine from its name.
+ *
+ * @return the engine or NULL if there is no such engine
+ */
+const struct ro_engine *
+engine_get(const char *name)
+{
+	for (const struct ro_engine *engine = engines; engine->name; engine++)
+		if (!strcmp(engine->name, name)) return engine;
+	return NULL;
+}
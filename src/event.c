@@ -20,6 +20,8 @@
 
 #include <signal.h>
 #include <errno.h>
+#include <string.h>
+#include <inttypes.h>
 #include <arpa/inet.h>
 #include <event2/listener.h>
 
@@ -34,21 +36,249 @@ levent_log_cb(int severity, const char *msg)
 	}
 }
 
+/**
+ * Post a message into the mailbox of a worker. When the mailbox is full,
+ * the message is queued in the backlog of the worker: the worker reads its
+ * mailbox, then the backlog. Once the backlog is not empty, it also gets
+ * the next messages to keep them in order.
+ */
+static int
+levent_post(struct ro_worker *worker, struct worker_message *msg)
+{
+	struct worker_backlog *queued;
+	ssize_t n = 0;
+	pthread_mutex_lock(&worker->event->backlog_lock);
+	while (TAILQ_EMPTY(&worker->event->backlog) &&
+	    (n = write(worker->event->mailbox[1], msg, sizeof(*msg))) == -1) {
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+		pthread_mutex_unlock(&worker->event->backlog_lock);
+		log_warn("event", "unable to post message to worker %u",
+		    worker->index);
+		return -1;
+	}
+	if (!TAILQ_EMPTY(&worker->event->backlog) || n == -1) {
+		if ((queued = malloc(sizeof(*queued))) == NULL) {
+			pthread_mutex_unlock(&worker->event->backlog_lock);
+			log_warn("event", "unable to queue message to worker %u",
+			    worker->index);
+			return -1;
+		}
+		queued->msg = *msg;
+		TAILQ_INSERT_TAIL(&worker->event->backlog, queued, next);
+	}
+	pthread_mutex_unlock(&worker->event->backlog_lock);
+	return 0;
+}
+
+/**
+ * Handle a message posted by another worker (or by ourself).
+ */
+static void
+levent_receive(struct ro_worker *worker, struct worker_message *msg)
+{
+	switch (msg->type) {
+	case WORKER_STOP:
+		log_debug("event", "stop worker %u", worker->index);
+		event_base_loopbreak(worker->event->base);
+		break;
+	case WORKER_DUMP: {
+		struct ro_local *local;
+		connection_debug(worker);
+		slab_debug(worker);
+		TAILQ_FOREACH(local, &worker->locals, next)
+		    local_debug(local);
+		break;
+	}
+	case WORKER_HANDOFF:
+		if (msg->keyed)
+			log_debug("event",
+			    "worker %u receives [%s]:%s for group key %016" PRIx64 "%016" PRIx64,
+			    worker->index, msg->addr, msg->serv,
+			    msg->group_key[0], msg->group_key[1]);
+		else
+			log_debug("event",
+			    "worker %u receives [%s]:%s for group ID #%" PRIu32,
+			    worker->index, msg->addr, msg->serv, msg->group_id);
+		connection_attach(worker, msg->fd, msg->group_id,
+		    msg->keyed?msg->group_key:NULL,
+		    msg->version, msg->fresh, msg->addr, msg->serv);
+		break;
+	case WORKER_SESSIONS:
+		control_dump_run(worker, msg->dump);
+		break;
+	case WORKER_SESSIONS_READY:
+		control_dump_ready(worker->cfg, msg->dump);
+		break;
+	}
+}
+
+/**
+ * Receive messages posted by other workers (or by ourself).
+ */
+static void
+levent_inbox(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_worker *worker = arg;
+	struct worker_message msg;
+	ssize_t n;
+	while ((n = read(fd, &msg, sizeof(msg))) != 0) {
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			log_warn("event", "unable to read mailbox of worker %u",
+			    worker->index);
+			return;
+		}
+		if (n != sizeof(msg)) {
+			log_warnx("event", "incomplete message for worker %u",
+			    worker->index);
+			return;
+		}
+		levent_receive(worker, &msg);
+	}
+
+	/* The mailbox was full when these ones were posted */
+	TAILQ_HEAD(, worker_backlog) backlog = TAILQ_HEAD_INITIALIZER(backlog);
+	struct worker_backlog *queued;
+	pthread_mutex_lock(&worker->event->backlog_lock);
+	TAILQ_CONCAT(&backlog, &worker->event->backlog, next);
+	pthread_mutex_unlock(&worker->event->backlog_lock);
+	while ((queued = TAILQ_FIRST(&backlog)) != NULL) {
+		TAILQ_REMOVE(&backlog, queued, next);
+		levent_receive(worker, &queued->msg);
+		free(queued);
+	}
+}
+
+/**
+ * Hand a connection over to the worker owning the given group.
+ *
+ * @param fd  File descriptor of the connection. It is closed on error.
+ * @param key Group key or NULL to use the group ID.
+ * @return    0 on success, -1 on error
+ */
+int
+event_handoff(struct ro_worker *worker, int fd, uint32_t id,
+    const uint64_t *key, uint8_t version, bool fresh,
+    char addr[static INET6_ADDRSTRLEN], char serv[static SERVSTRLEN])
+{
+	struct ro_cfg *cfg = worker->cfg;
+	unsigned owner = key?RO_KEY_WORKER(key, cfg->workers):RO_GROUP_WORKER(id);
+	if (owner >= (unsigned)cfg->workers) {
+		log_warnx("event", "no worker %u for group ID #%" PRIu32,
+		    owner, id);
+		close(fd);
+		return -1;
+	}
+	struct worker_message msg = {
+		.type = WORKER_HANDOFF,
+		.fd = fd,
+		.group_id = id,
+		.keyed = (key != NULL),
+		.fresh = fresh,
+		.version = version
+	};
+	if (key) memcpy(msg.group_key, key, sizeof(msg.group_key));
+	memcpy(msg.addr, addr, sizeof(msg.addr));
+	memcpy(msg.serv, serv, sizeof(msg.serv));
+	if (levent_post(&cfg->worker[owner], &msg) == -1) {
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Give a dump of sessions to a worker: to dump its sessions or, for the
+ * first worker, to send what was dumped.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+event_dump(struct ro_worker *worker, struct control_dump *dump, bool ready)
+{
+	struct worker_message msg = {
+		.type = ready?WORKER_SESSIONS_READY:WORKER_SESSIONS,
+		.fd = -1,
+		.dump = dump
+	};
+	return levent_post(worker, &msg);
+}
+
+static void
+levent_broadcast(struct ro_cfg *cfg, int type)
+{
+	struct worker_message msg = { .type = type, .fd = -1 };
+	for (int i = 0; i < cfg->workers; i++) {
+		/* Better exit now than hang forever */
+		if (levent_post(&cfg->worker[i], &msg) == -1 &&
+		    type == WORKER_STOP)
+			fatalx("unable to stop a worker");
+	}
+}
+
 static void
 levent_dump(evutil_socket_t fd, short what, void *arg)
 {
 	struct ro_cfg *cfg = arg;
-	struct ro_local *local;
-	TAILQ_FOREACH(local, &cfg->locals, next)
-	    local_debug(local);
+	levent_broadcast(cfg, WORKER_DUMP);
 }
 
 static void
 levent_stop(evutil_socket_t fd, short what, void *arg)
 {
-        struct event_base *base = arg;
-        (void)fd; (void)what;
-        event_base_loopbreak(base);
+	struct ro_cfg *cfg = arg;
+	(void)fd; (void)what;
+	levent_broadcast(cfg, WORKER_STOP);
+}
+
+/**
+ * Configure one worker: event base, mailbox and listening socket.
+ */
+static int
+levent_worker_configure(struct ro_cfg *cfg, struct ro_worker *worker)
+{
+	worker->cfg = cfg;
+	TAILQ_INIT(&worker->locals);
+	if ((worker->event = calloc(1, sizeof(struct worker_private))) == NULL) {
+		log_warn("event", "unable to allocate private data for worker");
+		return -1;
+	}
+	LIST_INIT(&worker->event->dumps);
+	TAILQ_INIT(&worker->event->backlog);
+	TAILQ_INIT(&worker->event->lingering);
+	pthread_mutex_init(&worker->event->backlog_lock, NULL);
+	worker->event->mailbox[0] = worker->event->mailbox[1] = -1;
+	if (!(worker->event->base = event_base_new())) {
+		log_warnx("event", "unable to initialize libevent");
+		return -1;
+	}
+	if (pipe(worker->event->mailbox) == -1) {
+		log_warn("event", "unable to create mailbox for worker %u",
+		    worker->index);
+		return -1;
+	}
+	evutil_make_socket_nonblocking(worker->event->mailbox[0]);
+	evutil_make_socket_nonblocking(worker->event->mailbox[1]);
+	if ((worker->event->inbox = event_new(worker->event->base,
+		    worker->event->mailbox[0],
+		    EV_READ|EV_PERSIST,
+		    levent_inbox, worker)) == NULL ||
+	    event_add(worker->event->inbox, NULL) == -1) {
+		log_warnx("event", "unable to setup mailbox for worker %u",
+		    worker->index);
+		return -1;
+	}
+	if (cfg->io_uring && !cfg->engine->pipes)
+		log_warnx("event", "io_uring is only used with the splice engine");
+	else if (cfg->io_uring &&
+	    (worker->event->uring = uring_init(RO_URING_ENTRIES)) == NULL)
+		log_warnx("event", "io_uring not available for worker %u, use splice only",
+		    worker->index);
+	if (pool_start(worker) == -1)
+		return -1;
+	return connection_listen(worker);
 }
 
 /**
@@ -60,50 +290,93 @@ event_configure(struct ro_cfg *cfg)
 	log_debug("event", "configure libevent");
 	event_set_log_callback(levent_log_cb);
 
-	if ((cfg->event = calloc(1, sizeof(struct event_private))) == NULL) {
+	if ((cfg->event = calloc(1, sizeof(struct event_private))) == NULL ||
+	    (cfg->worker = calloc(cfg->workers, sizeof(struct ro_worker))) == NULL) {
 		log_warn("event", "unable to allocate private data for events");
 		return -1;
 	}
-	if (!(cfg->event->base = event_base_new())) {
-		log_warnx("event", "unable to initialize libevent");
-		return -1;
+	for (int i = 0; i < cfg->workers; i++) {
+		cfg->worker[i].index = i;
+		if (levent_worker_configure(cfg, &cfg->worker[i]) == -1)
+			return -1;
 	}
 
-	log_info("event", "libevent %s initialized with %s method",
+	struct event_base *base = cfg->worker[0].event->base;
+	log_info("event", "libevent %s initialized with %s method, %d worker(s)",
 	    event_get_version(),
-	    event_base_get_method(cfg->event->base));
+	    event_base_get_method(base),
+	    cfg->workers);
 
-	/* Signals */
+	/* Signals are handled by the first worker */
 	log_debug("event", "register signals");
         signal(SIGPIPE, SIG_IGN);
 	signal(SIGHUP, SIG_IGN);
-	evsignal_add(cfg->event->signals.sigint = evsignal_new(cfg->event->base,
-		SIGINT, levent_stop, cfg->event->base),
+	evsignal_add(cfg->event->signals.sigint = evsignal_new(base,
+		SIGINT, levent_stop, cfg),
 	    NULL);
-	evsignal_add(cfg->event->signals.sigterm = evsignal_new(cfg->event->base,
-		SIGTERM, levent_stop, cfg->event->base),
+	evsignal_add(cfg->event->signals.sigterm = evsignal_new(base,
+		SIGTERM, levent_stop, cfg),
 	    NULL);
-	evsignal_add(cfg->event->signals.sigusr1 = evsignal_new(cfg->event->base,
+	evsignal_add(cfg->event->signals.sigusr1 = evsignal_new(base,
 		SIGUSR1, levent_dump, cfg),
 	    NULL);
 
-	return connection_listen(cfg);
+	if (cfg->control && control_listen(cfg) == -1)
+		return -1;
+
+	return 0;
+}
+
+static void *
+levent_worker_loop(void *arg)
+{
+	struct ro_worker *worker = arg;
+	log_debug("event", "start event loop for worker %u", worker->index);
+	if (event_base_loop(worker->event->base, 0) == -1)
+		log_warnx("event", "unable to run libevent loop for worker %u",
+		    worker->index);
+	log_debug("event", "end of event loop for worker %u", worker->index);
+	return NULL;
 }
 
 int
 event_loop(struct ro_cfg *cfg)
 {
-	if (event_reinit(cfg->event->base)) {
-		log_warnx("event", "unable to reinit event loop");
-		return -1;
+	int rc = 0;
+	for (int i = 0; i < cfg->workers; i++) {
+		if (event_reinit(cfg->worker[i].event->base)) {
+			log_warnx("event", "unable to reinit event loop");
+			return -1;
+		}
 	}
-	log_info("event", "start main event loop");
-	if (event_base_loop(cfg->event->base, 0) == -1) {
-		log_warnx("event", "unable to run libevent loop");
-		return -1;
+	/* Worker 0 runs in the main thread */
+	for (int i = 1; i < cfg->workers; i++) {
+		struct ro_worker *worker = &cfg->worker[i];
+		if ((errno = pthread_create(&worker->event->thread, NULL,
+			    levent_worker_loop, worker)) != 0) {
+			log_warn("event", "unable to start worker %u", i);
+			levent_broadcast(cfg, WORKER_STOP);
+			rc = -1;
+			break;
+		}
+		worker->event->running = true;
+	}
+	if (rc == 0) {
+		log_info("event", "start main event loop");
+		if (event_base_loop(cfg->worker[0].event->base, 0) == -1) {
+			log_warnx("event", "unable to run libevent loop");
+			levent_broadcast(cfg, WORKER_STOP);
+			rc = -1;
+		}
+	}
+	for (int i = 1; i < cfg->workers; i++) {
+		struct ro_worker *worker = &cfg->worker[i];
+		if (!worker->event->running) continue;
+		pthread_join(worker->event->thread, NULL);
+		worker->event->running = false;
 	}
 	log_info("event", "end of main loop");
-	return 0;
+	return rc;
 }
 
 /**
@@ -113,25 +386,49 @@ void
 event_shutdown(struct ro_cfg *cfg)
 {
 	if (cfg->event) {
-		if (cfg->event->listener)
-			evconnlistener_free(cfg->event->listener);
+		control_free(cfg);
 		if (cfg->event->signals.sigint)
 			event_free(cfg->event->signals.sigint);
 		if (cfg->event->signals.sigterm)
 			event_free(cfg->event->signals.sigterm);
 		if (cfg->event->signals.sigusr1)
 			event_free(cfg->event->signals.sigusr1);
+		free(cfg->event);
+	}
+	for (int i = 0; cfg->worker && i < cfg->workers; i++) {
+		struct ro_worker *worker = &cfg->worker[i];
+		if (!worker->event) continue;
+		if (worker->event->listener)
+			evconnlistener_free(worker->event->listener);
+		if (worker->event->inbox)
+			event_free(worker->event->inbox);
+		pool_free(worker);
+		if (worker->event->mailbox[0] != -1) close(worker->event->mailbox[0]);
+		if (worker->event->mailbox[1] != -1) close(worker->event->mailbox[1]);
+		struct worker_backlog *queued;
+		while ((queued = TAILQ_FIRST(&worker->event->backlog)) != NULL) {
+			TAILQ_REMOVE(&worker->event->backlog, queued, next);
+			if (queued->msg.fd != -1) close(queued->msg.fd);
+			free(queued);
+		}
+		pthread_mutex_destroy(&worker->event->backlog_lock);
 
 		/* Remove all local endpoints */
 		struct ro_local *local, *local_next;
-		for (local = TAILQ_FIRST(&cfg->locals);
+		for (local = TAILQ_FIRST(&worker->locals);
 		     local != NULL;
 		     local = local_next) {
 			local_next = TAILQ_NEXT(local, next);
 			local_destroy(local); /* Will do TAILQ_REMOVE */
 		}
+		group_free(worker);
+		slab_free(worker);
+		zerocopy_linger_free(worker);
 
-		event_base_free(cfg->event->base);
-		free(cfg->event);
+		if (worker->event->base)
+			event_base_free(worker->event->base);
+		uring_free(worker->event->uring);
+		free(worker->event);
 	}
+	free(cfg->worker);
 }
@@ -18,52 +18,313 @@
 #include "ro-ro-tcp.h"
 
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <event2/event.h>
 
 #ifndef _RO_EVENT_H
 #define _RO_EVENT_H
 
-struct event_private {
-	struct event_base *base;
-	struct evconnlistener *listener;
+/**
+ * A FIFO of bytes. With the splice engine, this is a pipe. With the copy
+ * engine, this is a ring buffer in memory.
+ */
+struct ro_buffer {
+	bool ready;		/* Buffer has been initialized */
+	int pipe[2];		/* Pipe (splice engine) */
+	char *data;		/* Ring buffer (copy engine) */
+	size_t size;		/* Size of the ring buffer (or of the pipe) */
+	size_t start;		/* Offset of the first byte in the ring buffer */
+	size_t len;		/* Bytes in the ring buffer */
+	struct ro_zerocopy *zerocopy; /* Zerocopy state (copy engine) */
+};
 
+struct event_private {
 	struct {
 		struct event *sigint;
 		struct event *sigterm;
 		struct event *sigusr1;
 	} signals;
+
+	struct evconnlistener *control;	     /* Control socket (optional) */
+	TAILQ_HEAD(, control_client) clients; /* Connected to the control socket */
+	TAILQ_HEAD(, control_dump) dumps;     /* Dumps of sessions in progress */
+	struct event *dump_retry;	     /* Give dumps to workers again */
+};
+
+struct worker_private {
+	struct event_base *base;
+	struct evconnlistener *listener;
+
+	pthread_t thread;
+	bool running;		/* Thread has been started */
+
+	int mailbox[2];		/* Pipe to receive messages from other workers */
+	struct event *inbox;
+	pthread_mutex_t backlog_lock;
+	TAILQ_HEAD(, worker_backlog) backlog; /* Messages not fitting in the mailbox */
+
+	struct ro_uring *uring;	/* Ring to batch operations (optional) */
+
+	TAILQ_HEAD(, pool_connection) pool; /* Connections to relay kept ready */
+	struct event *pool_retry; /* Timer to fill the pool again after an error */
+
+	struct ro_buffer pipes[RO_PIPE_CACHED]; /* Empty pipes kept for reuse */
+	TAILQ_HEAD(, zerocopy_linger) lingering; /* Buffers waiting for completions */
+	struct event *linger;	/* Timer to check them */
+
+	LIST_HEAD(, control_dump) dumps; /* Dumps of our sessions in progress */
+};
+
+/**
+ * Message sent to a worker through its mailbox. A message is smaller than
+ * PIPE_BUF, so several workers can write to the same mailbox without locking.
+ * When the mailbox is full, the message is queued in the backlog of the
+ * worker instead, see `levent_post()`.
+ */
+struct worker_message {
+	enum {
+		WORKER_STOP=1,	/* Stop the event loop */
+		WORKER_DUMP,	/* Dump local endpoints */
+		WORKER_HANDOFF,	/* Attach a connection to one of our groups */
+		WORKER_SESSIONS, /* Dump some sessions for the control socket */
+		WORKER_SESSIONS_READY /* Sessions dumped (first worker only) */
+	} type;
+	int fd;
+	uint32_t group_id;
+	bool keyed;		/* Group identified by a key */
+	uint64_t group_key[RO_KEY_WORDS];
+	bool fresh;		/* The group can be created */
+	uint8_t version;	/* Negotiated version of the protocol */
+	char addr[INET6_ADDRSTRLEN];
+	char serv[SERVSTRLEN];
+	struct control_dump *dump; /* Dump of sessions, see `control.c` */
+};
+
+struct worker_backlog {
+	TAILQ_ENTRY(worker_backlog) next;
+	struct worker_message msg;
 };
 
-#define RO_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
+/* Establishment with version 2: magic, version and group ID */
+#define RO_HELLO_SIZE (sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t))
+/* Same with a group key: magic, version, flags and group key */
+#define RO_KEYED_HELLO_SIZE (sizeof(uint32_t) + 2 * sizeof(uint8_t) + \
+	    RO_KEY_WORDS * sizeof(uint64_t))
+#define RO_HELLO_JOIN 0x01	/* Don't create the group if it is unknown */
+#define RO_CONTROL_MAX 4	/* Pending control frames for a remote */
+
+/**
+ * A connection to the relay established in advance (proxy only). Its hello
+ * uses RO_POOL_GROUP and the real one is sent when a local endpoint claims
+ * it.
+ */
+struct pool_connection {
+	TAILQ_ENTRY(pool_connection) next;
+	struct ro_worker *worker;
+	struct event *event;
+	enum {
+		POOL_CONNECTING=1, /* Waiting for the TCP handshake */
+		POOL_HELLO,	   /* Waiting for the reply of the relay */
+		POOL_READY	   /* Can be claimed */
+	} state;
+	char hello[RO_HELLO_SIZE]; /* Reply received */
+	size_t hello_bytes;	/* Bytes of reply received */
+	char laddr[INET6_ADDRSTRLEN];
+	char lserv[SERVSTRLEN];
+	char raddr[INET6_ADDRSTRLEN];
+	char rserv[SERVSTRLEN];
+};
+
+/**
+ * A frame received out of order and parked in the reorder pipe of a remote
+ * until its turn comes. Frames from a given remote are received in order,
+ * therefore, the parked frames of a remote form a FIFO.
+ */
+struct parked_frame {
+	TAILQ_ENTRY(parked_frame) next;
+	uint64_t seq;		/* Serial or offset of the frame */
+	uint32_t length;	/* Size of the frame */
+	size_t bytes;		/* Bytes of this frame in the reorder pipe */
+	bool complete;		/* All bytes of the frame have been parked */
+	bool counted;		/* Waiting time has been accounted */
+	struct timespec since;	/* When the frame was parked */
+};
+
+/**
+ * Bytes given to a remote but not acknowledged by the peer yet (version 2).
+ * Their payload is kept in the replay buffer of the remote, in the same
+ * order, to be sent again if the connection is lost.
+ */
+struct replay_frame {
+	TAILQ_ENTRY(replay_frame) next;
+	uint64_t seq;		/* Offset of the first byte */
+	uint32_t length;	/* Bytes kept */
+};
+
+/**
+ * A send done with MSG_ZEROCOPY (or a regular send done while some of them
+ * are still pending). Its bytes cannot be reused until the kernel reports
+ * its completion on the error queue of the socket.
+ */
+struct zerocopy_send {
+	TAILQ_ENTRY(zerocopy_send) next;
+	char *block;		/* Memory holding the bytes */
+	size_t bytes;		/* Number of bytes sent */
+	uint32_t id;		/* Identifier of the notification */
+	bool zerocopy;		/* Sent with MSG_ZEROCOPY */
+	bool done;		/* Completion received */
+};
+
+/**
+ * Memory of a ring buffer replaced while some of its bytes were still
+ * pinned by the kernel.
+ */
+struct zerocopy_block {
+	TAILQ_ENTRY(zerocopy_block) next;
+	char *data;
+	size_t pinned;		/* Bytes waiting for completion */
+};
+
+struct ro_zerocopy {
+	int fd;			/* Socket we send to */
+	uint32_t next_id;	/* Identifier of the next zerocopy send */
+	unsigned outstanding;	/* Zerocopy sends waiting for completion */
+	size_t pinned;		/* Bytes of the ring waiting for completion */
+	size_t sent;		/* Bytes sent with MSG_ZEROCOPY */
+	size_t copied;		/* ... but copied by the kernel anyway */
+	TAILQ_HEAD(zerocopy_sends, zerocopy_send) sends;
+	TAILQ_HEAD(, zerocopy_block) retired;
+};
+
+/**
+ * Buffer of a destroyed remote with zerocopy sends not complete yet. The
+ * socket is kept, shut down for writing, to receive their completions.
+ */
+struct zerocopy_linger {
+	TAILQ_ENTRY(zerocopy_linger) next;
+	struct ro_buffer buffer;
+};
+
+struct ro_replay {
+	TAILQ_ENTRY(ro_replay) next;
+	struct ro_buffer data;	/* Payloads */
+	size_t bytes;		/* Bytes in this buffer */
+	size_t lost;		/* Losses when queued to be sent again */
+	TAILQ_HEAD(replay_frames, replay_frame) frames;
+};
 
 struct local_private {
 	struct event *read;
 	struct event *write;
+	struct event *sample;	/* Timer to sample remotes */
+	struct event *hold;	/* Timer to hold small frames */
+	struct event *sizing;	/* Timer to adapt the size of pipes */
+	struct event *adapt;	/* Timer to open or close remotes */
+	struct event *reap;	/* Destroy retired remotes */
+	struct event *ack;	/* Timer to acknowledge delivered bytes */
+	struct event *orphan;	/* Timer to give up waiting for a replacement */
+	size_t last_busy;	/* Busy count at last adaptation */
+	unsigned busy;		/* Consecutive busy intervals */
+	bool flush;		/* Small frames have been held long enough */
 	struct {
-		int read[2];  /* pipe for splicing from the local endpoint */
-		size_t nr;    /* Number of bytes in read pipe */
-		int write[2]; /* Pipe for splicing from the remote */
-		size_t nw;    /* Number of bytes in write pipe */
+		struct ro_buffer read;	/* Data from the local endpoint */
+		size_t nr;		/* Number of bytes in read pipe */
+		struct ro_buffer write;	/* Data for the local endpoint */
+		size_t nw;		/* Number of bytes in write pipe */
+		size_t last_out;	/* Bytes read at last sizing */
+		size_t last_in;		/* Bytes written at last sizing */
 	} pipe;
 
-	struct ro_remote *current_send_remote; /* We are currently sending to this remote */
+	struct ro_remote *last_send_remote; /* We last gave a frame to this remote */
+	struct ro_remote *filling; /* This remote did not get its whole frame yet */
 	struct ro_remote *current_receive_remote; /* We are currently receiving from this remote */
-	uint32_t remaining_bytes;	  /* We need to send this many bytes */
-	size_t partial_bytes;		  /* But before that, we only wrote this many bytes for the header */
+	size_t parked;		  /* Bytes in reorder pipes of all remotes */
+
+	uint8_t version;	/* Negotiated version of the protocol */
+	bool established;	/* A remote got a reply from the relay */
+	uint64_t send_next;	/* Serial or offset of the next frame to send */
+	uint64_t receive_next;	/* Serial or offset of the next frame to receive */
+
+	/* Orderly shutdown (version 2) */
+	bool eof;		/* Local endpoint has nothing more to send */
+	bool close_queued;	/* CLOSE frame given to a remote */
+	bool close_done;	/* CLOSE frame sent */
+	bool peer_eof;		/* CLOSE frame received */
+	uint64_t peer_final;	/* Offset after the last byte from peer */
+	bool shut;		/* Local endpoint told there is nothing more */
+	uint64_t peer_window;	/* Bytes delivered by peer (last WINDOW frame) */
 
-	uint16_t send_serial;	 /* Current serial number for sending */
-	uint16_t receive_serial; /* Current serial number for receiving */
+	/* Replay of frames of lost remotes (version 2) */
+	uint64_t acked;		/* Bytes delivered in the last WINDOW frame sent */
+	unsigned attempts;	/* Replacements opened without progress */
+	TAILQ_HEAD(, ro_replay) resend; /* Frames to send again */
 };
 
 struct remote_private {
 	struct event *read;
 	struct event *write;
 
-	char partial_header[RO_HEADER_SIZE]; /* Partial received header */
+	bool handshake;		/* Establishment protocol in progress */
+	bool timed;		/* Time to establish this connection is measured */
+	struct timespec opened;	/* When this connection was opened */
+
+	/* Pending frame to send */
+	struct ro_buffer send;	/* Header and payload */
+	uint64_t send_seq;	/* Serial or offset of the frame */
+	char send_header[RO_HEADER_MAX]; /* Header of the frame */
+	size_t send_header_size; /* Size of the header */
+	uint32_t send_frame;	/* Size of the payload */
+	uint32_t send_bytes;	/* Bytes of header and payload still to send */
+	uint32_t send_fill;	/* Bytes of payload still in the read pipe */
+	uint64_t send_since;	/* When the frame was given (with --latency) */
+	struct ro_frame control[RO_CONTROL_MAX]; /* Control frames to send */
+	unsigned controls;	/* Number of control frames to send */
+	bool close_out;		/* Sending the CLOSE frame */
+	bool close_carrier;	/* The CLOSE frame was given to this remote */
+	struct ro_replay *replay; /* Frames not acknowledged yet */
+	struct ro_replay *replay_from; /* Frame taken from this queue, not the read pipe */
+	uint32_t replay_ahead;	/* Bytes kept for replay but not moved yet */
+	uint64_t unkept;	/* Offset after the last byte sent without a copy */
+	bool lost;		/* Connection lost, frames replayed elsewhere */
+	size_t joined;		/* Losses of the local endpoint when created,
+				 * or of the proxy (relay) */
+	bool joining;		/* Waiting for the losses of the proxy, then
+				 * for us to send their frames again (relay) */
+	bool announced;		/* Losses of the proxy received (relay) */
+
+	/* Closing this connection only (version 2) */
+	bool retiring;		/* Don't give new frames to this remote */
+	bool retire_out;	/* Sending the RETIRE frame */
+	bool retired;		/* RETIRE frame sent */
+	bool retire_in;		/* RETIRE frame received */
+	size_t last_bytes;	/* Bytes moved at last adaptation */
+	unsigned idle;		/* Consecutive idle intervals */
+
+	char hello[RO_KEYED_HELLO_SIZE]; /* Reply received during establishment */
+	size_t hello_bytes;	/* Bytes of reply received */
+
+	struct ro_buffer in;	/* Data read in bulk (copy engine) */
+	char partial_header[RO_HEADER_MAX]; /* Partial received header */
 	size_t partial_bytes;	    /* Size of partially received header */
+	bool framed;		    /* Header completely received */
+	bool eof;		    /* Remote closed the connection */
+	uint32_t duplicate;	    /* Bytes of the frame already delivered */
 
-	uint16_t receive_serial;  /* We are receiving this serial */
+	uint64_t receive_seq;	  /* We are receiving this serial or offset */
 	uint32_t remaining_bytes; /* We need to receive this many bytes */
+	uint64_t receive_since;	  /* When the header was received (with --latency) */
+	enum {
+		RECEIVE_UNDECIDED=0, /* No destination for received bytes */
+		RECEIVE_DIRECT,	     /* Splice to the write pipe */
+		RECEIVE_PARKED	     /* Splice to the reorder pipe */
+	} receive_mode;
+
+	/* Reorder buffer */
+	struct ro_buffer park;	/* Frames received out of order */
+	size_t parked;		/* Bytes in this pipe */
+	bool stalled;		/* Waiting for room in reorder buffer */
+	TAILQ_HEAD(parked_frame_head, parked_frame) frames;
 };
 
 static inline void
@@ -75,6 +336,18 @@ event_close_and_free(struct event *event)
 	}
 }
 
+/**
+ * Tell if a remote can accept a new frame.
+ */
+static inline bool
+remote_available(struct ro_remote *remote)
+{
+	return (remote->connected &&
+	    !remote->event->retiring &&
+	    !remote->event->joining &&
+	    remote->event->send_bytes == 0);
+}
+
 #define MAX_SPLICE_AT_ONCE (1<<30)
 #define MAX_SPLICE_BYTES (1448 * 16)
 
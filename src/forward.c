@@ -26,473 +26,2054 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+static int local_close_check(struct ro_local *);
+static int local_reap(struct ro_local *);
+static int local_dispatch(struct ro_local *);
+static int local_ack(struct ro_local *, bool);
+static int local_acked(struct ro_local *, uint64_t);
+static int remote_closed(struct ro_remote *);
+static int remote_lost(struct ro_remote *);
+static int remote_frame_out(struct ro_remote *);
+static int remote_send_init(struct ro_remote *);
+
+/**
+ * Read bytes from a remote. With an engine reading remotes in bulk, the data
+ * is first read in the input buffer of the remote.
+ *
+ * @return the number of bytes read, 0 if the remote was closed or -1 with
+ *         errno set (EAGAIN if there is nothing to read, ENOBUFS if the
+ *         destination is full)
+ */
+static ssize_t
+remote_read(struct ro_remote *remote, struct ro_buffer *to, void *buf, size_t len)
+{
+	const struct ro_engine *engine = remote->cfg->engine;
+	int fd = event_get_fd(remote->event->read);
+	ssize_t n;
+	if (!engine->staged) {
+		if (to) return engine->read_in(fd, to, len);
+		while ((n = read(fd, buf, len)) == -1 && errno == EINTR);
+		if (n == -1 && errno == EWOULDBLOCK) errno = EAGAIN;
+		return n;
+	}
+
+	struct ro_buffer *in = &remote->event->in;
+	if (!in->ready && slab_buffer_init(remote->local->worker, in, 0) == -1)
+		return -1;
+	for (int i = 0; i < 2; i++) {
+		n = to?engine->move(in, to, len):engine->get(in, buf, len);
+		if (n != -1 || errno != EAGAIN || i == 1) break;
+		/* Nothing in the input buffer, read more from the remote */
+		if ((n = engine->read_in(fd, in, MAX_SPLICE_AT_ONCE)) <= 0)
+			break;
+	}
+	return n;
+}
+
+/**
+ * Resume reading from a remote. Some data may already be waiting in its input
+ * buffer while the socket itself has nothing more to read.
+ */
 static void
-tcp_cork_set(int fd, bool enable)
+remote_wake(struct ro_remote *remote)
 {
-#ifdef TCP_CORK
-	int val = enable;
-	if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) == -1)
-		log_warn("remote", "unable to %s TCP cork on fd %d",
-		    enable?"set":"unset", fd);
-#endif
+	if (remote->event->lost) return;
+	event_add(remote->event->read, NULL);
+	if (remote->event->in.len > 0)
+		event_active(remote->event->read, EV_READ, 0);
 }
 
 /**
- * Advertise how many bytes we will send to remote.
+ * Receive the header from the remote end. With version 2 of the protocol,
+ * the size of the header is only known once its first bytes are received.
  *
- * @param many    How many bytes we would like to send.
- * @param partial How many bytes (of the header) we have to send yet.
- * @return        How many bytes (of the header) we have sent
+ * @return How many bytes (of the header) we have received
  */
 static ssize_t
-remote_prepare_sending(struct ro_remote *remote, size_t many, size_t partial)
-{
-	/* Our header is quite simple: the serial, the size of the buffer we
-	 * want to transmit. */
-	char buf[RO_HEADER_SIZE] = {};
-	uint16_t serial = htons(remote->local->event->send_serial);
-	uint32_t bytes = htonl(many);
-	memcpy(buf, &serial, sizeof(serial));
-	memcpy(buf + sizeof(serial), &bytes, sizeof(bytes));
-	ssize_t n;
-	while ((n = write(event_get_fd(remote->event->write),
-		    ((char *)buf) + (RO_HEADER_SIZE - partial), partial)) <= 0) {
-		if (errno == EINTR) continue;
-		if (n == 0) {
-			log_debug("remote", "connection [%s]:%s <-> [%s]:%s was closed",
+remote_prepare_receiving(struct ro_remote *remote)
+{
+	size_t partial = remote->event->partial_bytes;
+	ssize_t n = remote_read(remote, NULL,
+	    (char *)remote->event->partial_header + partial,
+	    frame_header_size(remote->local->event->version,
+		remote->event->partial_header, partial) - partial);
+	if (n > 0) return n;
+	if (n == 0) return remote_closed(remote);
+	if (errno == EAGAIN) {
+		METRIC_ADD(remote->local->worker->metrics.eagain[0], 1);
+		return 0;
+	}
+	log_warn("remote", "unable to read header from [%s]:%s",
+	    remote->raddr, remote->rserv);
+	remote_lost(remote);
+	return -1;
+}
+
+/**
+ * Handle a remote closed by the other end. With version 2 of the protocol,
+ * the peer closes its connections once both ends have sent their CLOSE
+ * frame. This is not an error as long as we have nothing more to send: the
+ * remaining connections may still carry data. Otherwise, the connection is
+ * lost.
+ *
+ * @return -1, the remote should not be read anymore
+ */
+static int
+remote_closed(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	if (remote->event->eof || remote->event->retire_in ||
+	    remote->event->lost) {
+		event_del(remote->event->read);
+		return -1;
+	}
+	log_debug("remote",
+	    "connection [%s]:%s <-> [%s]:%s was closed",
+	    remote->laddr, remote->lserv,
+	    remote->raddr, remote->rserv);
+	if (local->event->version < 2 || !local->event->close_queued ||
+	    remote->event->partial_bytes > 0) {
+		remote_lost(remote);
+		return -1;
+	}
+	remote->event->eof = true;
+	event_del(remote->event->read);
+
+	struct ro_remote *other;
+	TAILQ_FOREACH(other, &local->remotes, next)
+	    if (!other->event->eof && !other->event->lost) return -1;
+	if (!local->event->peer_eof) {
+		log_debug("forward",
+		    "[%s]:%s: all remotes closed before the end of the stream",
+		    local->addr, local->serv);
+		local_destroy(local);
+		return -1;
+	}
+	local_close_check(local);
+	return -1;
+}
+
+/**
+ * Queue a control frame on a remote. It is sent right away if the remote is
+ * idle, after its current frame otherwise.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_control(struct ro_remote *remote, const struct ro_frame *frame)
+{
+	/* Pings are best effort */
+	if (frame->type == FRAME_PING && remote->event->retiring) return 0;
+	if (frame->type == FRAME_WINDOW) {
+		/* Only the last acknowledgement matters */
+		for (unsigned i = 0; i < remote->event->controls; i++) {
+			if (remote->event->control[i].type != FRAME_WINDOW) continue;
+			remote->event->control[i].seq = frame->seq;
+			return 0;
+		}
+	}
+	if (remote->event->controls == RO_CONTROL_MAX) {
+		if (frame->type == FRAME_PING) return 0;
+		log_warnx("forward", "too many control frames for [%s]:%s <-> [%s]:%s",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv);
+		local_destroy(remote->local);
+		return -1;
+	}
+	remote->event->control[remote->event->controls++] = *frame;
+	if (remote->event->send_bytes > 0) return 0;
+	if (remote_send_init(remote) == -1) {
+		local_destroy(remote->local);
+		return -1;
+	}
+	return remote_frame_out(remote);
+}
+
+/**
+ * Put the pending control frames of an idle remote into its send pipe.
+ *
+ * @return true if there is something to send
+ */
+static bool
+remote_control_load(struct ro_remote *remote)
+{
+	const struct ro_engine *engine = remote->cfg->engine;
+	char header[RO_HEADER_MAX];
+	size_t bytes = 0;
+	unsigned i;
+	if (remote->event->controls == 0) return false;
+	for (i = 0; i < remote->event->controls; i++) {
+		struct ro_frame *frame = &remote->event->control[i];
+		size_t len = frame_encode(remote->local->event->version,
+		    frame, header);
+		if (engine->put(&remote->event->send, header, len) != (ssize_t)len)
+			break;
+		if (frame->type == FRAME_CLOSE && frame->length == 1)
+			remote->event->retire_out = true;
+		else if (frame->type == FRAME_CLOSE)
+			remote->event->close_out = true;
+		bytes += len;
+	}
+	/* The send pipe is empty, this should not happen */
+	memmove(remote->event->control, remote->event->control + i,
+	    (remote->event->controls - i) * sizeof(struct ro_frame));
+	remote->event->controls -= i;
+	remote->event->send_frame = remote->event->send_fill = 0;
+	remote->event->send_bytes = bytes;
+	return (bytes > 0);
+}
+
+/**
+ * Handle a control frame received from a remote.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_control_in(struct ro_remote *remote, const struct ro_frame *frame)
+{
+	struct ro_local *local = remote->local;
+	switch (frame->type) {
+	case FRAME_PING:
+		if (frame->length == 0) {
+			struct ro_frame echo = {
+				.type = FRAME_PING,
+				.seq = frame->seq,
+				.length = 1
+			};
+			return remote_control(remote, &echo);
+		}
+		if (frame->length == 2) {
+			/* The proxy may notice a loss before us: this
+			 * connection then carries the frames of this loss
+			 * and nothing else is given to it before we notice
+			 * it too and send them, see `local_resend()`. */
+			log_debug("forward", "[%s]:%s <-> [%s]:%s: joined after %"PRIu64" losses",
+			    remote->laddr, remote->lserv,
+			    remote->raddr, remote->rserv,
+			    frame->seq);
+			if (!remote->event->joining) return 0;
+			remote->event->announced = true;
+			if (frame->seq > remote->event->joined)
+				remote->event->joined = frame->seq;
+			return local_dispatch(local);
+		}
+		log_debug("forward", "[%s]:%s <-> [%s]:%s: ping echo %"PRIu64,
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    frame->seq);
+		return 0;
+	case FRAME_WINDOW:
+		return local_acked(local, frame->seq);
+	case FRAME_CLOSE:
+		if (frame->length == 1) {
+			/* Nothing more on this connection */
+			log_debug("forward", "[%s]:%s <-> [%s]:%s: connection closed by peer",
 			    remote->laddr, remote->lserv,
 			    remote->raddr, remote->rserv);
-			local_destroy(remote->local);
+			remote->event->retire_in = true;
+			event_del(remote->event->read);
+			if (!remote->event->retiring &&
+			    remote_retire(remote) == -1) return -1;
+			return local_reap(local);
+		}
+		log_debug("forward", "[%s]:%s <-> [%s]:%s: end of stream at offset %"PRIu64,
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    frame->seq);
+		local->event->peer_eof = true;
+		local->event->peer_final = frame->seq;
+		return local_close_check(local);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Stop giving frames to a remote and tell the peer this connection carries
+ * nothing more (version 2 of the protocol). The remote is destroyed once
+ * both ends have done so and its parked frames have been delivered.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+int
+remote_retire(struct ro_remote *remote)
+{
+	struct ro_frame frame = {
+		.type = FRAME_CLOSE,
+		.length = 1
+	};
+	log_debug("forward", "[%s]:%s <-> [%s]:%s: close connection",
+	    remote->laddr, remote->lserv,
+	    remote->raddr, remote->rserv);
+	remote->event->retiring = true;
+	return remote_control(remote, &frame);
+}
+
+/**
+ * Offset following the last byte received in order: those bytes are either
+ * in the write pipe or already written to the local endpoint (version 2).
+ */
+static uint64_t
+local_delivered(struct ro_local *local)
+{
+	return frame_first(local->event->version) +
+	    local->stats.in + local->event->pipe.nw;
+}
+
+/**
+ * Record bytes just copied to the replay buffer of a remote.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+replay_keep(struct ro_replay *replay, uint64_t seq, size_t bytes)
+{
+	struct replay_frame *frame = TAILQ_LAST(&replay->frames, replay_frames);
+	replay->bytes += bytes;
+	if (frame != NULL && frame->seq + frame->length == seq) {
+		frame->length += bytes;
+		return 0;
+	}
+	if ((frame = calloc(1, sizeof(struct replay_frame))) == NULL) {
+		log_warn("forward", "unable to allocate memory for replay buffer");
+		return -1;
+	}
+	frame->seq = seq;
+	frame->length = bytes;
+	TAILQ_INSERT_TAIL(&replay->frames, frame, next);
+	return 0;
+}
+
+/**
+ * Release the bytes acknowledged by the peer from a replay buffer.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+replay_trim(struct ro_local *local, struct ro_replay *replay)
+{
+	const struct ro_engine *engine = local->cfg->engine;
+	uint64_t acked = local->event->peer_window;
+	struct replay_frame *frame;
+	while ((frame = TAILQ_FIRST(&replay->frames)) != NULL &&
+	    frame->seq < acked) {
+		size_t n = (acked - frame->seq < frame->length)?
+		    (acked - frame->seq):frame->length;
+		frame->seq += n;
+		frame->length -= n;
+		replay->bytes -= n;
+		while (n > 0) {
+			ssize_t d = engine->discard(&replay->data, n);
+			if (d <= 0) {
+				log_warn("forward", "unexpected problem while releasing replay buffer");
+				return -1;
+			}
+			n -= d;
+		}
+		if (frame->length > 0) break;
+		TAILQ_REMOVE(&replay->frames, frame, next);
+		free(frame);
+	}
+	return 0;
+}
+
+/**
+ * Free a replay buffer.
+ */
+void
+replay_free(struct ro_worker *worker, struct ro_replay *replay)
+{
+	struct replay_frame *frame;
+	if (replay == NULL) return;
+	while ((frame = TAILQ_FIRST(&replay->frames)) != NULL) {
+		TAILQ_REMOVE(&replay->frames, frame, next);
+		free(frame);
+	}
+	slab_buffer_free(worker, &replay->data);
+	free(replay);
+}
+
+/**
+ * Handle an acknowledgement from the peer: the acknowledged bytes are
+ * released from the replay buffers and new frames may be sent.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_acked(struct ro_local *local, uint64_t seq)
+{
+	struct ro_remote *remote, *filling = local->event->filling;
+	struct ro_replay *replay;
+	if (seq <= local->event->peer_window) return 0;
+	local->event->peer_window = seq;
+	local->event->attempts = 0;
+	if (local->cfg->replay == 0) return 0;
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (remote->event->replay != NULL &&
+		    replay_trim(local, remote->event->replay) == -1)
+			goto error;
+	}
+	TAILQ_FOREACH(replay, &local->event->resend, next) {
+		/* The head of this one is being moved */
+		if (filling && filling->event->replay_from == replay) continue;
+		if (replay_trim(local, replay) == -1) goto error;
+	}
+	return local_dispatch(local);
+error:
+	local_destroy(local);
+	return -1;
+}
+
+static void
+local_ack_cb(evutil_socket_t fd, short what, void *arg)
+{
+	local_ack(arg, true);
+}
+
+/**
+ * Acknowledge the bytes delivered to the local endpoint (version 2, with a
+ * replay buffer), for the peer to release them from its replay buffers.
+ * This is done every RO_ACK_BYTES or after a short delay.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_ack(struct ro_local *local, bool now)
+{
+	uint64_t delivered = local_delivered(local);
+	struct ro_remote *remote, *selected = NULL;
+	if (local->event->version < 2 || local->cfg->replay == 0 ||
+	    delivered == local->event->acked)
+		return 0;
+	if (now || delivered - local->event->acked >= RO_ACK_BYTES) {
+		/* Any remote with room for a control frame, prefer an idle one */
+		TAILQ_FOREACH(remote, &local->remotes, next) {
+			if (!remote->connected || remote->event->retiring ||
+			    remote->event->controls == RO_CONTROL_MAX) continue;
+			if (selected == NULL || remote_available(remote))
+				selected = remote;
+			if (remote_available(remote)) break;
+		}
+	}
+	if (selected == NULL) {
+		struct timeval tv = {
+			.tv_sec = RO_ACK_DELAY / 1000,
+			.tv_usec = (RO_ACK_DELAY % 1000) * 1000
+		};
+		if (local->event->ack == NULL &&
+		    (local->event->ack = slab_event_new(local->worker, -1, 0,
+			local_ack_cb, local)) == NULL) {
+			log_warnx("forward", "unable to setup acknowledgement timer for [%s]:%s",
+			    local->addr, local->serv);
+			local_destroy(local);
 			return -1;
 		}
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			return 0;
+		if (!evtimer_pending(local->event->ack, NULL))
+			evtimer_add(local->event->ack, &tv);
+		return 0;
+	}
+	struct ro_frame frame = {
+		.type = FRAME_WINDOW,
+		.seq = delivered
+	};
+	log_debug("forward", "[%s]:%s: acknowledge %"PRIu64" bytes to [%s]:%s",
+	    local->addr, local->serv, delivered,
+	    selected->raddr, selected->rserv);
+	local->event->acked = delivered;
+	if (local->event->ack) evtimer_del(local->event->ack);
+	return remote_control(selected, &frame);
+}
+
+static void
+local_orphan_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_local *local = arg;
+	struct ro_remote *remote;
+	TAILQ_FOREACH(remote, &local->remotes, next)
+	    if (remote->connected) return;
+	log_warnx("forward", "[%s]:%s: no connection came back, give up",
+	    local->addr, local->serv);
+	local_destroy(local);
+}
+
+/**
+ * Give up on a session whose connections were all lost if no replacement
+ * comes back in time (relay only).
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_orphan(struct ro_local *local)
+{
+	struct ro_remote *remote;
+	struct timeval tv = { .tv_sec = RO_REPLAY_TIMEOUT };
+	TAILQ_FOREACH(remote, &local->remotes, next)
+	    if (remote->connected) return 0;
+	if (local->event->orphan == NULL &&
+	    (local->event->orphan = slab_event_new(local->worker, -1, 0,
+		local_orphan_cb, local)) == NULL) {
+		log_warnx("forward", "unable to setup orphan timer for [%s]:%s",
+		    local->addr, local->serv);
+		local_destroy(local);
+		return -1;
+	}
+	evtimer_add(local->event->orphan, &tv);
+	return 0;
+}
+
+/**
+ * Handle the loss of the connection of a remote. Without a replay buffer
+ * (or with version 1 of the protocol, or when some of the frames it carried
+ * were not kept), the whole session is torn down.
+ * Otherwise, the frames the peer did not acknowledge are queued to be sent
+ * again, what was received from this remote but not delivered is dropped
+ * (the peer sends it again) and the proxy opens a replacement connection.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_lost(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	struct ro_cfg *cfg = local->cfg;
+	if (remote->event->lost) return 0;
+	if (cfg->replay == 0 || local->event->version < 2 ||
+	    !remote->connected) {
+		local_destroy(local);
+		return -1;
+	}
+	if (remote->event->unkept > local->event->peer_window) {
+		log_info("forward", "[%s]:%s: connection [%s]:%s <-> [%s]:%s lost with frames not kept for replay",
+		    local->addr, local->serv,
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv);
+		local_destroy(local);
+		return -1;
+	}
+	log_info("forward", "[%s]:%s: connection [%s]:%s <-> [%s]:%s lost, send its frames again",
+	    local->addr, local->serv,
+	    remote->laddr, remote->lserv,
+	    remote->raddr, remote->rserv);
+	local->stats.lost++;
+	remote->event->lost = true;
+	remote->connected = false;
+	event_del(remote->event->read);
+	event_del(remote->event->write);
+
+	/* The frame being moved is cut after what was copied to the replay
+	 * buffer. The remaining is given back to its source. */
+	if (local->event->filling == remote) {
+		struct ro_replay *from = remote->event->replay_from;
+		struct ro_buffer *source = from?&from->data:&local->event->pipe.read;
+		uint64_t cut = remote->event->send_seq + remote->event->send_frame -
+		    remote->event->send_fill + remote->event->replay_ahead;
+		size_t remaining = remote->event->send_fill - remote->event->replay_ahead;
+		size_t ahead = remote->event->replay_ahead;
+		while (ahead > 0) {
+			ssize_t n = cfg->engine->discard(source, ahead);
+			if (n <= 0) {
+				log_warn("forward", "unexpected problem while cutting frame");
+				local_destroy(local);
+				return -1;
+			}
+			ahead -= n;
+		}
+		if (from == NULL) {
+			local->event->pipe.nr -= remote->event->replay_ahead;
+			local->event->send_next = cut;
+		} else {
+			from->bytes -= remote->event->replay_ahead;
+			if (remaining > 0) {
+				struct replay_frame *frame;
+				if ((frame = calloc(1, sizeof(struct replay_frame))) == NULL) {
+					log_warn("forward", "unable to allocate memory for replay buffer");
+					local_destroy(local);
+					return -1;
+				}
+				frame->seq = cut;
+				frame->length = remaining;
+				TAILQ_INSERT_HEAD(&from->frames, frame, next);
+			}
+		}
+		local->event->filling = NULL;
+	}
+	remote->event->send_bytes = remote->event->send_fill =
+	    remote->event->send_frame = remote->event->replay_ahead = 0;
+	remote->event->send_since = 0;
+	remote->event->replay_from = NULL;
+	remote->event->controls = 0;
+	if (remote->event->replay != NULL) {
+		if (replay_trim(local, remote->event->replay) == -1) {
+			local_destroy(local);
+			return -1;
 		}
-		log_warn("remote", "unable to send header to [%s]:%s",
+		remote->event->replay->lost = local->stats.lost;
+		TAILQ_INSERT_TAIL(&local->event->resend, remote->event->replay, next);
+		remote->event->replay = NULL;
+
+		/* The replacement may already be there, waiting for us to
+		 * notice this loss: `local_resend()` gives it the frames. */
+		struct ro_remote *other;
+		TAILQ_FOREACH(other, &local->remotes, next) {
+			if (other->event->joining &&
+			    other->event->joined == local->stats.lost)
+				event_add(other->event->write, NULL);
+		}
+	}
+	if (remote->event->close_carrier)
+		local->event->close_queued = local->event->close_done = false;
+	local->event->acked = 0;	/* Acknowledgements may have been lost */
+
+	/* Frames received from this remote are sent again by the peer */
+	if (local->event->current_receive_remote == remote) {
+		local->event->receive_next = local_delivered(local);
+		local->event->current_receive_remote = NULL;
+	}
+	struct parked_frame *frame;
+	while ((frame = TAILQ_FIRST(&remote->event->frames)) != NULL) {
+		TAILQ_REMOVE(&remote->event->frames, frame, next);
+		free(frame);
+	}
+	local->event->parked -= remote->event->parked;
+	remote->event->parked = 0;
+	remote->event->framed = remote->event->stalled = false;
+
+	if (cfg->role == ROLE_PROXY) {
+		if (local->event->attempts++ >= RO_REPLAY_ATTEMPTS) {
+			log_warnx("forward", "[%s]:%s: too many connections lost, give up",
+			    local->addr, local->serv);
+			local_destroy(local);
+			return -1;
+		}
+		if (connection_open(cfg, local) == -1) {
+			log_warnx("forward", "[%s]:%s: unable to open a replacement connection",
+			    local->addr, local->serv);
+			local_destroy(local);
+			return -1;
+		}
+	} else if (local_orphan(local) == -1)
+		return -1;
+	return local_reap(local);
+}
+
+/**
+ * Check a data frame whose header was just received against what we already
+ * have. The peer sends again the frames of a connection it lost: if we did
+ * not notice the loss yet, the remote carrying them first is lost now.
+ * Bytes already delivered are skipped.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_replayed(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	struct ro_remote *other, *other_next;
+	uint64_t seq = remote->event->receive_seq;
+	uint64_t end = seq + remote->event->remaining_bytes;
+	for (other = TAILQ_FIRST(&local->remotes);
+	     other != NULL;
+	     other = other_next) {
+		other_next = TAILQ_NEXT(other, next);
+		if (other == remote || other->event->lost) continue;
+		bool overlap = (local->event->current_receive_remote == other &&
+		    seq < local->event->receive_next &&
+		    end > local_delivered(local));
+		struct parked_frame *frame;
+		TAILQ_FOREACH(frame, &other->event->frames, next)
+		    if (seq < frame->seq + frame->length && frame->seq < end)
+			    overlap = true;
+		if (!overlap) continue;
+		if (remote_lost(other) == -1) return -1;
+	}
+	if (seq < local->event->receive_next) {
+		uint64_t skip = ((end < local->event->receive_next)?
+		    end:local->event->receive_next) - seq;
+		log_debug("forward",
+		    "[%s]:%s <-> [%s]:%s: %"PRIu64" bytes already received (offset %"PRIu64")",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    skip, seq);
+		remote->event->duplicate = skip;
+		remote->event->receive_seq += skip;
+		remote->event->remaining_bytes -= skip;
+	}
+	return 0;
+}
+
+static uint64_t
+timespec_elapsed(struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000ULL +
+	    (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/**
+ * Create the reorder buffer of a remote.
+ */
+static int
+remote_park_init(struct ro_remote *remote)
+{
+	if (remote->event->park.ready) return 0;
+	if (slab_buffer_init(remote->local->worker, &remote->event->park,
+		remote->cfg->reorder) == -1) {
+		log_warn("forward", "unable to create reorder buffer for [%s]:%s <-> [%s]:%s",
+		    remote->laddr, remote->lserv,
 		    remote->raddr, remote->rserv);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Decide what to do with the frame whose header was just received: either
+ * deliver it directly if this is the one we are waiting for or park it in the
+ * reorder buffer.
+ *
+ * @return true if a decision has been taken, false if we need to wait for
+ *         room in the reorder buffer.
+ */
+static bool
+remote_receive_decide(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	if (local->event->current_receive_remote == NULL &&
+	    remote->event->receive_seq == local->event->receive_next &&
+	    TAILQ_EMPTY(&remote->event->frames)) {
+		local->event->receive_next = frame_next(local->event->version,
+		    remote->event->receive_seq, remote->event->remaining_bytes);
+		local->event->current_receive_remote = remote;
+		remote->event->receive_mode = RECEIVE_DIRECT;
+		log_debug("forward",
+		    "[%s]:%s <-> [%s]:%s: "
+		    "receiving %"PRIu32" bytes (sequence is %"PRIu64")",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    remote->event->remaining_bytes,
+		    remote->event->receive_seq);
+		return true;
+	}
+
+	/* Not the right remote, park the frame if we have room */
+	struct parked_frame *frame = NULL;
+	if (local->event->parked >= local->cfg->reorder ||
+	    remote_park_init(remote) == -1 ||
+	    (frame = calloc(1, sizeof(struct parked_frame))) == NULL) {
+		if (!remote->event->stalled) {
+			local->stats.reorder_full++;
+			METRIC_ADD(local->worker->metrics.reorder_stalls, 1);
+		}
+		log_debug("forward",
+		    "[%s]:%s <-> [%s]:%s: "
+		    "sequence is %" PRIu64 " while expecting %" PRIu64"; "
+		    "reorder buffer full, stop reading",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    remote->event->receive_seq,
+		    local->event->receive_next);
+		remote->event->stalled = true;
+		return false;
+	}
+	log_debug("forward",
+	    "[%s]:%s <-> [%s]:%s: "
+	    "sequence is %" PRIu64 " while expecting %" PRIu64"; park %"PRIu32" bytes",
+	    remote->laddr, remote->lserv,
+	    remote->raddr, remote->rserv,
+	    remote->event->receive_seq,
+	    local->event->receive_next,
+	    remote->event->remaining_bytes);
+	frame->seq = remote->event->receive_seq;
+	frame->length = remote->event->remaining_bytes;
+	frame->complete = (remote->event->remaining_bytes == 0);
+	clock_gettime(CLOCK_MONOTONIC, &frame->since);
+	TAILQ_INSERT_TAIL(&remote->event->frames, frame, next);
+	remote->event->stalled = false;
+	remote->event->receive_mode = RECEIVE_PARKED;
+	return true;
+}
+
+/**
+ * Move parked frames to the write pipe as long as they are the ones we
+ * expect.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_deliver(struct ro_local *local)
+{
+	bool freed = false;
+	while (1) {
+		struct ro_remote *remote = local->event->current_receive_remote;
+		struct parked_frame *frame = NULL;
+		uint64_t expected = local->event->receive_next;
+
+		if (remote != NULL) {
+			/* Already delivering a frame directly */
+			if (remote->event->receive_mode == RECEIVE_DIRECT &&
+			    TAILQ_EMPTY(&remote->event->frames))
+				break;
+			frame = TAILQ_FIRST(&remote->event->frames);
+			if (frame == NULL) break;
+		} else {
+			/* Search for the next frame */
+			TAILQ_FOREACH(remote, &local->remotes, next) {
+				frame = TAILQ_FIRST(&remote->event->frames);
+				if (frame && frame->seq == expected) break;
+				if (!frame &&
+				    remote->event->receive_mode == RECEIVE_UNDECIDED &&
+				    remote->event->framed &&
+				    remote->event->receive_seq == expected) {
+					/* Stalled remote, waiting for room */
+					log_debug("forward",
+					    "[%s]:%s <-> [%s]:%s: next remote, start reading",
+					    remote->laddr, remote->lserv,
+					    remote->raddr, remote->rserv);
+					remote_wake(remote);
+					break;
+				}
+			}
+			if (remote == NULL || frame == NULL) break;
+			local->event->receive_next = frame_next(local->event->version,
+			    frame->seq, frame->length);
+			local->event->current_receive_remote = remote;
+			if (!frame->counted) {
+				uint64_t waited = timespec_elapsed(&frame->since);
+				frame->counted = true;
+				local->stats.reordered++;
+				local->stats.reorder_wait += waited;
+				if (waited > local->stats.reorder_max)
+					local->stats.reorder_max = waited;
+			}
+			log_debug("forward",
+			    "[%s]:%s <-> [%s]:%s: deliver parked frame %"PRIu64,
+			    remote->laddr, remote->lserv,
+			    remote->raddr, remote->rserv,
+			    frame->seq);
+		}
+
+		/* Move parked bytes to the write pipe */
+		while (frame->bytes > 0) {
+			ssize_t n = local->cfg->engine->move(&remote->event->park,
+			    &local->event->pipe.write,
+			    frame->bytes);
+			if (n <= 0) {
+				if (n == -1 && errno == ENOBUFS)
+					/* Write pipe is full, we will be called
+					 * again once some room is available. */
+					goto end;
+				log_warn("forward", "unexpected problem while moving data from reorder buffer");
+				local_destroy(local);
+				return -1;
+			}
+			frame->bytes -= n;
+			remote->event->parked -= n;
+			local->event->parked -= n;
+			local->event->pipe.nw += n;
+			if (local->latency)
+				latency_in(&local->latency->write, n);
+			freed = true;
+			event_add(local->event->write, NULL);
+		}
+		TAILQ_REMOVE(&remote->event->frames, frame, next);
+		if (!frame->complete) {
+			/* The remaining of the frame is still on the socket,
+			 * switch to direct mode for this remote. */
+			remote->event->receive_mode = RECEIVE_DIRECT;
+			remote_wake(remote);
+			free(frame);
+			break;
+		}
+		if (local->latency)
+			latency_observe(local, STAGE_RECEIVE,
+			    timespec_elapsed(&frame->since));
+		free(frame);
+		local->event->current_receive_remote = NULL;
+		if (remote->event->retire_in &&
+		    TAILQ_EMPTY(&remote->event->frames) &&
+		    local_reap(local) == -1)
+			return -1;
+	}
+end:
+	if (freed) {
+		/* Some room in reorder buffer, wake up stalled remotes */
+		struct ro_remote *remote;
+		TAILQ_FOREACH(remote, &local->remotes, next) {
+			if (remote->event->stalled)
+				remote_wake(remote);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Receive frames from remote end.
+ *
+ * If the frame being received is the one we expect, the data is moved to
+ * the write pipe. Otherwise, it is moved to the reorder pipe of the remote
+ * such that all remotes can keep receiving data. If the reorder buffer is
+ * full, we stop reading from the remote until some room is available.
+ */
+static void
+remote_frame_in(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+
+	while (1) {
+		/* Read the remaining of the header if needed */
+		if (!remote->event->framed) {
+			/* No header yet */
+			uint8_t version = local->event->version;
+			ssize_t n = remote_prepare_receiving(remote);
+			if (n < 0) return;
+			if (n == 0) {
+				log_debug("forward",
+				    "[%s]:%s <-> [%s]:%s: no incoming data available, start reading",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv);
+				event_add(remote->event->read, NULL);
+				return;
+			}
+			remote->event->partial_bytes += n;
+			if (remote->event->partial_bytes <
+			    frame_header_size(version, remote->event->partial_header,
+				remote->event->partial_bytes))
+				continue;	/* Header still incomplete */
+			struct ro_frame frame;
+			if (frame_decode(version, remote->event->partial_header,
+				&frame) == -1) {
+				log_warnx("remote", "invalid frame received from [%s]:%s",
+				    remote->raddr, remote->rserv);
+				local_destroy(local);
+				return;
+			}
+			remote->event->partial_bytes = 0;
+			if (frame.type != FRAME_DATA) {
+				if (remote_control_in(remote, &frame) == -1) return;
+				if (remote->event->retire_in || remote->event->lost)
+					return;
+				continue;
+			}
+			remote->event->framed = true;
+			if (remote->event->joining &&
+			    !remote->event->announced) {
+				/* The proxy keeps no replay buffer */
+				remote->event->joining = false;
+				event_add(remote->event->write, NULL);
+			}
+			METRIC_ADD(local->worker->metrics.frames[1], 1);
+			if (local->latency)
+				remote->event->receive_since = latency_now();
+			remote->event->receive_seq = frame.seq;
+			remote->event->remaining_bytes = frame.length;
+			remote->event->receive_mode = RECEIVE_UNDECIDED;
+			if (version >= 2 && remote_replayed(remote) == -1)
+				return;
+		}
+
+		/* Drop what we already received from a lost remote */
+		while (remote->event->duplicate > 0) {
+			char buf[MAX_SPLICE_BYTES];
+			ssize_t n = remote_read(remote, NULL, buf,
+			    (remote->event->duplicate < sizeof(buf))?
+			    remote->event->duplicate:sizeof(buf));
+			if (n <= 0) {
+				if (n == -1 && errno == EAGAIN) {
+					event_add(remote->event->read, NULL);
+					return;
+				}
+				log_warn("remote", "unable to receive from [%s]:%s",
+				    remote->raddr, remote->rserv);
+				remote_lost(remote);
+				return;
+			}
+			remote->event->duplicate -= n;
+		}
+		if (remote->event->remaining_bytes == 0) {
+			remote->event->framed = false;
+			continue;
+		}
+
+		/* If header is here, check where the data should go */
+		if (remote->event->receive_mode == RECEIVE_UNDECIDED &&
+		    !remote_receive_decide(remote)) {
+			event_del(remote->event->read);
+			return;
+		}
+
+		/* Splice data */
+		bool direct = (remote->event->receive_mode == RECEIVE_DIRECT);
+		while (remote->event->remaining_bytes > 0) {
+			size_t max = remote->event->remaining_bytes;
+			if (!direct) {
+				/* Don't go over the size of reorder buffer */
+				if (local->event->parked >= local->cfg->reorder) {
+					log_debug("forward",
+					    "[%s]:%s <-> [%s]:%s: reorder buffer full, stop reading",
+					    remote->laddr, remote->lserv,
+					    remote->raddr, remote->rserv);
+					if (!remote->event->stalled) {
+						local->stats.reorder_full++;
+						METRIC_ADD(local->worker->metrics.reorder_stalls, 1);
+					}
+					remote->event->stalled = true;
+					event_del(remote->event->read);
+					return;
+				}
+				if (max > local->cfg->reorder - local->event->parked)
+					max = local->cfg->reorder - local->event->parked;
+			}
+			ssize_t n = remote_read(remote,
+			    direct?&local->event->pipe.write:&remote->event->park,
+			    NULL, max);
+			if (n <= 0) {
+				if (n == 0) {
+					log_debug("remote",
+					    "while remote frame in, connection [%s]:%s <-> [%s]:%s closed",
+					    remote->laddr, remote->lserv,
+					    remote->raddr, remote->rserv);
+					remote_lost(remote);
+					return;
+				}
+				if (errno == EAGAIN) {
+					/* Nothing to read yet. What we got of
+					 * this frame is acknowledged now: the
+					 * peer may wait for it to send the
+					 * rest. */
+					METRIC_ADD(local->worker->metrics.eagain[0], 1);
+					event_add(remote->event->read, NULL);
+					if (direct) local_ack(local, false);
+					return;
+				}
+				if (errno == ENOBUFS) {
+					/* The pipe is full. For the write pipe, we
+					 * will be woken up once the local end has
+					 * been written. For the reorder pipe, once
+					 * the frames have been delivered. */
+					log_debug("forward",
+					    "[%s]:%s <-> [%s]:%s: %s pipe full, stop reading",
+					    remote->laddr, remote->lserv,
+					    remote->raddr, remote->rserv,
+					    direct?"write":"reorder");
+					event_del(remote->event->read);
+					if (!direct) remote->event->stalled = true;
+					else local_ack(local, false);
+					return;
+				}
+				log_warn("remote", "unexpected problem while receiving from [%s]:%s",
+				    remote->raddr, remote->rserv);
+				remote_lost(remote);
+				return;
+			}
+			remote->stats.in += n;
+			remote->event->remaining_bytes -= n;
+			if (direct) {
+				local->event->pipe.nw += n;
+				if (local->latency)
+					latency_in(&local->latency->write, n);
+				/* We put data in the write pipe, let's read it */
+				event_add(local->event->write, NULL);
+			} else {
+				struct parked_frame *frame =
+				    TAILQ_LAST(&remote->event->frames, parked_frame_head);
+				frame->bytes += n;
+				remote->event->parked += n;
+				local->event->parked += n;
+			}
+		}
+
+		/* Frame completely received, be ready for next header */
+		remote->event->framed = false;
+		remote->event->receive_mode = RECEIVE_UNDECIDED;
+		if (direct) {
+			if (local->latency)
+				latency_observe(local, STAGE_RECEIVE,
+				    latency_now() - remote->event->receive_since);
+			log_debug("forward",
+			    "[%s]:%s <-> [%s]:%s: read all data from remote, find the next remote",
+			    remote->laddr, remote->lserv,
+			    remote->raddr, remote->rserv);
+			local->event->current_receive_remote = NULL;
+			if (local_deliver(local) == -1) return;
+			if (local_ack(local, false) == -1) return;
+			if (remote->event->lost) return;
+		} else {
+			TAILQ_LAST(&remote->event->frames, parked_frame_head)->complete = true;
+		}
+	}
+}
+
+/**
+ * Account the time taken to send a data frame, once it is gone.
+ */
+static void
+remote_send_done(struct ro_remote *remote)
+{
+	if (remote->event->send_since == 0) return;
+	latency_observe(remote->local, STAGE_SEND,
+	    latency_now() - remote->event->send_since);
+	remote->event->send_since = 0;
+}
+
+/**
+ * Send the pending frame of a remote.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_frame_out(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+
+	/* Send header and data. Only the part of the frame already moved
+	 * to the send pipe can be sent. Pending control frames are sent
+	 * after it. */
+again:
+	while (remote->event->send_bytes > remote->event->send_fill) {
+		ssize_t n = remote->cfg->engine->write_out(&remote->event->send,
+		    event_get_fd(remote->event->write),
+		    remote->event->send_bytes - remote->event->send_fill);
+		if (n <= 0) {
+			if (n == 0) {
+				log_debug("remote",
+				    "while remote frame out, connection [%s]:%s <-> [%s]:%s closed",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv);
+				return remote_lost(remote);
+			}
+			if (errno == EAGAIN) {
+				log_debug("forward",
+				    "[%s]:%s <-> [%s]:%s: currently cannot send data to remote (%"PRIu32" remaining), "
+				    "start writing",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv,
+				    remote->event->send_bytes);
+				METRIC_ADD(local->worker->metrics.eagain[1], 1);
+				event_add(remote->event->write, NULL);
+				return 0;
+			}
+			log_warn("remote", "unexpected problem while sending to [%s]:%s",
+			    remote->raddr, remote->rserv);
+			return remote_lost(remote);
+		}
+		/* Don't account the header */
+		size_t header = (remote->event->send_bytes > remote->event->send_frame)?
+		    (remote->event->send_bytes - remote->event->send_frame):0;
+		remote->stats.out += ((size_t)n > header)?(n - header):0;
+		remote->event->send_bytes -= n;
+	}
+	if (remote->event->send_bytes == 0) remote_send_done(remote);
+	if (remote->event->send_bytes == 0 && remote_control_load(remote))
+		goto again;
+	event_del(remote->event->write);
+	remote_send_release(remote);
+	if (remote->event->send_bytes == 0 && remote->event->retire_out) {
+		remote->event->retire_out = false;
+		remote->event->retired = true;
+		if (local_reap(local) == -1) return -1;
+	}
+	if (remote->event->send_bytes == 0 && remote->event->close_out) {
+		remote->event->close_out = false;
+		local->event->close_done = true;
+		return local_close_check(local);
+	}
+	if (remote->event->send_bytes == 0 && local->event->shut)
+		return local_close_check(local);
+	return 0;
+}
+
+/**
+ * Give the send pipe of an idle remote back to the worker. Like reorder
+ * pipes, send pipes are only held while there is something to send.
+ */
+void
+remote_send_release(struct ro_remote *remote)
+{
+	if (!remote->cfg->engine->pipes || !remote->event->send.ready ||
+	    remote->event->send_bytes > 0 || remote->event->controls > 0)
+		return;
+	slab_buffer_free(remote->local->worker, &remote->event->send);
+}
+
+static bool
+remote_sending(struct ro_remote *remote)
+{
+	return (remote->event->send_bytes > 0);
+}
+
+/**
+ * Create the pipe holding the pending frame of a remote and, if needed, its
+ * replay buffer.
+ */
+static int
+remote_send_init(struct ro_remote *remote)
+{
+	const struct ro_engine *engine = remote->cfg->engine;
+	struct ro_replay *replay;
+	if (remote->cfg->replay > 0 && remote->event->replay == NULL &&
+	    remote->local->event->version >= 2) {
+		/* Best effort for the size, the replay buffer may fill up
+		 * before the limit. Pipes cannot grow past the limit of
+		 * the system. */
+		size_t size = remote->cfg->replay;
+		if (engine->pipes && remote->cfg->max_pipe > 0 &&
+		    size > remote->cfg->max_pipe)
+			size = remote->cfg->max_pipe;
+		if ((replay = calloc(1, sizeof(struct ro_replay))) == NULL ||
+		    slab_buffer_init(remote->local->worker, &replay->data, size) == -1) {
+			log_warn("forward", "unable to create replay buffer for [%s]:%s <-> [%s]:%s",
+			    remote->laddr, remote->lserv,
+			    remote->raddr, remote->rserv);
+			free(replay);
+			return -1;
+		}
+		TAILQ_INIT(&replay->frames);
+		remote->event->replay = replay;
+	}
+	if (remote->event->send.ready) return 0;
+	/* Make room for the header on top of the whole read pipe. Best
+	 * effort, frames are completed later otherwise. */
+	if (slab_buffer_init(remote->local->worker, &remote->event->send,
+		engine->capacity(&remote->local->event->pipe.read) +
+		RO_HEADER_MAX) == -1) {
+		log_warn("forward", "unable to create send pipe for [%s]:%s <-> [%s]:%s",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv);
+		return -1;
+	}
+	if (remote->cfg->zerocopy && engine->zerocopy &&
+	    engine->zerocopy(&remote->event->send,
+		event_get_fd(remote->event->write)) == -1)
+		log_warn("forward", "unable to enable zerocopy for [%s]:%s <-> [%s]:%s",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv);
+	return 0;
+}
+
+/**
+ * Move the remaining of the current frame of a remote from the read pipe (or
+ * from the replay buffer of a lost remote) to its send pipe. With a replay
+ * buffer, the payload is copied there first.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_send_fill(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	const struct ro_engine *engine = remote->cfg->engine;
+	struct ro_replay *replay = remote->event->replay;
+	struct ro_replay *from = remote->event->replay_from;
+	struct ro_buffer *source = from?&from->data:&local->event->pipe.read;
+	while (remote->event->send_fill > 0) {
+		size_t max = remote->event->send_fill;
+		uint64_t seq = remote->event->send_seq +
+		    remote->event->send_frame - remote->event->send_fill;
+		if (replay != NULL && remote->event->replay_ahead == 0) {
+			/* Keep a copy unless over budget. Waiting for an
+			 * acknowledgement instead could deadlock: it may
+			 * come behind data the peer cannot deliver until
+			 * we send more. */
+			uint64_t unacked = seq - local->event->peer_window;
+			size_t room = (unacked < local->cfg->replay)?
+			    (local->cfg->replay - unacked):0;
+			ssize_t n = (room > 0)?
+			    engine->tee(source, &replay->data,
+				(max < room)?max:room):0;
+			if (n < 0 && errno != ENOBUFS) {
+				log_warn("forward", "unexpected problem while copying data to replay buffer");
+				local_destroy(local);
+				return -1;
+			}
+			if (n > 0) {
+				if (replay_keep(replay, seq, n) == -1) {
+					local_destroy(local);
+					return -1;
+				}
+				remote->event->replay_ahead = n;
+			} else
+				log_debug("forward",
+				    "[%s]:%s <-> [%s]:%s: replay buffer full, %"PRIu32" bytes not kept",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv,
+				    remote->event->send_fill);
+		}
+		if (remote->event->replay_ahead > 0)
+			max = remote->event->replay_ahead;
+		ssize_t n = engine->move(source, &remote->event->send, max);
+		if (n <= 0) {
+			if (n == -1 && errno == ENOBUFS) {
+				/* Send pipe is full */
+				log_debug("forward",
+				    "[%s]:%s <-> [%s]:%s: send pipe full, %"PRIu32" bytes to move later",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv,
+				    remote->event->send_fill);
+				local->event->filling = remote;
+				return 0;
+			}
+			log_warn("forward", "unexpected problem while moving data to send pipe");
+			local_destroy(local);
+			return -1;
+		}
+		if (from == NULL) local->event->pipe.nr -= n;
+		else from->bytes -= n;
+		remote->event->send_fill -= n;
+		if (remote->event->replay_ahead > 0)
+			remote->event->replay_ahead -= n;
+		else if (replay != NULL)
+			remote->event->unkept = seq + n;
+	}
+	local->event->filling = NULL;
+	remote->event->replay_from = NULL;
+	return 0;
+}
+
+/**
+ * Move the current frame of a remote to its send pipe and send it. When the
+ * send pipe is too small for the whole frame, it is drained to the remote
+ * until either everything has been moved or the remote cannot accept more
+ * data.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_send(struct ro_remote *remote)
+{
+	do {
+		if (remote_send_fill(remote) == -1) return -1;
+		if (remote_frame_out(remote) == -1) return -1;
+	} while (remote->event->send_fill > 0 &&
+	    remote->event->send_bytes == remote->event->send_fill);
+	return 0;
+}
+
+/**
+ * Give a data frame to a remote: the header is encoded and the payload will
+ * be moved by `remote_send_fill()`.
+ */
+static void
+remote_send_prepare(struct ro_remote *remote, uint64_t seq, size_t n)
+{
+	struct ro_frame frame = {
+		.type = FRAME_DATA,
+		.seq = seq,
+		.length = n
+	};
+	remote->event->send_header_size = frame_encode(remote->local->event->version,
+	    &frame, remote->event->send_header);
+	remote->event->send_seq = seq;
+	remote->event->send_frame = n;
+	remote->event->send_fill = n;
+	remote->event->send_bytes = remote->event->send_header_size + n;
+	if (remote->local->latency) remote->event->send_since = latency_now();
+}
+
+/**
+ * Account for a frame once its header is in the send pipe: it cannot be
+ * given back anymore.
+ */
+static void
+remote_send_account(struct ro_remote *remote)
+{
+	METRIC_ADD(remote->local->worker->metrics.frames[0], 1);
+	metrics_observe(&remote->local->worker->metrics.frame_size,
+	    remote->event->send_frame);
+}
+
+/**
+ * Put the header of the prepared frame in the send pipe of a remote and
+ * start sending the frame.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+remote_send_start(struct ro_remote *remote)
+{
+	/* The send pipe is empty, this cannot block. */
+	remote->local->event->last_send_remote = remote;
+	if (remote->cfg->engine->put(&remote->event->send, remote->event->send_header,
+		remote->event->send_header_size) !=
+	    (ssize_t)remote->event->send_header_size) {
+		log_warn("forward", "unable to write header to send pipe");
 		local_destroy(remote->local);
 		return -1;
 	}
-	return n;
+	remote_send_account(remote);
+	return remote_send(remote);
+}
+
+/**
+ * Give the frames of lost remotes to their replacements, with their original
+ * offsets.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_resend(struct ro_local *local)
+{
+	struct ro_cfg *cfg = local->cfg;
+	struct ro_replay *replay;
+	struct ro_remote *remote;
+	while (local->event->filling == NULL &&
+	    (replay = TAILQ_FIRST(&local->event->resend)) != NULL) {
+		struct replay_frame *frame;
+		if (replay_trim(local, replay) == -1) {
+			local_destroy(local);
+			return -1;
+		}
+		if ((frame = TAILQ_FIRST(&replay->frames)) == NULL) {
+			TAILQ_REMOVE(&local->event->resend, replay, next);
+			replay_free(local->worker, replay);
+			continue;
+		}
+		size_t n = frame->length;
+		if (cfg->max_frame > 0 && n > cfg->max_frame)
+			n = cfg->max_frame;
+		/* Surviving remotes may have many frames queued in the
+		 * kernel: the peer would have to park all of them before
+		 * getting the missing ones. Only use a replacement. */
+		TAILQ_FOREACH(remote, &local->remotes, next) {
+			if (remote->connected &&
+			    !remote->event->retiring &&
+			    remote->event->send_bytes == 0 &&
+			    remote->event->joined >= replay->lost &&
+			    remote->event->joined <= local->stats.lost) break;
+		}
+		if (remote == NULL) break;
+		if (remote_send_init(remote) == -1) {
+			local_destroy(local);
+			return -1;
+		}
+		remote_send_prepare(remote, frame->seq, n);
+		frame->seq += n;
+		frame->length -= n;
+		if (frame->length == 0) {
+			TAILQ_REMOVE(&replay->frames, frame, next);
+			free(frame);
+		}
+		log_debug("forward",
+		    "[%s]:%s <-> [%s]:%s: send again %zu bytes (offset %"PRIu64")",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    n, remote->event->send_seq);
+		remote->event->replay_from = replay;
+		if (remote_send_start(remote) == -1) return -1;
+	}
+	if (local->event->filling != NULL) return 0;
+
+	/* A replacement waiting for us to notice its losses gets new
+	 * frames once the frames of these losses are all sent again. */
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (!remote->event->joining || !remote->event->announced ||
+		    remote->event->joined > local->stats.lost) continue;
+		TAILQ_FOREACH(replay, &local->event->resend, next)
+			if (replay->lost <= remote->event->joined) break;
+		if (replay == NULL) remote->event->joining = false;
+	}
+	return 0;
+}
+
+/**
+ * Compute the size of the frames to cut from the read pipe. A large burst
+ * is spread over all the connected remotes but frames are kept between the
+ * configured minimum and maximum sizes.
+ */
+static size_t
+local_frame_size(struct ro_local *local)
+{
+	struct ro_cfg *cfg = local->cfg;
+	struct ro_remote *remote;
+	size_t connected = 0, size = local->event->pipe.nr;
+	TAILQ_FOREACH(remote, &local->remotes, next)
+	    if (remote->connected && !remote->event->retiring) connected++;
+	if (connected > 1)
+		size = (size + connected - 1) / connected;
+	if (size < cfg->min_frame)
+		size = cfg->min_frame;
+	if (cfg->max_frame > 0 && size > cfg->max_frame)
+		size = cfg->max_frame;
+	return size;
+}
+
+/**
+ * Frames cut by `local_dispatch()` when io_uring is used. They are moved to
+ * the send pipes and sent to the remotes with a couple of system calls.
+ */
+struct dispatch_batch {
+	struct ro_local *local;
+	unsigned count;
+	struct {
+		struct ro_remote *remote;
+		int header;	/* Result of header write */
+		int move;	/* Result of move to send pipe */
+		int out;	/* Result of splice to remote */
+	} frames[RO_URING_BATCH];
+};
+
+static void
+dispatch_batch_cb(uint64_t data, int res, void *arg)
+{
+	struct dispatch_batch *batch = arg;
+	unsigned i = data >> 2;
+	switch (data & 3) {
+	case 0: batch->frames[i].header = res; break;
+	case 1: batch->frames[i].move = res; break;
+	case 2: batch->frames[i].out = res; break;
+	}
 }
 
 /**
- * Receive the header from the remote nd
+ * Move and send frames from a batch.
+ *
+ * In a first step, headers and payloads are moved to the send pipes. They
+ * are linked together to ensure payloads are taken from the read pipe in
+ * order. In a second step, send pipes are spliced to the remotes.
  *
- * @param partial How many bytes (of the header) we have to receive yet.
- * @return        How many bytes (of the header) we have received
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
  */
-static ssize_t
-remote_prepare_receiving(struct ro_remote *remote, size_t partial)
+static int
+dispatch_batch_flush(struct dispatch_batch *batch)
 {
-	ssize_t n;
-	while ((n = read(event_get_fd(remote->event->read),
-		    (char *)remote->event->partial_header + partial,
-		    RO_HEADER_SIZE - partial)) <= 0) {
-		if (errno == EINTR) continue;
-		if (n == 0) {
+	struct ro_local *local = batch->local;
+	struct ro_uring *ring = local->worker->event->uring;
+	struct ro_remote *remote;
+	unsigned i, count = batch->count;
+	if (count == 0) return 0;
+	batch->count = 0;
+
+	for (i = 0; i < count; i++) {
+		remote = batch->frames[i].remote;
+		batch->frames[i].header = batch->frames[i].move =
+		    batch->frames[i].out = -ECANCELED;
+		uring_write(ring, remote->event->send.pipe[1],
+		    remote->event->send_header, remote->event->send_header_size,
+		    true, (i << 2) | 0);
+		uring_splice(ring, local->event->pipe.read.pipe[0],
+		    remote->event->send.pipe[1], remote->event->send_fill,
+		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK,
+		    i < count - 1, (i << 2) | 1);
+	}
+	if (uring_submit(ring, dispatch_batch_cb, batch) == -1) {
+		local_destroy(local);
+		return -1;
+	}
+
+	/* Check what was moved. Once a frame was not moved entirely, the
+	 * next ones were not processed and are given back. */
+	unsigned moved;
+	for (moved = 0; moved < count; moved++) {
+		remote = batch->frames[moved].remote;
+		if (batch->frames[moved].header !=
+		    (int)remote->event->send_header_size) break;
+		int res = batch->frames[moved].move;
+		if (res < 0 && res != -EAGAIN) {
+			errno = -res;
+			log_warn("forward", "unexpected problem while splicing to send pipe");
+			local_destroy(local);
+			return -1;
+		}
+		if (res > 0) remote->event->send_fill -= res;
+		if (remote->event->send_fill > 0) {
+			/* Send pipe is full, the remaining will be moved
+			 * later. */
+			local->event->pipe.nr += remote->event->send_fill;
+			local->event->filling = remote;
+			moved++;
+			break;
+		}
+	}
+	if (moved < count)
+		local->event->send_next = batch->frames[moved].remote->event->send_seq;
+	for (i = moved; i < count; i++) {
+		remote = batch->frames[i].remote;
+		if (batch->frames[i].header > 0) {
+			log_warnx("forward", "header written for a canceled frame");
+			local_destroy(local);
+			return -1;
+		}
+		local->event->pipe.nr += remote->event->send_frame;
+		if (local->latency)
+			local->latency->read.out -= remote->event->send_frame;
+		remote->event->send_frame = remote->event->send_fill =
+		    remote->event->send_bytes = 0;
+		remote->event->send_since = 0;
+	}
+	if (moved == 0) {
+		log_warnx("forward", "unable to write header to send pipe");
+		local_destroy(local);
+		return -1;
+	}
+	local->event->last_send_remote = batch->frames[moved - 1].remote;
+
+	/* Send to remotes */
+	for (i = 0; i < moved; i++) {
+		remote = batch->frames[i].remote;
+		remote_send_account(remote);
+		uring_splice(ring, remote->event->send.pipe[0],
+		    event_get_fd(remote->event->write),
+		    remote->event->send_bytes - remote->event->send_fill,
+		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK,
+		    false, (i << 2) | 2);
+	}
+	if (uring_submit(ring, dispatch_batch_cb, batch) == -1) {
+		local_destroy(local);
+		return -1;
+	}
+	for (i = 0; i < moved; i++) {
+		remote = batch->frames[i].remote;
+		int res = batch->frames[i].out;
+		if (res == 0) {
 			log_debug("remote",
-			    "connection [%s]:%s <-> [%s]:%s was closed",
+			    "while remote frame out, connection [%s]:%s <-> [%s]:%s closed",
 			    remote->laddr, remote->lserv,
 			    remote->raddr, remote->rserv);
-			local_destroy(remote->local);
+			local_destroy(local);
 			return -1;
 		}
-		if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			return 0;
+		if (res < 0 && res != -EAGAIN) {
+			errno = -res;
+			log_warn("remote", "unable to send frame to [%s]:%s",
+			    remote->raddr, remote->rserv);
+			local_destroy(local);
+			return -1;
 		}
-		log_warn("remote", "unable to read header from [%s]:%s",
-		    remote->raddr, remote->rserv);
-		local_destroy(remote->local);
-		return -1;
+		if (res == -EAGAIN)
+			METRIC_ADD(local->worker->metrics.eagain[1], 1);
+		if (res > 0) {
+			remote->stats.out += ((size_t)res > remote->event->send_header_size)?
+			    (res - remote->event->send_header_size):0;
+			remote->event->send_bytes -= res;
+			if (remote->event->send_bytes == 0)
+				remote_send_done(remote);
+		}
+		/* Let the usual path handle the remaining */
+		if (local->event->filling == remote) {
+			if (remote_send(remote) == -1) return -1;
+		} else if (remote->event->send_bytes > 0)
+			event_add(remote->event->write, NULL);
+		else if (remote->event->controls > 0) {
+			if (remote_frame_out(remote) == -1) return -1;
+		} else
+			remote_send_release(remote);
 	}
-	return n;
+	return 0;
 }
 
 /**
- * Splice data from remote end.
+ * Cut frames from the read pipe and give them to remotes which can accept
+ * them right now. Each remote has its own pending frame, therefore, a remote
+ * which cannot send does not prevent the others from doing so.
  *
- * We need to be sure that this is the right remote to read right now. If it is
- * not, we disable reading on it and we store it in the remote structure.
+ * When there is less than the minimum frame size in the read pipe, the data
+ * is held for a short delay to let more data come in.
  *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
  */
-static void
-remote_splice_in(struct ro_remote *remote)
+static int
+local_dispatch(struct ro_local *local)
 {
-	struct ro_local *local = remote->local;
-
-	/* Read the remaining of the header if needed */
-	if (remote->event->partial_bytes != RO_HEADER_SIZE) {
-		/* No header yet */
-		ssize_t n = remote_prepare_receiving(remote, remote->event->partial_bytes);
-		if (n < 0) return;
-		if (n == 0) {
-			log_debug("forward",
-			    "[%s]:%s <-> [%s]:%s: no incoming data available, start reading",
-			    remote->laddr, remote->lserv,
-			    remote->raddr, remote->rserv);
-			event_add(remote->event->read, NULL);
-			return;
-		}
-		remote->event->partial_bytes += n;
-		if (remote->event->partial_bytes == RO_HEADER_SIZE) {
-			memcpy(&remote->event->receive_serial,
-			    remote->event->partial_header,
-			    sizeof(remote->event->receive_serial));
-			remote->event->receive_serial = ntohs(remote->event->receive_serial);
-			memcpy(&remote->event->remaining_bytes,
-			    remote->event->partial_header + sizeof(remote->event->receive_serial),
-			    sizeof(remote->event->remaining_bytes));
-			remote->event->remaining_bytes = ntohl(remote->event->remaining_bytes);
-		} else return;	/* Header still incomplete */
-	}
-
-	/* If header is here, check if we need to select a new remote */
-	if (local->event->current_receive_remote == NULL ||
-	    local->event->current_receive_remote->event->receive_serial != local->event->receive_serial ||
-	    local->event->current_receive_remote->event->remaining_bytes == 0) {
-		if (remote->event->receive_serial != local->event->receive_serial + 1) {
-			/* Not the right remote, stop reading */
+	struct ro_cfg *cfg = local->cfg;
+	if (local->event->pipe.nr > 0 &&
+	    local->event->pipe.nr < cfg->min_frame &&
+	    local->event->hold != NULL &&
+	    !local->event->flush && !local->event->eof) {
+		if (!evtimer_pending(local->event->hold, NULL)) {
+			struct timeval tv = {
+				.tv_sec = cfg->frame_delay / 1000,
+				.tv_usec = (cfg->frame_delay % 1000) * 1000
+			};
 			log_debug("forward",
-			    "[%s]:%s <-> [%s]:%s: "
-			    "serial is %" PRIu16 " while expecting %" PRIu16"; stop reading",
-			    remote->laddr, remote->lserv,
-			    remote->raddr, remote->rserv,
-			    remote->event->receive_serial,
-			    local->event->receive_serial + 1);
-			event_del(remote->event->read);
-			return;
+			    "[%s]:%s: hold %zu bytes until more data is available",
+			    local->addr, local->serv,
+			    local->event->pipe.nr);
+			evtimer_add(local->event->hold, &tv);
 		}
-		local->event->receive_serial++;
-		local->event->current_receive_remote = remote;
-		log_debug("forward",
-		    "[%s]:%s <-> [%s]:%s: "
-		    "receiving %"PRIu32" bytes (serial is %"PRIu16")",
-		    remote->laddr, remote->lserv,
-		    remote->raddr, remote->rserv,
-		    remote->event->remaining_bytes,
-		    remote->event->receive_serial);
+		return 0;
 	}
+	if (local->event->hold) evtimer_del(local->event->hold);
 
-	if (local->event->current_receive_remote != remote) {
-		log_debug("forward",
-		    "[%s]:%s <-> [%s]:%s: not the active remote, pause",
-		    remote->laddr, remote->lserv,
-		    remote->raddr, remote->rserv);
-		event_del(remote->event->read);
-		return;
+	/* Complete the frame we were not able to move entirely */
+	struct ro_remote *remote;
+	if ((remote = local->event->filling) != NULL) {
+		if (remote_send(remote) == -1) return -1;
+		if (local->event->filling != NULL) return 0;
 	}
 
-	/* Splice data */
-	while (remote->event->remaining_bytes > 0) {
-		ssize_t n = splice(event_get_fd(remote->event->read),
-		    NULL,
-		    local->event->pipe.write[1],
-		    NULL,
-		    remote->event->remaining_bytes,
-		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
-		if (n <= 0) {
-			if (errno == EINTR) continue;
-			if (n == 0) {
-				log_debug("remote",
-				    "while remote splice in, connection [%s]:%s <-> [%s]:%s closed",
-				    remote->laddr, remote->lserv,
-				    remote->raddr, remote->rserv);
-				local_destroy(local);
-				return;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	/* Frames of lost remotes go first */
+	if (local_resend(local) == -1) return -1;
+	if (local->event->filling != NULL) return 0;
+
+	struct ro_uring *ring = local->worker->event->uring;
+	struct dispatch_batch batch = { .local = local };
+	size_t size = local_frame_size(local);
+	for (;;) {
+		size_t n = (local->event->pipe.nr < size)?local->event->pipe.nr:size;
+		remote = (n > 0)?cfg->scheduler->select(local, n):NULL;
+		if (remote == NULL && batch.count > 0) {
+			/* Send what we have. This may free some remotes. */
+			if (dispatch_batch_flush(&batch) == -1) return -1;
+			if (local->event->filling != NULL) return 0;
+			size = local_frame_size(local);
+			continue;
+		}
+		if (remote == NULL) {
+			/* All remotes are busy, we will be called again when
+			 * one of them has sent its frame. */
+			if (n > 0) {
 				log_debug("forward",
-				    "[%s]:%s <-> [%s]:%s: splice in would block, stop reading",
-				    remote->laddr, remote->lserv,
-				    remote->raddr, remote->rserv);
-				event_del(remote->event->read);
-				return;
-			}
-			if (errno == ENOSYS || errno == EINVAL) {
-				log_warn("remote", "splice not supported, nothing will work");
-				local_destroy(local);
-				return;
+				    "[%s]:%s: no remote available for %zu bytes",
+				    local->addr, local->serv,
+				    local->event->pipe.nr);
+				local->stats.busy++;
 			}
-			log_warn("remote", "unexpected problem while splicing");
+			break;
+		}
+		if (remote_send_init(remote) == -1) {
 			local_destroy(local);
-			return;
+			return -1;
 		}
-		remote->stats.in += n;
-		remote->event->remaining_bytes -= n;
-		local->event->pipe.nw += n;
 
-		/* We put data in the write pipe, let's read it */
+		/* The header is put in front of the payload in the send
+		 * pipe: both of them are spliced together to the remote. */
+		remote_send_prepare(remote, local->event->send_next, n);
+		if (local->latency)
+			latency_out(local, STAGE_READ, &local->latency->read, n);
+		local->event->send_next = frame_next(local->event->version,
+		    local->event->send_next, n);
 		log_debug("forward",
-		    "[%s]:%s <-> [%s]:%s: put data in the write pipe, start writing on local",
+		    "[%s]:%s <-> [%s]:%s: selected as next remote for %zu bytes (sequence %"PRIu64")",
 		    remote->laddr, remote->lserv,
-		    remote->raddr, remote->rserv);
-		event_add(local->event->write, NULL);
-	}
+		    remote->raddr, remote->rserv,
+		    n, remote->event->send_seq);
 
-	if (remote->event->remaining_bytes == 0) {
-		/* Be ready for next header */
-		remote->event->partial_bytes = 0;
+		/* We can push more data to read pipe */
+		if (!local->event->eof)
+			event_add(local->event->read, NULL);
 
-		/* Let's enable another remote if possible */
-		log_debug("forward",
-		    "[%s]:%s <-> [%s]:%s: read all data from remote, find the next remote",
-		    remote->laddr, remote->lserv,
-		    remote->raddr, remote->rserv);
-		struct ro_remote *other;
-		TAILQ_FOREACH(other, &local->remotes, next)  {
-			if (other->event->partial_bytes == RO_HEADER_SIZE &&
-			    other->event->receive_serial == local->event->receive_serial + 1) {
-				log_debug("forward",
-				    "[%s]:%s <-> [%s]:%s: next remote, start reading",
-				    other->laddr, other->lserv,
-				    other->raddr, other->rserv);
-				event_add(other->event->read, NULL);
-				break;
-			}
+		if (ring != NULL) {
+			/* Will be moved and sent with other frames */
+			local->event->pipe.nr -= n;
+			batch.frames[batch.count++].remote = remote;
+			if (batch.count < RO_URING_BATCH) continue;
+			if (dispatch_batch_flush(&batch) == -1) return -1;
+			if (local->event->filling != NULL) return 0;
+			continue;
 		}
+
+		if (remote_send_start(remote) == -1) return -1;
+		if (local->event->filling != NULL) return 0;
 	}
-	return;
+	if (local->event->pipe.nr == 0)
+		local->event->flush = false;
+	return local_close_check(local);
 }
 
-static void
-remote_splice_out(struct ro_local *local)
+/**
+ * Tell if the peer got everything it needs from us: our control frames have
+ * been sent and, with a replay buffer, our data has been acknowledged.
+ * Remotes closed by the peer cannot carry anything anymore.
+ */
+static bool
+local_flushed(struct ro_local *local)
 {
-	if (local->event->pipe.nr == 0) {
-		log_debug("forward",
-		    "[%s]:%s: nothing in read pipe, start reading, disable writing on connected remotes",
-		    local->addr, local->serv);
-		event_add(local->event->read, NULL);
-		struct ro_remote *r;
-		TAILQ_FOREACH(r, &local->remotes, next) {
-			if (r->connected)
-				event_del(r->event->write);
-		}
-		return;
+	struct ro_remote *remote;
+	bool open = false;
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (!remote->connected || remote->event->eof) continue;
+		open = true;
+		if (remote->event->send_bytes > 0 || remote->event->controls > 0)
+			return false;
 	}
+	return (!open || local->cfg->replay == 0 ||
+	    local->event->peer_window == local->event->send_next);
+}
 
-	/* We need to select a remote */
-	struct ro_remote *remote = local->event->current_send_remote;
-	if (local->event->remaining_bytes == 0) {
-		/* Select next available remote. */
-		int loop = 0;
-		while (1) {
-			if (remote == NULL)
-				remote = TAILQ_FIRST(&local->remotes);
-			else if ((remote =
-				TAILQ_NEXT(remote, next)) == NULL) {
-				remote = TAILQ_FIRST(&local->remotes);
-				loop++;
-			}
-			if (remote == NULL || loop >= 2) {
-				/* Should not happen */
-				log_warnx("forward", "no remote available?");
-				local_destroy(local);
-				return;
-			}
-			if (remote->connected) break;
+/**
+ * Make progress on the orderly shutdown of a session (version 2 of the
+ * protocol). Once the local endpoint has nothing more to send and all its
+ * data has been given to remotes, a CLOSE frame tells the peer where the
+ * stream ends. Once the CLOSE frame of the peer has been received and all the
+ * data before it has been delivered, the write side of the local endpoint is
+ * shut down. When both are done, the session is over.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_close_check(struct ro_local *local)
+{
+	if (!local->event->eof && !local->event->peer_eof) return 0;
+	if (local->event->version < 2) {
+		/* Negotiated after the local endpoint was closed */
+		local_destroy(local);
+		return -1;
+	}
+	if (local->event->eof && !local->event->close_queued &&
+	    local->event->pipe.nr == 0 && local->event->filling == NULL &&
+	    TAILQ_EMPTY(&local->event->resend)) {
+		/* Any remote will do, prefer an idle one */
+		struct ro_remote *remote, *selected = NULL;
+		TAILQ_FOREACH(remote, &local->remotes, next) {
+			if (!remote->connected || remote->event->retiring) continue;
+			if (selected == NULL || remote_available(remote))
+				selected = remote;
+			if (remote_available(remote)) break;
 		}
-		log_debug("forward",
-		    "[%s]:%s <-> [%s]:%s: selected as next remote for %zu bytes (serial %"PRIu16,
-		    remote->laddr, remote->lserv,
-		    remote->raddr, remote->rserv,
-		    local->event->pipe.nr,
-		    local->event->send_serial+1);
-		local->event->partial_bytes = RO_HEADER_SIZE;
-		local->event->remaining_bytes = local->event->pipe.nr;
-		local->event->send_serial++;
-		local->event->current_send_remote = remote;
-	}
-
-	/* Write the header */
-	if (local->event->partial_bytes > 0) {
-		tcp_cork_set(event_get_fd(remote->event->write), 1);
-		ssize_t n = remote_prepare_sending(remote,
-		    local->event->remaining_bytes,
-		    local->event->partial_bytes);
-		if (n < 0) return;
-		if (n == 0) {
-			/* Cannot write to remote */
+		if (selected != NULL) {
+			struct ro_frame frame = {
+				.type = FRAME_CLOSE,
+				.seq = local->event->send_next
+			};
 			log_debug("forward",
-			    "[%s]:%s <-> [%s]:%s: currently cannot send header to remote, start writing",
-			    remote->laddr, remote->lserv,
-			    remote->raddr, remote->rserv);
-			event_add(remote->event->write, NULL);
-			return;
+			    "[%s]:%s: end of stream at offset %"PRIu64", send CLOSE to [%s]:%s",
+			    local->addr, local->serv,
+			    frame.seq,
+			    selected->raddr, selected->rserv);
+			local->event->close_queued = true;
+			selected->event->close_carrier = true;
+			if (remote_control(selected, &frame) == -1) return -1;
 		}
-		if ((local->event->partial_bytes -= n) > 0) {
-			/* Partial write? */
-			log_debug("forward",
-			    "[%s]:%s <-> [%s]:%s: partial header sent, start writing",
-			    remote->laddr, remote->lserv,
-			    remote->raddr, remote->rserv);
-			event_add(remote->event->write, NULL);
-			return;
+	}
+	if (local->event->peer_eof && !local->event->shut &&
+	    local->connected &&
+	    local->event->receive_next == local->event->peer_final &&
+	    local->event->current_receive_remote == NULL &&
+	    local->event->pipe.nw == 0) {
+		log_debug("forward",
+		    "[%s]:%s: all data delivered, shutdown write side",
+		    local->addr, local->serv);
+		shutdown(event_get_fd(local->event->write), SHUT_WR);
+		local->event->shut = true;
+		/* Final acknowledgement */
+		if (local_ack(local, true) == -1) return -1;
+	}
+	if (local->event->close_done && local->event->shut &&
+	    local_flushed(local)) {
+		log_debug("forward", "[%s]:%s: both ends closed, end of session",
+		    local->addr, local->serv);
+		local_destroy(local);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Destroy the remotes which are done with their closing or lost. This is
+ * deferred to not destroy a remote from one of its own callbacks.
+ */
+static void
+local_reap_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_local *local = arg;
+	struct ro_remote *remote, *remote_next;
+	bool lost = false;
+	for (remote = TAILQ_FIRST(&local->remotes);
+	     remote != NULL;
+	     remote = remote_next) {
+		remote_next = TAILQ_NEXT(remote, next);
+		if (remote->event->lost) {
+			remote_destroy(remote);
+			lost = true;
+			continue;
 		}
+		if (!remote->event->retired || !remote->event->retire_in ||
+		    !TAILQ_EMPTY(&remote->event->frames) ||
+		    local->event->current_receive_remote == remote)
+			continue;
+		log_debug("forward", "[%s]:%s <-> [%s]:%s: closed on both ends",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv);
+		remote_destroy(remote);
 	}
+	if (!lost) return;
 
-	/* Splice data */
-	while (local->event->remaining_bytes > 0) {
-		ssize_t n = splice(local->event->pipe.read[0],
-		    NULL,
-		    event_get_fd(remote->event->write),
-		    NULL,
-		    local->event->remaining_bytes,
-		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
-		if (n <= 0) {
-			if (errno == EINTR) continue;
-			if (n == 0) {
-				log_debug("remote",
-				    "while remote splice out, connection [%s]:%s <-> [%s]:%s closed",
-				    remote->laddr, remote->lserv,
-				    remote->raddr, remote->rserv);
-				local_destroy(local);
-				return;
-			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				log_debug("forward",
-				    "[%s]:%s <-> [%s]:%s: currently cannot splice data to remote (%"PRIu32" remaining), "
-				    "start writing",
-				    remote->laddr, remote->lserv,
-				    remote->raddr, remote->rserv,
-				    local->event->remaining_bytes);
-				event_add(remote->event->write, NULL);
-				return;
-			}
-			if (errno == ENOSYS || errno == EINVAL) {
-				log_warn("remote", "splice not supported, nothing will work");
-				local_destroy(local);
-				return;
-			}
-			log_warn("remote", "unexpected problem while splicing");
+	/* Frames of lost remotes can now be received from other remotes
+	 * or sent to them. */
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (remote->event->stalled)
+			remote_wake(remote);
+	}
+	if (local_deliver(local) == -1) return;
+	if (local_ack(local, true) == -1) return;
+	local_dispatch(local);
+}
+
+/**
+ * Schedule the destruction of remotes done with their closing or lost.
+ *
+ * @return -1 if the local endpoint was destroyed, 0 otherwise
+ */
+static int
+local_reap(struct ro_local *local)
+{
+	if (local->event->reap == NULL &&
+	    (local->event->reap = slab_event_new(local->worker, -1, 0,
+		local_reap_cb, local)) == NULL) {
+		log_warnx("forward", "unable to setup reap event for [%s]:%s",
+		    local->addr, local->serv);
+		local_destroy(local);
+		return -1;
+	}
+	event_active(local->event->reap, EV_TIMEOUT, 0);
+	return 0;
+}
+
+/**
+ * Handle a remote which failed to connect. When connections are opened on
+ * demand, the session goes on with the remaining ones. When replacing a lost
+ * connection, another attempt is made.
+ */
+static void
+remote_abort(struct ro_remote *remote)
+{
+	struct ro_local *local = remote->local;
+	struct ro_remote *other;
+	if (local->cfg->replay > 0 && local->event->established &&
+	    local->event->version >= 2 &&
+	    local->event->attempts < RO_REPLAY_ATTEMPTS) {
+		log_debug("forward", "[%s]:%s: try again to replace a lost connection",
+		    local->addr, local->serv);
+		local->event->attempts++;
+		remote_destroy(remote);
+		if (connection_open(local->cfg, local) == -1) {
+			log_warnx("forward", "[%s]:%s: unable to open a replacement connection",
+			    local->addr, local->serv);
 			local_destroy(local);
+		}
+		return;
+	}
+	if (local->cfg->adaptive) {
+		TAILQ_FOREACH(other, &local->remotes, next) {
+			if (!other->connected) continue;
+			log_debug("forward", "[%s]:%s: give up on [%s]:%s",
+			    local->addr, local->serv,
+			    remote->raddr, remote->rserv);
+			remote_destroy(remote);
 			return;
 		}
-		remote->stats.out += n;
-		local->event->remaining_bytes -= n;
-		local->event->pipe.nr -= n;
-		/* We can push more data to read pipe */
-		log_debug("forward",
-		    "[%s]:%s <-> [%s]:%s: data has been sent to remote, start reading on local",
-		    remote->laddr, remote->lserv,
-		    remote->raddr, remote->rserv);
-		event_add(local->event->read, NULL);
 	}
-	tcp_cork_set(event_get_fd(remote->event->write), 0);
+	local_destroy(local);
 }
 
+/**
+ * Called when data has been held long enough in the read pipe.
+ */
+void
+local_hold_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_local *local = arg;
+	local->event->flush = true;
+	local_dispatch(local);
+}
 
 static void
-local_splice_in(struct ro_local *local)
+local_read_in(struct ro_local *local)
 {
 	while (1) {
-		ssize_t n = splice(event_get_fd(local->event->read), NULL,
-		    local->event->pipe.read[1], NULL,
-		    MAX_SPLICE_AT_ONCE,
-		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		ssize_t n = local->cfg->engine->read_in(event_get_fd(local->event->read),
+		    &local->event->pipe.read,
+		    MAX_SPLICE_AT_ONCE);
 		if (n <= 0) {
-			if (errno == EINTR) continue;
+			if (n == 0 && local->event->eof) {
+				event_del(local->event->read);
+				break;
+			}
 			if (n == 0) {
 				log_debug("local",
-				    "while local splice in, connection with [%s]:%s closed",
+				    "while local read in, connection with [%s]:%s closed",
 				    local->addr, local->serv);
+				if (local->event->version >= 2) {
+					/* Send remaining data, then CLOSE */
+					local->event->eof = true;
+					event_del(local->event->read);
+					break;
+				}
 				local_destroy(local);
 				return;
 			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				if (local->event->pipe.nr > 0) {
-					log_debug("forward",
-					    "[%s]:%s: cannot splice more data from local, stop reading",
-					    local->addr, local->serv);
-					event_del(local->event->read);
-				} else {
-					log_debug("forward",
-					    "[%s]:%s: cannot splice more data from local, wait for read read",
-					    local->addr, local->serv);
-					event_add(local->event->read, NULL); /* useless, but for consistency */
-				}
+			if (errno == ENOBUFS) {
+				/* Read pipe is full, we will be woken up once
+				 * some frames are sent. */
+				log_debug("forward",
+				    "[%s]:%s: cannot read more data from local, stop reading",
+				    local->addr, local->serv);
+				event_del(local->event->read);
 				break;
 			}
-			if (errno == ENOSYS || errno == EINVAL) {
-				log_warn("forward", "splice not supported, nothing will work");
-				local_destroy(local);
-				return;
+			if (errno == EAGAIN) {
+				log_debug("forward",
+				    "[%s]:%s: cannot read more data from local, wait for read",
+				    local->addr, local->serv);
+				METRIC_ADD(local->worker->metrics.eagain[0], 1);
+				event_add(local->event->read, NULL); /* useless, but for consistency */
+				break;
 			}
-			log_warn("forward", "unknown problem while splicing");
+			log_warn("forward", "unknown problem while reading from [%s]:%s",
+			    local->addr, local->serv);
 			local_destroy(local);
 			return;
 		}
 		local->stats.out += n;
+		METRIC_ADD(local->worker->metrics.bytes[0], n);
 		local->event->pipe.nr += n;
+		if (local->latency) latency_in(&local->latency->read, n);
 	}
-	/* We should enable remote, but maybe we don't have one yet. */
-	if (local->event->pipe.nr > 0)
-		remote_splice_out(local);
+	/* We should send to remotes, but maybe we don't have one yet. */
+	if (local->event->pipe.nr > 0 || local->event->eof)
+		local_dispatch(local);
 }
 
 static void
-local_splice_out(struct ro_local *local)
+local_write_out(struct ro_local *local)
 {
 	while (local->event->pipe.nw > 0) {
-		ssize_t n = splice(local->event->pipe.write[0], NULL,
-		    event_get_fd(local->event->write), NULL,
-		    local->event->pipe.nw,
-		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		ssize_t n = local->cfg->engine->write_out(&local->event->pipe.write,
+		    event_get_fd(local->event->write),
+		    local->event->pipe.nw);
 		if (n <= 0) {
-			if (errno == EINTR) continue;
 			if (n == 0) {
 				log_debug("local",
-				    "while local splice out, connection with [%s]:%s closed",
+				    "while local write out, connection with [%s]:%s closed",
 				    local->addr, local->serv);
 				local_destroy(local);
 				return;
 			}
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				break;
-			}
-			if (errno == ENOSYS || errno == EINVAL) {
-				log_warn("forward", "splice not supported, nothing will work");
-				local_destroy(local);
+			if (errno == EAGAIN) {
+				/* Wait for the local end to be writable */
+				METRIC_ADD(local->worker->metrics.eagain[1], 1);
+				event_add(local->event->write, NULL);
 				return;
 			}
-			log_warn("forward", "unknown problem while splicing");
+			log_warn("forward", "unknown problem while writing to [%s]:%s",
+			    local->addr, local->serv);
 			local_destroy(local);
 			return;
 		}
 
 		local->stats.in += n;
+		METRIC_ADD(local->worker->metrics.bytes[1], n);
 		local->event->pipe.nw -= n;
+		if (local->latency)
+			latency_out(local, STAGE_WRITE, &local->latency->write, n);
 		/* We can push more data to write pipe. */
 		struct ro_remote *remote = local->event->current_receive_remote;
-		if (remote) {
+		if (remote && remote->event->receive_mode == RECEIVE_DIRECT) {
 			/* Just wake up this remote */
 			log_debug("forward",
 			    "[%s]:%s: can receive more data, waking up [%s]:%s <-> [%s]:%s for read",
 			    local->addr, local->serv,
 			    remote->laddr, remote->lserv,
 			    remote->raddr, remote->rserv);
-			event_add(remote->event->read, NULL);
-		} else {
-			/* Wake all remotes */
-			log_debug("forward",
-			    "[%s]:%s: can receive more data, waking up all remotes for read",
-			    local->addr, local->serv);
-			TAILQ_FOREACH(remote, &local->remotes, next) {
-				if (remote->connected) {
-					event_add(remote->event->read, NULL);
-				} else {
-					log_debug("forward",
-					    "[%s]:%s <-> [%s]:%s: not waking up, not connected yet",
-					    remote->laddr, remote->lserv,
-					    remote->raddr, remote->rserv);
-				}
-			}
-		}
+			remote_wake(remote);
+		} else if (local_deliver(local) == -1)
+			return;
 	}
 	log_debug("forward",
 	    "[%s]:%s: emptied the write pipe, stop writing",
 	    local->addr, local->serv);
 	event_del(local->event->write);
+	local_close_check(local);
 }
 
 void
@@ -536,11 +2117,11 @@ local_data_cb(evutil_socket_t fd, short what, void *arg)
 	}
 	switch (what) {
 	case EV_READ:
-		/* Incoming data available. Let's splice. */
-		local_splice_in(local);
+		/* Incoming data available. */
+		local_read_in(local);
 		return;
 	case EV_WRITE:
-		local_splice_out(local);
+		local_write_out(local);
 		return;
 	}
 end:
@@ -548,13 +2129,42 @@ end:
 	    what, fd);
 }
 
+/**
+ * Account the time needed to establish a connection to relay, from the
+ * connect() to the reply to our hello. Connections from the pool are not
+ * accounted.
+ */
+static void
+remote_connect_stats(struct ro_remote *remote, int fd)
+{
+	struct ro_worker *worker = remote->local->worker;
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int fastopen = 0;
+	if (!remote->event->timed) return;
+	uint64_t elapsed = timespec_elapsed(&remote->event->opened);
+	if (remote->cfg->fastopen &&
+	    getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+	    (info.tcpi_options & TCPI_OPT_SYN_DATA))
+		fastopen = 1;
+	worker->stats.connects[fastopen]++;
+	worker->stats.connect_total[fastopen] += elapsed;
+	if (elapsed > worker->stats.connect_max[fastopen])
+		worker->stats.connect_max[fastopen] = elapsed;
+	metrics_observe(&worker->metrics.handshake[fastopen], elapsed);
+	log_debug("remote", "[%s]:%s established in %" PRIu64 " µs%s",
+	    remote->raddr, remote->rserv, elapsed,
+	    fastopen?" with TCP Fast Open":"");
+}
+
 void
 remote_data_cb(evutil_socket_t fd, short what, void *arg)
 {
 	struct ro_remote *remote = arg;
 	struct ro_local *local = remote->local;
+	if (remote->event->lost) return;
 	if (!remote->connected) {
-		if (what == EV_WRITE) {
+		if (what == EV_WRITE && !remote->event->handshake) {
 			/* Are we connected? */
 			socklen_t len = sizeof(errno);
 			getsockopt(fd, SOL_SOCKET, SO_ERROR, &errno, &len);
@@ -563,29 +2173,74 @@ remote_data_cb(evutil_socket_t fd, short what, void *arg)
 			if (errno != 0) {
 				log_warn("remote", "unable to connect to [%s]:%s",
 				    remote->raddr, remote->rserv);
-				local_destroy(local);
+				remote_abort(remote);
 				return;
 			}
 
+			/* Start the establishment protocol, see
+			 * `connection_send_group()` in `connection.c`. */
+			if (connection_send_group(remote) == -1) {
+				remote_abort(remote);
+				return;
+			}
+			remote->event->handshake = true;
 			event_del(remote->event->write);
 			event_add(remote->event->read, NULL);
+			return;
+		}
+		if (what == EV_READ && remote->event->handshake) {
+			switch (connection_receive_group(remote)) {
+			case -1:
+				remote_abort(remote);
+				return;
+			case 0:
+				return;
+			}
+			remote->event->handshake = false;
 			event_add(local->event->read, NULL);
 			remote->connected = true;
-			log_debug("remote", "connected [%s]:%s <-> [%s]:%s (fd: %d)",
-			    remote->laddr, remote->lserv,
-			    remote->raddr, remote->rserv,
-			    fd);
-			connection_established(local, remote);
+			remote_connect_stats(remote, fd);
+			if (local->keyed)
+				log_debug("remote", "connected [%s]:%s <-> [%s]:%s (fd: %d, group key %016" PRIx64 "%016" PRIx64 ")",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv,
+				    fd, local->group_key[0], local->group_key[1]);
+			else
+				log_debug("remote", "connected [%s]:%s <-> [%s]:%s (fd: %d, group ID #%" PRIu32 ")",
+				    remote->laddr, remote->lserv,
+				    remote->raddr, remote->rserv,
+				    fd, local->group_id);
+			if (connection_established(local, remote) == -1)
+				return;
+			if (local->event->version >= 2 && remote->cfg->replay > 0) {
+				/* Tell the relay which losses this one
+				 * may replace, see `remote_control_in()`. */
+				struct ro_frame frame = {
+					.type = FRAME_PING,
+					.seq = remote->event->joined,
+					.length = 2
+				};
+				if (remote_control(remote, &frame) == -1) return;
+			}
+			local_dispatch(local);
 			return;
 		}
 		goto end;
 	}
+	/* Zerocopy completions are signaled as errors on the socket, read
+	 * them to not be woken up again. */
+	if (remote->event->send.zerocopy)
+		remote->cfg->engine->reclaim(&remote->event->send);
 	switch (what) {
 	case EV_READ:
-		remote_splice_in(remote);
+		remote_frame_in(remote);
 		return;
 	case EV_WRITE:
-		remote_splice_out(remote->local);
+		if (remote_frame_out(remote) == -1)
+			return;
+		if (!remote_sending(remote) ||
+		    local->event->filling == remote)
+			local_dispatch(local);
 		return;
 	}
 end:
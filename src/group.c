@@ -0,0 +1,187 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Local endpoints of a worker indexed by group ID or group key (relay
+ * only). Buckets are chained and their number doubles when there are more
+ * endpoints than buckets: finding a group or allocating a new group ID
+ * does not depend on the number of sessions.
+ *
+ * The keys of the last sessions are remembered: with `--parallel`, a
+ * connection of the proxy may arrive after the end of its session and it
+ * would otherwise create the group again.
+ */
+
+#include "ro-ro-tcp.h"
+
+#include <string.h>
+
+static uint64_t
+group_value(const struct ro_local *local)
+{
+	return local->keyed?
+	    (local->group_key[0] ^ local->group_key[1]):local->group_id;
+}
+
+/**
+ * Get the bucket of a value. Group IDs only differ by their highest bits
+ * in a worker, they are mixed with a multiplicative hash.
+ */
+static struct group_bucket *
+group_bucket(struct ro_worker *worker, uint64_t value)
+{
+	return &worker->groups.buckets[
+		(value * 0x9e3779b97f4a7c15ULL) >> (64 - worker->groups.bits)];
+}
+
+/**
+ * Rehash all local endpoints into 2^bits buckets.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+group_resize(struct ro_worker *worker, unsigned bits)
+{
+	struct group_bucket *old = worker->groups.buckets;
+	size_t i, size = old?((size_t)1 << worker->groups.bits):0;
+	struct ro_local *local;
+	struct group_bucket *buckets = calloc((size_t)1 << bits, sizeof(*buckets));
+	if (buckets == NULL) {
+		log_warn("group", "unable to allocate %zu buckets for worker %u",
+		    (size_t)1 << bits, worker->index);
+		return -1;
+	}
+	worker->groups.buckets = buckets;
+	worker->groups.bits = bits;
+	for (i = 0; i < size; i++) {
+		while ((local = LIST_FIRST(&old[i])) != NULL) {
+			LIST_REMOVE(local, hash);
+			LIST_INSERT_HEAD(group_bucket(worker, group_value(local)),
+			    local, hash);
+		}
+	}
+	free(old);
+	return 0;
+}
+
+/**
+ * Index a local endpoint with its group ID or its group key.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+group_insert(struct ro_worker *worker, struct ro_local *local)
+{
+	if (worker->groups.buckets == NULL &&
+	    group_resize(worker, RO_GROUP_BITS) == -1)
+		return -1;
+	if (worker->groups.count >= ((size_t)1 << worker->groups.bits))
+		/* On error, we just get longer chains */
+		group_resize(worker, worker->groups.bits + 1);
+	LIST_INSERT_HEAD(group_bucket(worker, group_value(local)), local, hash);
+	worker->groups.count++;
+	return 0;
+}
+
+/**
+ * Remove a local endpoint from the index, if it is there. Its group key is
+ * retired.
+ */
+void
+group_remove(struct ro_local *local)
+{
+	struct ro_worker *worker = local->worker;
+	if (local->hash.le_prev == NULL) return;
+	LIST_REMOVE(local, hash);
+	local->hash.le_prev = NULL;
+	worker->groups.count--;
+	if (!local->keyed) return;
+	memcpy(worker->groups.retired[worker->groups.next_retired],
+	    local->group_key, sizeof(local->group_key));
+	worker->groups.next_retired =
+	    (worker->groups.next_retired + 1) % RO_GROUP_RETIRED;
+}
+
+/**
+ * Find the local endpoint of a group ID.
+ */
+struct ro_local *
+group_find(struct ro_worker *worker, uint32_t id)
+{
+	struct ro_local *local;
+	if (worker->groups.buckets == NULL) return NULL;
+	LIST_FOREACH(local, group_bucket(worker, id), hash)
+	    if (!local->keyed && local->group_id == id) return local;
+	return NULL;
+}
+
+/**
+ * Find the local endpoint of a group key.
+ */
+struct ro_local *
+group_find_key(struct ro_worker *worker, const uint64_t key[static RO_KEY_WORDS])
+{
+	struct ro_local *local;
+	if (worker->groups.buckets == NULL) return NULL;
+	LIST_FOREACH(local, group_bucket(worker, key[0] ^ key[1]), hash)
+	    if (local->keyed &&
+		memcmp(local->group_key, key, sizeof(local->group_key)) == 0)
+		    return local;
+	return NULL;
+}
+
+/**
+ * Tell if a group key belongs to one of the last sessions.
+ */
+bool
+group_retired(struct ro_worker *worker, const uint64_t key[static RO_KEY_WORDS])
+{
+	for (unsigned i = 0; i < RO_GROUP_RETIRED; i++)
+		if (memcmp(worker->groups.retired[i], key,
+			sizeof(worker->groups.retired[i])) == 0)
+			return true;
+	return false;
+}
+
+/**
+ * Allocate a new group ID. The worker index is encoded in the lowest bits
+ * such that any worker can tell which one owns the group. IDs are given in
+ * sequence, skipping the ones still in use after a wrap-around. IDs which
+ * could be mistaken for the start of a version 2 hello are never given.
+ */
+uint32_t
+group_new(struct ro_worker *worker)
+{
+	uint32_t id;
+	do {
+		id = (++worker->last_group_id << RO_WORKER_BITS) | worker->index;
+	} while (id == 0 || id == RO_POOL_GROUP ||
+	    id == RO_MAGIC || id == RO_MAGIC_KEY ||
+	    group_find(worker, id) != NULL);
+	return id;
+}
+
+/**
+ * Free the index of a worker. Local endpoints are not freed.
+ */
+void
+group_free(struct ro_worker *worker)
+{
+	free(worker->groups.buckets);
+	worker->groups.buckets = NULL;
+	worker->groups.count = 0;
+}
@@ -0,0 +1,535 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Impairment relay, to put between the proxy and the relay (or between
+ * any client and server) to emulate a bad link without root privileges.
+ * Each accepted connection is forwarded to the remote address with the
+ * rule given by its rank: the first connection gets the first rule, the
+ * second one the second rule and so on, starting again from the first
+ * rule when there are no more.
+ *
+ * Data read in each direction is queued with the time it may leave: now,
+ * plus the delay, plus or minus a random jitter (a TCP stream cannot be
+ * reordered, so never before the data read previously). It is then paced
+ * by the rate, held while the connection is stalled and written. After
+ * the reset time, both sides are closed with a RST. The random generator
+ * is seeded with a constant (changed with -S): runs are reproducible.
+ */
+
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#define IMPAIR_RULES 16
+#define IMPAIR_QUEUE (16 << 20)	/* default bytes queued in each direction */
+#define IMPAIR_BURST 1500	/* smallest write when the rate is limited */
+#define IMPAIR_LATE 2000	/* µs a late timer may catch up with the rate */
+
+struct impair_rule {
+	uint64_t delay;		/* µs */
+	uint64_t jitter;	/* µs */
+	uint64_t rate;		/* bytes per second, 0 for no limit */
+	uint64_t stall_every;	/* µs between stalls */
+	uint64_t stall_for;	/* µs of each stall */
+	uint64_t reset;		/* µs after accept, 0 for never */
+};
+
+struct impair_mark {
+	TAILQ_ENTRY(impair_mark) next;
+	size_t bytes;
+	uint64_t at;		/* when these bytes may leave */
+};
+
+/* One direction of a connection */
+struct impair_flow {
+	struct impair_conn *conn;
+	struct bufferevent *from, *to;
+	struct evbuffer *queue;	/* bytes waiting to leave */
+	TAILQ_HEAD(, impair_mark) marks;
+	struct event *timer;
+	uint64_t last;		/* when the last bytes read may leave */
+	uint64_t free;		/* when the rate allows more bytes */
+	bool eof;		/* nothing more to read */
+	bool done;		/* shutdown sent to the other side */
+};
+
+struct impair_conn {
+	TAILQ_ENTRY(impair_conn) next;
+	unsigned rank;
+	struct impair_rule *rule;
+	struct bufferevent *client, *server;
+	struct impair_flow flows[2]; /* client to server, server to client */
+	struct event *reset;
+	uint64_t start;
+};
+
+static struct {
+	struct event_base *base;
+	struct sockaddr_storage remote;
+	int remote_len;
+	struct impair_rule rules[IMPAIR_RULES];
+	unsigned nrules;
+	unsigned accepted;
+	size_t queue;
+	TAILQ_HEAD(, impair_conn) conns;
+} impair = {
+	.nrules = 1,
+	.queue = IMPAIR_QUEUE
+};
+
+static uint64_t
+impair_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void
+impair_free(struct impair_conn *conn)
+{
+	for (int i = 0; i < 2; i++) {
+		struct impair_flow *flow = &conn->flows[i];
+		struct impair_mark *mark;
+		while ((mark = TAILQ_FIRST(&flow->marks)) != NULL) {
+			TAILQ_REMOVE(&flow->marks, mark, next);
+			free(mark);
+		}
+		if (flow->queue) evbuffer_free(flow->queue);
+		if (flow->timer) event_free(flow->timer);
+	}
+	if (conn->reset) event_free(conn->reset);
+	if (conn->client) bufferevent_free(conn->client);
+	if (conn->server) bufferevent_free(conn->server);
+	TAILQ_REMOVE(&impair.conns, conn, next);
+	free(conn);
+}
+
+/**
+ * Close both sides with a RST.
+ */
+static void
+impair_abort(struct impair_conn *conn)
+{
+	struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+	struct bufferevent *bevs[] = { conn->client, conn->server };
+	for (int i = 0; i < 2; i++) {
+		evutil_socket_t fd = bevs[i]?bufferevent_getfd(bevs[i]):-1;
+		if (fd != -1)
+			setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	}
+	impair_free(conn);
+}
+
+/**
+ * Postpone a time to the end of a stall.
+ */
+static uint64_t
+impair_stall(struct impair_conn *conn, uint64_t at)
+{
+	struct impair_rule *rule = conn->rule;
+	if (rule->stall_every == 0 || rule->stall_for == 0 || at < conn->start)
+		return at;
+	uint64_t period = rule->stall_every + rule->stall_for;
+	uint64_t phase = (at - conn->start) % period;
+	if (phase < rule->stall_every) return at;
+	return at - phase + period;
+}
+
+/**
+ * Shutdown the other side once everything has been written.
+ *
+ * @return -1 if the connection was freed, 0 otherwise
+ */
+static int
+impair_finish(struct impair_flow *flow)
+{
+	struct impair_conn *conn = flow->conn;
+	if (!flow->eof || flow->done ||
+	    evbuffer_get_length(flow->queue) > 0 ||
+	    evbuffer_get_length(bufferevent_get_output(flow->to)) > 0)
+		return 0;
+	log_debug("impair", "connection %u: %s closed", conn->rank,
+	    (flow == &conn->flows[0])?"client":"server");
+	shutdown(bufferevent_getfd(flow->to), SHUT_WR);
+	flow->done = true;
+	if (conn->flows[0].done && conn->flows[1].done) {
+		log_debug("impair", "connection %u: done", conn->rank);
+		impair_free(conn);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Write the bytes which may leave now.
+ *
+ * @return -1 if the connection was freed, 0 otherwise
+ */
+static int
+impair_release(struct impair_flow *flow)
+{
+	struct impair_conn *conn = flow->conn;
+	struct impair_rule *rule = conn->rule;
+	struct evbuffer *out = bufferevent_get_output(flow->to);
+	struct impair_mark *mark;
+	uint64_t now = impair_now();
+
+	while ((mark = TAILQ_FIRST(&flow->marks)) != NULL) {
+		uint64_t at = (mark->at > flow->free)?mark->at:flow->free;
+		at = impair_stall(conn, at);
+		if (at > now) {
+			struct timeval tv = {
+				.tv_sec = (at - now) / 1000000,
+				.tv_usec = (at - now) % 1000000
+			};
+			evtimer_add(flow->timer, &tv);
+			break;
+		}
+		/* Wait for the other side to read, see `impair_write()` */
+		if (evbuffer_get_length(out) >= impair.queue) break;
+		size_t n = mark->bytes;
+		if (rule->rate > 0) {
+			/* Bytes allowed for 1 ms */
+			size_t burst = rule->rate / 1000;
+			uint64_t from = flow->free;
+			if (burst < IMPAIR_BURST) burst = IMPAIR_BURST;
+			if (n > burst) n = burst;
+			if (from + IMPAIR_LATE < now) from = now - IMPAIR_LATE;
+			flow->free = from + n * 1000000 / rule->rate;
+		}
+		evbuffer_remove_buffer(flow->queue, out, n);
+		mark->bytes -= n;
+		if (mark->bytes == 0) {
+			TAILQ_REMOVE(&flow->marks, mark, next);
+			free(mark);
+		}
+	}
+	if (!flow->eof && evbuffer_get_length(flow->queue) < impair.queue)
+		bufferevent_enable(flow->from, EV_READ);
+	return impair_finish(flow);
+}
+
+static void
+impair_timer(evutil_socket_t fd, short what, void *arg)
+{
+	impair_release(arg);
+}
+
+static void
+impair_read(struct bufferevent *bev, void *arg)
+{
+	struct impair_conn *conn = arg;
+	struct impair_flow *flow = &conn->flows[(bev == conn->client)?0:1];
+	struct impair_rule *rule = conn->rule;
+	struct evbuffer *in = bufferevent_get_input(bev);
+	struct impair_mark *mark;
+	size_t n = evbuffer_get_length(in);
+	uint64_t now = impair_now(), at = now + rule->delay;
+
+	if (n == 0) return;
+	if ((mark = calloc(1, sizeof(struct impair_mark))) == NULL) {
+		log_warn("impair", "unable to allocate memory for connection %u",
+		    conn->rank);
+		impair_abort(conn);
+		return;
+	}
+	if (rule->jitter > 0) {
+		at += random() % (2 * rule->jitter + 1);
+		at = (at > now + rule->jitter)?(at - rule->jitter):now;
+	}
+	if (at < flow->last) at = flow->last;
+	mark->bytes = n;
+	mark->at = flow->last = at;
+	TAILQ_INSERT_TAIL(&flow->marks, mark, next);
+	evbuffer_add_buffer(flow->queue, in);
+	if (evbuffer_get_length(flow->queue) >= impair.queue)
+		bufferevent_disable(bev, EV_READ);
+	impair_release(flow);
+}
+
+/**
+ * Some room in the output buffer of one side.
+ */
+static void
+impair_write(struct bufferevent *bev, void *arg)
+{
+	struct impair_conn *conn = arg;
+	impair_release(&conn->flows[(bev == conn->server)?0:1]);
+}
+
+static void
+impair_event(struct bufferevent *bev, short events, void *arg)
+{
+	struct impair_conn *conn = arg;
+	struct impair_flow *flow = &conn->flows[(bev == conn->client)?0:1];
+	if (events & BEV_EVENT_CONNECTED) {
+		log_debug("impair", "connection %u: connected to remote",
+		    conn->rank);
+		return;
+	}
+	if (events & BEV_EVENT_EOF) {
+		flow->eof = true;
+		bufferevent_disable(bev, EV_READ);
+		impair_finish(flow);
+		return;
+	}
+	if (events & BEV_EVENT_ERROR) {
+		log_info("impair", "connection %u: %s: %s", conn->rank,
+		    (bev == conn->client)?"client":"server",
+		    evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+		impair_abort(conn);
+	}
+}
+
+static void
+impair_reset(evutil_socket_t fd, short what, void *arg)
+{
+	struct impair_conn *conn = arg;
+	log_info("impair", "connection %u: reset", conn->rank);
+	impair_abort(conn);
+}
+
+static void
+impair_accept(struct evconnlistener *listener, evutil_socket_t fd,
+    struct sockaddr *addr, int len, void *arg)
+{
+	struct impair_conn *conn;
+	if ((conn = calloc(1, sizeof(struct impair_conn))) == NULL) {
+		log_warn("impair", "unable to allocate memory for new connection");
+		evutil_closesocket(fd);
+		return;
+	}
+	TAILQ_INSERT_TAIL(&impair.conns, conn, next);
+	conn->rank = impair.accepted++;
+	conn->rule = &impair.rules[conn->rank % impair.nrules];
+	conn->start = impair_now();
+	if ((conn->client = bufferevent_socket_new(impair.base, fd,
+		    BEV_OPT_CLOSE_ON_FREE)) == NULL ||
+	    (conn->server = bufferevent_socket_new(impair.base, -1,
+		BEV_OPT_CLOSE_ON_FREE)) == NULL) {
+		log_warnx("impair", "unable to create buffers for new connection");
+		if (conn->client == NULL) evutil_closesocket(fd);
+		impair_free(conn);
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		struct impair_flow *flow = &conn->flows[i];
+		flow->conn = conn;
+		flow->from = i?conn->server:conn->client;
+		flow->to = i?conn->client:conn->server;
+		TAILQ_INIT(&flow->marks);
+		if ((flow->queue = evbuffer_new()) == NULL ||
+		    (flow->timer = evtimer_new(impair.base, impair_timer,
+			flow)) == NULL) {
+			log_warnx("impair", "unable to create queues for new connection");
+			impair_free(conn);
+			return;
+		}
+		bufferevent_setwatermark(flow->to, EV_WRITE, impair.queue / 2, 0);
+		bufferevent_setcb(flow->from, impair_read, impair_write,
+		    impair_event, conn);
+	}
+	if (conn->rule->reset > 0) {
+		struct timeval tv = {
+			.tv_sec = conn->rule->reset / 1000000,
+			.tv_usec = conn->rule->reset % 1000000
+		};
+		if ((conn->reset = evtimer_new(impair.base, impair_reset,
+			    conn)) == NULL ||
+		    evtimer_add(conn->reset, &tv) == -1) {
+			log_warnx("impair", "unable to setup reset timer");
+			impair_free(conn);
+			return;
+		}
+	}
+	if (bufferevent_socket_connect(conn->server,
+		(struct sockaddr *)&impair.remote, impair.remote_len) == -1) {
+		log_warn("impair", "unable to connect to remote");
+		impair_abort(conn);
+		return;
+	}
+	bufferevent_enable(conn->client, EV_READ|EV_WRITE);
+	bufferevent_enable(conn->server, EV_READ|EV_WRITE);
+	log_info("impair", "connection %u: accepted, rule %u",
+	    conn->rank, conn->rank % impair.nrules + 1);
+}
+
+static void
+impair_stop(evutil_socket_t fd, short what, void *arg)
+{
+	event_base_loopbreak(impair.base);
+}
+
+/**
+ * Parse a duration (ms, fractions allowed) or a rate (bytes per second,
+ * with k, m or g for multiples of 1000).
+ */
+static int
+impair_value(const char *value, uint64_t *result, bool rate)
+{
+	char *end;
+	double v = strtod(value, &end);
+	if (end == value || v < 0) return -1;
+	if (!rate) {
+		if (*end != '\0') return -1;
+		*result = v * 1000;
+		return 0;
+	}
+	switch (*end) {
+	case 'k': case 'K': v *= 1e3; end++; break;
+	case 'm': case 'M': v *= 1e6; end++; break;
+	case 'g': case 'G': v *= 1e9; end++; break;
+	}
+	if (*end != '\0') return -1;
+	*result = v;
+	return 0;
+}
+
+/**
+ * Parse a rule like `delay=50,jitter=5,rate=1m,stall=1000/200,reset=30000`.
+ */
+static int
+impair_rule(char *spec, struct impair_rule *rule)
+{
+	for (char *item = strtok(spec, ","); item != NULL; item = strtok(NULL, ",")) {
+		char *value = strchr(item, '=');
+		if (value == NULL) return -1;
+		*value++ = '\0';
+		if (strcmp(item, "delay") == 0) {
+			if (impair_value(value, &rule->delay, false) == -1) return -1;
+		} else if (strcmp(item, "jitter") == 0) {
+			if (impair_value(value, &rule->jitter, false) == -1) return -1;
+		} else if (strcmp(item, "rate") == 0) {
+			if (impair_value(value, &rule->rate, true) == -1) return -1;
+		} else if (strcmp(item, "reset") == 0) {
+			if (impair_value(value, &rule->reset, false) == -1) return -1;
+		} else if (strcmp(item, "stall") == 0) {
+			char *duration = strchr(value, '/');
+			if (duration == NULL) return -1;
+			*duration++ = '\0';
+			if (impair_value(value, &rule->stall_every, false) == -1 ||
+			    impair_value(duration, &rule->stall_for, false) == -1)
+				return -1;
+		} else return -1;
+	}
+	return 0;
+}
+
+static void
+impair_usage(void)
+{
+	fprintf(stderr,
+	    "usage: ro-ro-impair [-d] [-S seed] [-b bytes] [-i rule]... laddress:lport raddress:rport\n"
+	    "\n"
+	    "A rule is a list of comma-separated settings, for each direction:\n"
+	    "  delay=ms        delay data\n"
+	    "  jitter=ms       add or remove up to this delay randomly\n"
+	    "  rate=bytes      limit throughput (bytes per second, k/m/g suffixes)\n"
+	    "  stall=ms/ms     stop forwarding periodically for some time\n"
+	    "  reset=ms        close with a RST after this time\n"
+	    "The nth connection gets the nth rule (modulo the number of rules).\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_storage local;
+	int local_len = sizeof(local), debug = 1, rules = 0, ch;
+	unsigned seed = 1;
+	struct evconnlistener *listener = NULL;
+	struct event *sigint = NULL, *sigterm = NULL;
+	struct impair_conn *conn;
+	struct event_config *config;
+
+	while ((ch = getopt(argc, argv, "dS:b:i:")) != -1) {
+		switch (ch) {
+		case 'd':
+			debug++;
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			impair.queue = strtoul(optarg, NULL, 0);
+			if (impair.queue == 0) impair_usage();
+			break;
+		case 'i':
+			if (rules == IMPAIR_RULES ||
+			    impair_rule(optarg, &impair.rules[rules++]) == -1)
+				impair_usage();
+			break;
+		default:
+			impair_usage();
+		}
+	}
+	if (argc - optind != 2) impair_usage();
+	if (rules > 0) impair.nrules = rules;
+	impair.remote_len = sizeof(impair.remote);
+	if (evutil_parse_sockaddr_port(argv[optind], (struct sockaddr *)&local,
+		&local_len) == -1 ||
+	    evutil_parse_sockaddr_port(argv[optind + 1],
+		(struct sockaddr *)&impair.remote, &impair.remote_len) == -1)
+		impair_usage();
+
+	log_init(debug, "ro-ro-impair");
+	srandom(seed);
+	signal(SIGPIPE, SIG_IGN);
+	TAILQ_INIT(&impair.conns);
+	/* Delays are in µs, not in ms */
+	if ((config = event_config_new()) == NULL ||
+	    event_config_set_flag(config, EVENT_BASE_FLAG_PRECISE_TIMER) == -1 ||
+	    (impair.base = event_base_new_with_config(config)) == NULL)
+		fatalx("unable to create event base");
+	event_config_free(config);
+	if ((listener = evconnlistener_new_bind(impair.base, impair_accept, NULL,
+		    LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_EXEC,
+		    128, (struct sockaddr *)&local, local_len)) == NULL)
+		fatal("impair", "unable to listen");
+	if ((sigint = evsignal_new(impair.base, SIGINT, impair_stop, NULL)) == NULL ||
+	    (sigterm = evsignal_new(impair.base, SIGTERM, impair_stop, NULL)) == NULL ||
+	    event_add(sigint, NULL) == -1 || event_add(sigterm, NULL) == -1)
+		fatalx("unable to setup signals");
+	log_info("impair", "listening on %s, forwarding to %s with %u rule(s)",
+	    argv[optind], argv[optind + 1], impair.nrules);
+
+	event_base_dispatch(impair.base);
+
+	while ((conn = TAILQ_FIRST(&impair.conns)) != NULL) impair_free(conn);
+	evconnlistener_free(listener);
+	event_free(sigint);
+	event_free(sigterm);
+	event_base_free(impair.base);
+	return 0;
+}
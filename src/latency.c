@@ -0,0 +1,226 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Time spent by data in each stage (with `--latency`). Values are
+ * microseconds, counted in log-linear buckets like HdrHistogram: each
+ * power of two is split in 2^RO_LATENCY_SUB buckets, so a value is known
+ * within 12.5%. Each local endpoint has its own histograms and each worker
+ * sums them in its metrics.
+ *
+ * Frames are timed from their header. Bytes in the read and write pipes
+ * are timed with marks: when bytes come in, their offset and the time are
+ * kept. When bytes go out, the mark of the first of them tells how long
+ * it waited. When there are too many marks, the last one is extended:
+ * the bytes are accounted with the time of the oldest of them.
+ */
+
+#include "ro-ro-tcp.h"
+
+#include <time.h>
+#include <inttypes.h>
+#include <event2/buffer.h>
+
+static const char *stage_names[STAGE_MAX] = {
+	[STAGE_READ] = "read",
+	[STAGE_SEND] = "send",
+	[STAGE_RECEIVE] = "receive",
+	[STAGE_WRITE] = "write"
+};
+
+uint64_t
+latency_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static unsigned
+latency_bucket(uint64_t value)
+{
+	if (value >= (1ULL << RO_LATENCY_MAX))
+		value = (1ULL << RO_LATENCY_MAX) - 1;
+	if (value < (1 << RO_LATENCY_SUB)) return value;
+	unsigned shift = 63 - __builtin_clzll(value) - RO_LATENCY_SUB;
+	return ((shift + 1) << RO_LATENCY_SUB) +
+	    ((value >> shift) & ((1 << RO_LATENCY_SUB) - 1));
+}
+
+/**
+ * Smallest value larger than those of a bucket.
+ */
+static uint64_t
+latency_bound(unsigned bucket)
+{
+	if (bucket < (1 << RO_LATENCY_SUB)) return bucket + 1;
+	unsigned shift = (bucket >> RO_LATENCY_SUB) - 1;
+	uint64_t mantissa = bucket & ((1 << RO_LATENCY_SUB) - 1);
+	return (((1 << RO_LATENCY_SUB) + mantissa + 1) << shift);
+}
+
+/**
+ * Account the time spent by data in a stage.
+ */
+void
+latency_observe(struct ro_local *local, enum ro_stage stage, uint64_t value)
+{
+	struct ro_latency *latency = local->latency;
+	struct ro_metrics *metrics = &local->worker->metrics;
+	unsigned bucket = latency_bucket(value);
+	if (latency == NULL) return;
+	latency->buckets[stage][bucket]++;
+	if (value > latency->max[stage]) latency->max[stage] = value;
+	METRIC_ADD(metrics->latency[stage][bucket], 1);
+	METRIC_ADD(metrics->latency_sum[stage], value);
+}
+
+/**
+ * Mark bytes coming in a pipe.
+ */
+void
+latency_in(struct ro_latency_marks *marks, size_t n)
+{
+	marks->in += n;
+	if (marks->count == RO_LATENCY_MARKS) {
+		unsigned last = (marks->first + marks->count - 1) % RO_LATENCY_MARKS;
+		marks->marks[last].end = marks->in;
+		return;
+	}
+	unsigned next = (marks->first + marks->count++) % RO_LATENCY_MARKS;
+	marks->marks[next].end = marks->in;
+	marks->marks[next].at = latency_now();
+}
+
+/**
+ * Account bytes going out of a pipe with the time the first of them came
+ * in.
+ */
+void
+latency_out(struct ro_local *local, enum ro_stage stage,
+    struct ro_latency_marks *marks, size_t n)
+{
+	if (marks->count > 0) {
+		uint64_t at = marks->marks[marks->first].at;
+		latency_observe(local, stage, latency_now() - at);
+	}
+	marks->out += n;
+	while (marks->count > 0 &&
+	    marks->marks[marks->first].end <= marks->out) {
+		marks->first = (marks->first + 1) % RO_LATENCY_MARKS;
+		marks->count--;
+	}
+}
+
+/**
+ * Value under which a fraction of the values are (in per mille).
+ */
+static uint64_t
+latency_percentile(const uint32_t *buckets, uint64_t max, unsigned permille)
+{
+	uint64_t count = 0, seen = 0;
+	for (unsigned i = 0; i < RO_LATENCY_BUCKETS; i++) count += buckets[i];
+	if (count == 0) return 0;
+	uint64_t rank = (count * permille + 999) / 1000;
+	for (unsigned i = 0; i < RO_LATENCY_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			uint64_t value = latency_bound(i) - 1;
+			return (value < max)?value:max;
+		}
+	}
+	return max;
+}
+
+/**
+ * Write the histograms of all workers in the text format of Prometheus.
+ * Buckets are merged to keep one for each power of two.
+ */
+void
+latency_metrics(struct ro_cfg *cfg, struct evbuffer *out)
+{
+	evbuffer_add_printf(out,
+	    "# HELP ro_ro_tcp_latency_seconds Time spent by data in each stage.\n"
+	    "# TYPE ro_ro_tcp_latency_seconds histogram\n");
+	for (int stage = 0; stage < STAGE_MAX; stage++) {
+		uint64_t cumulated = 0, sum = 0;
+		for (int i = 0; i < cfg->workers; i++)
+			sum += METRIC_GET(cfg->worker[i].metrics.latency_sum[stage]);
+		for (unsigned bucket = 0; bucket < RO_LATENCY_BUCKETS; bucket++) {
+			for (int i = 0; i < cfg->workers; i++)
+				cumulated += METRIC_GET(
+					cfg->worker[i].metrics.latency[stage][bucket]);
+			if ((bucket & ((1 << RO_LATENCY_SUB) - 1)) !=
+			    (1 << RO_LATENCY_SUB) - 1)
+				continue;
+			evbuffer_add_printf(out,
+			    "ro_ro_tcp_latency_seconds_bucket{stage=\"%s\",le=\"%.6f\"} %" PRIu64 "\n",
+			    stage_names[stage], latency_bound(bucket) / 1000000.,
+			    cumulated);
+		}
+		evbuffer_add_printf(out,
+		    "ro_ro_tcp_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+		    "ro_ro_tcp_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+		    "ro_ro_tcp_latency_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+		    stage_names[stage], cumulated,
+		    stage_names[stage], sum / 1000000.,
+		    stage_names[stage], cumulated);
+	}
+}
+
+/**
+ * Write the percentiles of a local endpoint as a JSON member.
+ */
+void
+latency_json(struct evbuffer *out, struct ro_local *local)
+{
+	struct ro_latency *latency = local->latency;
+	if (latency == NULL) return;
+	evbuffer_add_printf(out, ",\"latency\":{");
+	for (int stage = 0; stage < STAGE_MAX; stage++) {
+		uint64_t count = 0;
+		for (unsigned i = 0; i < RO_LATENCY_BUCKETS; i++)
+			count += latency->buckets[stage][i];
+		evbuffer_add_printf(out,
+		    "%s\"%s\":{\"count\":%" PRIu64 ",\"p50\":%" PRIu64
+		    ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+		    stage?",":"", stage_names[stage], count,
+		    latency_percentile(latency->buckets[stage], latency->max[stage], 500),
+		    latency_percentile(latency->buckets[stage], latency->max[stage], 990),
+		    latency_percentile(latency->buckets[stage], latency->max[stage], 999),
+		    latency->max[stage]);
+	}
+	evbuffer_add_printf(out, "}");
+}
+
+/**
+ * Log the percentiles of a local endpoint.
+ */
+void
+latency_debug(struct ro_local *local)
+{
+	struct ro_latency *latency = local->latency;
+	if (latency == NULL) return;
+	for (int stage = 0; stage < STAGE_MAX; stage++)
+		log_info("latency",
+		    "local [%s]:%s: %s: p50 %" PRIu64 " µs, p99 %" PRIu64
+		    " µs, max %" PRIu64 " µs",
+		    local->addr, local->serv, stage_names[stage],
+		    latency_percentile(latency->buckets[stage], latency->max[stage], 500),
+		    latency_percentile(latency->buckets[stage], latency->max[stage], 990),
+		    latency->max[stage]);
+}
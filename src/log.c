@@ -29,6 +29,8 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 /* By default, logging is done on stderr. */
 static int	 debug = 1;
@@ -40,13 +42,48 @@ static void *logh_arg = NULL;
 static void	 vlog(int, const char *, const char *, va_list);
 static void	 logit(int, const char *, const char *, ...);
 
+/* Checked by the macros of log.h before evaluating the arguments */
+int		 log_info_enabled = 0;
+int		 log_debug_enabled = 0;
+
+/* Messages waiting for the background writer. This is a bounded queue
+ * without locks: a producer reserves a slot by incrementing `in`, fills it
+ * and publishes it by updating its sequence number. The writer does the
+ * same with `out`. When the queue is full, messages are dropped instead of
+ * waiting. */
+#define LOG_RING_SIZE 4096	/* power of 2 */
+struct log_slot {
+	size_t seq;
+	int pri;
+	const char *token;
+	char *msg;
+};
+static struct {
+	struct log_slot *slots;
+	size_t in;		/* next slot to fill */
+	size_t out;		/* next slot to write */
+	size_t dropped;		/* messages dropped since last report */
+	sem_t ready;		/* one post per published message */
+	pthread_t writer;
+	int running;
+	int stop;
+} ring;
+
 #define MAX_DBG_TOKENS 40
 static const char const *tokens[MAX_DBG_TOKENS + 1] = {NULL};
 
+static void
+log_levels(void)
+{
+	log_info_enabled = (debug > 1 || logh);
+	log_debug_enabled = (debug > 2 || logh);
+}
+
 void
 log_init(int n_debug, const char *progname)
 {
 	debug = n_debug;
+	log_levels();
 
 	if (!debug)
 		openlog(progname, LOG_PID | LOG_NDELAY, LOG_DAEMON);
@@ -59,6 +96,7 @@ log_register(void (*cb)(int, const char*, void*), void *arg)
 {
 	logh = cb;
 	logh_arg = arg;
+	log_levels();
 }
 
 void
@@ -88,10 +126,10 @@ static char *
 date()
 {
 	/* Return the current date as incomplete ISO 8601 (2012-12-12T16:13:30) */
-	static char date[] = "2012-12-12T16:13:30";
+	static __thread char date[] = "2012-12-12T16:13:30";
 	time_t t = time(NULL);
-	struct tm *tmp = localtime(&t);
-	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", tmp);
+	struct tm tm;
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime_r(&t, &tm));
 	return date;
 }
 
@@ -128,19 +166,175 @@ translate(int fd, int priority)
 	return "[UNKN]";
 }
 
+/**
+ * Write a formatted message to its destination.
+ */
 static void
-vlog(int pri, const char *token, const char *fmt, va_list ap)
+log_output(int pri, const char *token, const char *msg)
 {
 	if (logh) {
-		char *result;
-		if (vasprintf(&result, fmt, ap) != -1) {
-			logh(pri, result, logh_arg);
-			free(result);
-			return;
+		logh(pri, msg, logh_arg);
+		return;
+	}
+	if (debug)
+		fprintf(stderr, "%s %s%s%s]%s %s\n",
+		    date(),
+		    translate(STDERR_FILENO, pri),
+		    token ? "/" : "", token ? token : "",
+		    isatty(STDERR_FILENO) ? "\033[0m" : "",
+		    msg);
+	else
+		syslog(pri, "%s", msg);
+	fflush(stderr);
+}
+
+/**
+ * Queue a message for the background writer.
+ *
+ * @return 0 if the message is queued or dropped, -1 if it should be
+ *         written directly
+ */
+static int
+log_enqueue(int pri, const char *token, const char *fmt, va_list ap)
+{
+	struct log_slot *slot;
+	size_t pos = __atomic_load_n(&ring.in, __ATOMIC_RELAXED);
+	char *msg;
+	while (1) {
+		slot = &ring.slots[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring.in, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((ssize_t)(seq - pos) < 0) {
+			__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+			return 0;
+		} else
+			pos = __atomic_load_n(&ring.in, __ATOMIC_RELAXED);
+	}
+	if (vasprintf(&msg, fmt, ap) == -1) msg = NULL;
+	slot->pri = pri;
+	slot->token = token;
+	slot->msg = msg;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&ring.ready);
+	return 0;
+}
+
+/**
+ * Write the oldest queued message, if any.
+ *
+ * @return 1 if a message was taken from the queue, 0 otherwise
+ */
+static int
+log_dequeue(void)
+{
+	struct log_slot *slot;
+	size_t pos = __atomic_load_n(&ring.out, __ATOMIC_RELAXED);
+	size_t dropped;
+	while (1) {
+		slot = &ring.slots[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos + 1) {
+			if (__atomic_compare_exchange_n(&ring.out, &pos, pos + 1,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((ssize_t)(seq - (pos + 1)) < 0)
+			return 0;
+		else
+			pos = __atomic_load_n(&ring.out, __ATOMIC_RELAXED);
+	}
+	int pri = slot->pri;
+	const char *token = slot->token;
+	char *msg = slot->msg;
+	__atomic_store_n(&slot->seq, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+
+	if ((dropped = __atomic_exchange_n(&ring.dropped, 0, __ATOMIC_RELAXED)) > 0) {
+		char *lost;
+		if (asprintf(&lost, "%zu messages dropped, logging is too slow",
+			dropped) != -1) {
+			log_output(LOG_WARNING, "log", lost);
+			free(lost);
 		}
-		/* Otherwise, fallback to output on stderr. */
 	}
-	if (debug || logh) {
+	if (msg) {
+		log_output(pri, token, msg);
+		free(msg);
+	}
+	return 1;
+}
+
+/**
+ * Write queued messages until stopped. A wakeup may be for a message
+ * behind a slot not published yet: the whole queue is drained each time
+ * so that this message is written with the next one.
+ */
+static void *
+log_writer(void *arg)
+{
+	while (1) {
+		if (sem_wait(&ring.ready) == -1) continue;
+		while (log_dequeue());
+		if (__atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE)) break;
+	}
+	return NULL;
+}
+
+/**
+ * Write messages from a background thread. Threads logging a message only
+ * queue it and never wait for the output.
+ *
+ * @return 0 on success, -1 on error (messages are still written directly)
+ */
+int
+log_async(void)
+{
+	if (ring.running) return 0;
+	if (ring.slots == NULL) {
+		if ((ring.slots = calloc(LOG_RING_SIZE,
+			    sizeof(struct log_slot))) == NULL)
+			return -1;
+		for (size_t i = 0; i < LOG_RING_SIZE; i++)
+			ring.slots[i].seq = i;
+		if (sem_init(&ring.ready, 0, 0) == -1) {
+			free(ring.slots);
+			ring.slots = NULL;
+			return -1;
+		}
+	}
+	ring.stop = 0;
+	if (pthread_create(&ring.writer, NULL, log_writer, NULL) != 0)
+		return -1;
+	__atomic_store_n(&ring.running, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/**
+ * Stop the background writer once all queued messages have been written.
+ * Messages are then written directly. The queue is kept: other threads may
+ * still be about to use it.
+ */
+void
+log_flush(void)
+{
+	if (!__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE)) return;
+	__atomic_store_n(&ring.running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring.stop, 1, __ATOMIC_RELEASE);
+	sem_post(&ring.ready);
+	pthread_join(ring.writer, NULL);
+	while (log_dequeue());
+}
+
+static void
+vlog(int pri, const char *token, const char *fmt, va_list ap)
+{
+	char *msg;
+	if (__atomic_load_n(&ring.running, __ATOMIC_ACQUIRE) &&
+	    log_enqueue(pri, token, fmt, ap) == 0)
+		return;
+	if (!logh && debug) {
+		/* Output on stderr does not need a copy */
 		char *nfmt;
 		/* best effort in out of mem situations */
 		if (asprintf(&nfmt, "%s %s%s%s]%s %s\n",
@@ -156,8 +350,16 @@ vlog(int pri, const char *token, const char *fmt, va_list ap)
 			free(nfmt);
 		}
 		fflush(stderr);
-	} else
+		return;
+	}
+	if (!logh) {
 		vsyslog(pri, fmt, ap);
+		return;
+	}
+	if (vasprintf(&msg, fmt, ap) != -1) {
+		log_output(pri, token, msg);
+		free(msg);
+	}
 }
 
 
@@ -206,7 +408,7 @@ log_crit(const char *token, const char *emsg, ...)
 }
 
 void
-log_info(const char *token, const char *emsg, ...)
+(log_info)(const char *token, const char *emsg, ...)
 {
 	va_list	 ap;
 
@@ -232,7 +434,7 @@ log_debug_accept_token(const char *token)
 }
 
 void
-log_debug(const char *token, const char *emsg, ...)
+(log_debug)(const char *token, const char *emsg, ...)
 {
 	va_list	 ap;
 
@@ -255,6 +457,7 @@ fatal(const char *token, const char *emsg)
 		else
 			logit(LOG_CRIT, token ? token : "fatal", "%s", emsg);
 
+	log_flush();
 	exit(1);
 }
 
@@ -30,5 +30,24 @@ void             fatalx(const char *) __attribute__((__noreturn__));
 
 void		 log_register(void (*cb)(int, const char*, void*), void*);
 void             log_accept(const char *);
+int              log_async(void);
+void             log_flush(void);
+
+/* Levels are checked before evaluating the arguments. Debug logging can be
+ * removed at compile time. */
+extern int	 log_info_enabled;
+extern int	 log_debug_enabled;
+#define log_info(...) do {					\
+		if (log_info_enabled) (log_info)(__VA_ARGS__);	\
+	} while (0)
+#ifdef DISABLE_DEBUG_LOG
+# define log_debug(...) do {					\
+		if (0) (log_debug)(__VA_ARGS__);		\
+	} while (0)
+#else
+# define log_debug(...) do {					\
+		if (log_debug_enabled) (log_debug)(__VA_ARGS__);	\
+	} while (0)
+#endif
 
 #endif
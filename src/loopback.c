@@ -0,0 +1,214 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Helpers for the programs starting ro-ro-tcp on the loopback interface
+ * (`test-fds`, `test-replay` and `bench-forward`): free ports, an echo
+ * server, spawning programs and clients checking their data is echoed.
+ */
+
+#include "loopback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/**
+ * Get a free port on the loopback interface. When `lfd` is not NULL, the
+ * bound socket is kept there, otherwise it is closed.
+ */
+int
+loopback_port(int *lfd)
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	socklen_t len = sizeof(addr);
+	int one = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (fd == -1 ||
+	    bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+		perror("unable to get a port");
+		exit(1);
+	}
+	if (lfd) *lfd = fd;
+	else close(fd);
+	return ntohs(addr.sin_port);
+}
+
+/**
+ * Wait for a port to be in the LISTEN state, without connecting to it.
+ */
+int
+loopback_listening(int port)
+{
+	char line[256];
+	unsigned local, state;
+	for (int i = 0; i < 100; i++) {
+		FILE *f = fopen("/proc/net/tcp", "r");
+		if (f == NULL) return -1;
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, " %*d: %*x:%x %*x:%*x %x",
+				&local, &state) == 2 &&
+			    local == (unsigned)port && state == 0x0a) {
+				fclose(f);
+				return 0;
+			}
+		}
+		fclose(f);
+		usleep(50000);
+	}
+	return -1;
+}
+
+static void *
+loopback_echo_client(void *arg)
+{
+	int fd = (intptr_t)arg;
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		if (write(fd, buf, n) != n) break;
+	close(fd);
+	return NULL;
+}
+
+static void *
+loopback_echo_accept(void *arg)
+{
+	int lfd = (intptr_t)arg, fd;
+	pthread_t thread;
+	while ((fd = accept(lfd, NULL, NULL)) != -1) {
+		if (pthread_create(&thread, NULL, loopback_echo_client,
+			(void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/**
+ * Start an echo server in a thread on a socket from `loopback_port()`.
+ */
+int
+loopback_echo(int lfd)
+{
+	pthread_t thread;
+	if (listen(lfd, 128) == -1 ||
+	    pthread_create(&thread, NULL, loopback_echo_accept,
+		(void *)(intptr_t)lfd) != 0) {
+		perror("unable to start echo server");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/**
+ * Start a program with its error output discarded.
+ */
+pid_t
+loopback_spawn(const char *program, char *const argv[])
+{
+	pid_t pid;
+	if ((pid = fork()) == -1) {
+		perror("unable to start program");
+		return -1;
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDERR_FILENO);
+		execv(program, argv);
+		_exit(1);
+	}
+	return pid;
+}
+
+/**
+ * Connect to a port on the loopback interface.
+ *
+ * @return the connected socket or -1 on error
+ */
+int
+loopback_connect(int port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1 ||
+	    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		if (fd != -1) close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Send data to an echo server and read it back at the same time, with at
+ * most `window` bytes not echoed back yet. The socket is left open (and
+ * non-blocking).
+ *
+ * @return 0 if the data was echoed back, -1 otherwise
+ */
+int
+loopback_exchange(int fd, const char *data, size_t len, size_t window)
+{
+	char *buf = malloc(len);
+	size_t sent = 0, got = 0;
+	ssize_t n;
+	if (buf == NULL) return -1;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	while (got < len) {
+		size_t room = (sent < len)?window - (sent - got):0;
+		if (room > len - sent) room = len - sent;
+		struct pollfd pfd = {
+			.fd = fd,
+			.events = POLLIN | ((room > 0)?POLLOUT:0)
+		};
+		if (poll(&pfd, 1, -1) == -1) break;
+		if ((pfd.revents & POLLOUT) &&
+		    (n = write(fd, data + sent, room)) > 0)
+			sent += n;
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			n = read(fd, buf + got, len - got);
+			if (n == 0 || (n == -1 && errno != EAGAIN)) break;
+			if (n > 0) got += n;
+		}
+	}
+	if (got != len || memcmp(buf, data, len) != 0) {
+		fprintf(stderr, "data was not echoed back (%zu bytes)\n", got);
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,155 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Metrics in the text format of Prometheus. Each worker updates its own
+ * counters on the data path. The first worker sums them when they are
+ * requested on the control socket (see `control.c`): the cost does not
+ * depend on the number of sessions. Sessions and connections in use are
+ * taken from the objects handed out by `slab.c`.
+ */
+
+#include "ro-ro-tcp.h"
+
+#include <inttypes.h>
+#include <event2/buffer.h>
+
+/**
+ * Add a value to a histogram.
+ */
+void
+metrics_observe(struct ro_histogram *histogram, uint64_t value)
+{
+	unsigned bucket = (value <= 1)?0:(64 - __builtin_clzll(value - 1));
+	if (bucket < RO_HISTOGRAM_BUCKETS)
+		METRIC_ADD(histogram->buckets[bucket], 1);
+	METRIC_ADD(histogram->count, 1);
+	METRIC_ADD(histogram->sum, value);
+}
+
+static void
+metrics_sum(struct ro_histogram *total, struct ro_histogram *histogram)
+{
+	for (int i = 0; i < RO_HISTOGRAM_BUCKETS; i++)
+		total->buckets[i] += METRIC_GET(histogram->buckets[i]);
+	total->count += METRIC_GET(histogram->count);
+	total->sum += METRIC_GET(histogram->sum);
+}
+
+static void
+metrics_header(struct evbuffer *out, const char *name, const char *type,
+    const char *help)
+{
+	evbuffer_add_printf(out, "# HELP ro_ro_tcp_%s %s\n# TYPE ro_ro_tcp_%s %s\n",
+	    name, help, name, type);
+}
+
+/**
+ * Write the buckets of a histogram. Values are divided by `scale` (to
+ * export seconds from microseconds).
+ */
+static void
+metrics_histogram(struct evbuffer *out, const char *name, const char *labels,
+    struct ro_histogram *histogram, double scale)
+{
+	uint64_t cumulated = 0;
+	const char *sep = (*labels)?",":"";
+	const char *open = (*labels)?"{":"", *close = (*labels)?"}":"";
+	for (int i = 0; i < RO_HISTOGRAM_BUCKETS; i++) {
+		cumulated += histogram->buckets[i];
+		evbuffer_add_printf(out, "ro_ro_tcp_%s_bucket{%s%sle=\"%.10g\"} %" PRIu64 "\n",
+		    name, labels, sep, (double)(1ULL << i) / scale, cumulated);
+	}
+	evbuffer_add_printf(out, "ro_ro_tcp_%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n",
+	    name, labels, sep, histogram->count);
+	if (scale == 1)
+		evbuffer_add_printf(out, "ro_ro_tcp_%s_sum%s%s%s %" PRIu64 "\n",
+		    name, open, labels, close, histogram->sum);
+	else
+		evbuffer_add_printf(out, "ro_ro_tcp_%s_sum%s%s%s %.6f\n",
+		    name, open, labels, close, (double)histogram->sum / scale);
+	evbuffer_add_printf(out, "ro_ro_tcp_%s_count%s%s%s %" PRIu64 "\n",
+	    name, open, labels, close, histogram->count);
+}
+
+/**
+ * Write the metrics of all workers.
+ */
+void
+metrics_write(struct ro_cfg *cfg, struct evbuffer *out)
+{
+	struct ro_metrics total = {};
+	uint64_t sessions = 0, connections = 0;
+	for (int i = 0; i < cfg->workers; i++) {
+		struct ro_worker *worker = &cfg->worker[i];
+		struct ro_metrics *metrics = &worker->metrics;
+		for (int j = 0; j < 2; j++) {
+			total.bytes[j] += METRIC_GET(metrics->bytes[j]);
+			total.frames[j] += METRIC_GET(metrics->frames[j]);
+			total.eagain[j] += METRIC_GET(metrics->eagain[j]);
+			metrics_sum(&total.handshake[j], &metrics->handshake[j]);
+		}
+		total.reorder_stalls += METRIC_GET(metrics->reorder_stalls);
+		metrics_sum(&total.frame_size, &metrics->frame_size);
+		sessions += METRIC_GET(worker->slabs[SLAB_LOCAL].used);
+		connections += METRIC_GET(worker->slabs[SLAB_REMOTE].used);
+	}
+
+	metrics_header(out, "info", "gauge", "Role and engine.");
+	evbuffer_add_printf(out,
+	    "ro_ro_tcp_info{role=\"%s\",engine=\"%s\",workers=\"%d\"} 1\n",
+	    (cfg->role == ROLE_PROXY)?"proxy":"relay",
+	    cfg->engine->name, cfg->workers);
+	metrics_header(out, "sessions", "gauge", "Clients (or servers) connected.");
+	evbuffer_add_printf(out, "ro_ro_tcp_sessions %" PRIu64 "\n", sessions);
+	metrics_header(out, "connections", "gauge",
+	    "Connections between proxy and relay attached to a session.");
+	evbuffer_add_printf(out, "ro_ro_tcp_connections %" PRIu64 "\n", connections);
+	metrics_header(out, "bytes_total", "counter",
+	    "Bytes read from (out) and written to (in) clients or servers.");
+	evbuffer_add_printf(out,
+	    "ro_ro_tcp_bytes_total{direction=\"out\"} %" PRIu64 "\n"
+	    "ro_ro_tcp_bytes_total{direction=\"in\"} %" PRIu64 "\n",
+	    total.bytes[0], total.bytes[1]);
+	metrics_header(out, "frames_total", "counter",
+	    "Data frames sent (out) and received (in).");
+	evbuffer_add_printf(out,
+	    "ro_ro_tcp_frames_total{direction=\"out\"} %" PRIu64 "\n"
+	    "ro_ro_tcp_frames_total{direction=\"in\"} %" PRIu64 "\n",
+	    total.frames[0], total.frames[1]);
+	metrics_header(out, "frame_size_bytes", "histogram",
+	    "Size of the payload of data frames sent.");
+	metrics_histogram(out, "frame_size_bytes", "", &total.frame_size, 1);
+	metrics_header(out, "eagain_total", "counter",
+	    "Reads and writes (or splices) which would have blocked.");
+	evbuffer_add_printf(out,
+	    "ro_ro_tcp_eagain_total{operation=\"read\"} %" PRIu64 "\n"
+	    "ro_ro_tcp_eagain_total{operation=\"write\"} %" PRIu64 "\n",
+	    total.eagain[0], total.eagain[1]);
+	metrics_header(out, "reorder_stalls_total", "counter",
+	    "Connections which stopped reading because the reorder buffer was full.");
+	evbuffer_add_printf(out, "ro_ro_tcp_reorder_stalls_total %" PRIu64 "\n",
+	    total.reorder_stalls);
+	if (cfg->latency) latency_metrics(cfg, out);
+	if (cfg->role != ROLE_PROXY) return;
+	metrics_header(out, "handshake_seconds", "histogram",
+	    "Time to establish a connection to relay, up to the reply to the hello.");
+	metrics_histogram(out, "handshake_seconds", "fastopen=\"0\"",
+	    &total.handshake[0], 1000000.);
+	metrics_histogram(out, "handshake_seconds", "fastopen=\"1\"",
+	    &total.handshake[1], 1000000.);
+}
@@ -0,0 +1,307 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Pool of connections to the relay (proxy only). Each worker keeps a few
+ * connections already established, such that a new client does not wait
+ * for the TCP handshake. A pooled connection sends a version 2 hello with
+ * RO_POOL_GROUP as group ID and waits for it to be echoed back: the relay
+ * then waits for the real hello, sent when the connection is claimed. The
+ * relay closes pooled connections idle for RO_POOL_IDLE seconds, the proxy
+ * recycles them after half this delay.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+static void pool_fill(struct ro_worker *);
+
+static void
+pool_destroy(struct pool_connection *pooled)
+{
+	struct ro_worker *worker = pooled->worker;
+	TAILQ_REMOVE(&worker->event->pool, pooled, next);
+	event_close_and_free(pooled->event);
+	free(pooled);
+}
+
+/**
+ * Drop a pooled connection after an error and try again later.
+ */
+static void
+pool_failed(struct pool_connection *pooled)
+{
+	struct ro_worker *worker = pooled->worker;
+	struct timeval tv = { RO_POOL_RETRY, 0 };
+	pool_destroy(pooled);
+	if (worker->event->pool_retry)
+		event_add(worker->event->pool_retry, &tv);
+}
+
+/**
+ * Read the reply of the relay to the hello of a pooled connection.
+ *
+ * @return 1 when the reply has been received, 0 when we need to wait for
+ *         more bytes, -1 on error
+ */
+static int
+pool_receive_hello(struct pool_connection *pooled)
+{
+	struct ro_worker *worker = pooled->worker;
+	struct ro_cfg *cfg = worker->cfg;
+	ssize_t n;
+	while (pooled->hello_bytes < RO_HELLO_SIZE) {
+		n = read(event_get_fd(pooled->event),
+		    pooled->hello + pooled->hello_bytes,
+		    RO_HELLO_SIZE - pooled->hello_bytes);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			log_debug("pool", "unable to receive reply from [%s]:%s: %s",
+			    pooled->raddr, pooled->rserv, strerror(errno));
+			return -1;
+		}
+		if (n == 0) {
+			log_debug("pool", "[%s]:%s closed the pooled connection",
+			    pooled->raddr, pooled->rserv);
+			return -1;
+		}
+		pooled->hello_bytes += n;
+	}
+	uint32_t id, magic;
+	uint8_t version = pooled->hello[sizeof(magic)];
+	memcpy(&magic, pooled->hello, sizeof(magic));
+	memcpy(&id, pooled->hello + sizeof(magic) + 1, sizeof(id));
+	if (ntohl(magic) != RO_MAGIC || ntohl(id) != RO_POOL_GROUP ||
+	    version > cfg->protocol) {
+		log_debug("pool", "[%s]:%s sent an invalid reply to a pooled connection",
+		    pooled->raddr, pooled->rserv);
+		return -1;
+	}
+	if (version < 2) {
+		log_warnx("pool", "[%s]:%s does not support pooled connections",
+		    pooled->raddr, pooled->rserv);
+		event_free(worker->event->pool_retry);
+		worker->event->pool_retry = NULL;
+		return -1;
+	}
+	return 1;
+}
+
+static void
+pool_data_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct pool_connection *pooled = arg;
+	struct ro_worker *worker = pooled->worker;
+	struct ro_cfg *cfg = worker->cfg;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	switch (pooled->state) {
+	case POOL_CONNECTING: {
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+			log_debug("pool", "unable to connect to [%s]:%s: %s",
+			    pooled->raddr, pooled->rserv, strerror(err?err:errno));
+			pool_failed(pooled);
+			return;
+		}
+		uint32_t id = htonl(RO_POOL_GROUP);
+		uint32_t magic = htonl(RO_MAGIC);
+		char hello[RO_HELLO_SIZE];
+		ssize_t n;
+		memcpy(hello, &magic, sizeof(magic));
+		hello[sizeof(magic)] = cfg->protocol;
+		memcpy(hello + sizeof(magic) + 1, &id, sizeof(id));
+		while ((n = write(fd, hello, sizeof(hello))) == -1 && errno == EINTR);
+		if (n != sizeof(hello)) {
+			log_debug("pool", "unable to send hello to [%s]:%s",
+			    pooled->raddr, pooled->rserv);
+			pool_failed(pooled);
+			return;
+		}
+		pooled->state = POOL_HELLO;
+		event_del(pooled->event);
+		event_assign(pooled->event, worker->event->base, fd,
+		    EV_READ|EV_PERSIST, pool_data_cb, pooled);
+		event_add(pooled->event, NULL);
+		return;
+	}
+	case POOL_HELLO: {
+		int rc = pool_receive_hello(pooled);
+		if (rc == 0) return;
+		if (rc == -1) {
+			pool_failed(pooled);
+			return;
+		}
+		struct timeval tv = { RO_POOL_IDLE / 2, 0 };
+		log_debug("pool", "worker %u: connection [%s]:%s -> [%s]:%s ready",
+		    worker->index,
+		    pooled->laddr, pooled->lserv,
+		    pooled->raddr, pooled->rserv);
+		pooled->state = POOL_READY;
+		event_add(pooled->event, &tv);
+		return;
+	}
+	case POOL_READY:
+		/* Nothing is expected from the relay: either it closed the
+		 * connection or we keep it too long. Replace it. */
+		if (what & EV_TIMEOUT)
+			log_debug("pool", "recycle idle connection to [%s]:%s",
+			    pooled->raddr, pooled->rserv);
+		else
+			log_debug("pool", "pooled connection to [%s]:%s closed by relay",
+			    pooled->raddr, pooled->rserv);
+		pool_destroy(pooled);
+		pool_fill(worker);
+		return;
+	}
+}
+
+/**
+ * Open a new pooled connection.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int
+pool_connect(struct ro_worker *worker)
+{
+	struct ro_cfg *cfg = worker->cfg;
+	struct pool_connection *pooled;
+	int sfd;
+	if ((pooled = calloc(1, sizeof(struct pool_connection))) == NULL) {
+		log_warn("pool", "unable to allocate memory for pooled connection");
+		return -1;
+	}
+	pooled->worker = worker;
+	pooled->state = POOL_CONNECTING;
+	if ((sfd = endpoint_connect(cfg->remote, cfg->fastopen,
+		    pooled->laddr, pooled->lserv,
+		    pooled->raddr, pooled->rserv)) == -1) {
+		free(pooled);
+		return -1;
+	}
+	if ((pooled->event = event_new(worker->event->base, sfd,
+		    EV_WRITE, pool_data_cb, pooled)) == NULL) {
+		log_warnx("pool", "unable to create event for pooled connection");
+		close(sfd);
+		free(pooled);
+		return -1;
+	}
+	event_add(pooled->event, NULL);
+	TAILQ_INSERT_TAIL(&worker->event->pool, pooled, next);
+	return 0;
+}
+
+/**
+ * Open connections until the pool is full.
+ */
+static void
+pool_fill(struct ro_worker *worker)
+{
+	struct ro_cfg *cfg = worker->cfg;
+	struct pool_connection *pooled;
+	struct timeval tv = { RO_POOL_RETRY, 0 };
+	int n = 0;
+	if (worker->event->pool_retry == NULL) return; /* Disabled */
+	TAILQ_FOREACH(pooled, &worker->event->pool, next) n++;
+	while (n++ < cfg->pool) {
+		if (pool_connect(worker) == -1) {
+			event_add(worker->event->pool_retry, &tv);
+			return;
+		}
+	}
+}
+
+static void
+pool_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+	pool_fill(arg);
+}
+
+/**
+ * Start the pool of a worker.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+pool_start(struct ro_worker *worker)
+{
+	TAILQ_INIT(&worker->event->pool);
+	if (worker->cfg->pool == 0) return 0;
+	if ((worker->event->pool_retry = evtimer_new(worker->event->base,
+		    pool_retry_cb, worker)) == NULL) {
+		log_warnx("pool", "unable to create timer for pool of worker %u",
+		    worker->index);
+		return -1;
+	}
+	log_debug("pool", "worker %u keeps %d connection(s) ready",
+	    worker->index, worker->cfg->pool);
+	pool_fill(worker);
+	return 0;
+}
+
+/**
+ * Take an established connection from the pool. The pool is filled again
+ * in the background.
+ *
+ * @return the file descriptor of the connection or -1 if none is ready
+ */
+int
+pool_claim(struct ro_worker *worker,
+    char laddr[static INET6_ADDRSTRLEN], char lserv[static SERVSTRLEN],
+    char raddr[static INET6_ADDRSTRLEN], char rserv[static SERVSTRLEN])
+{
+	struct pool_connection *pooled;
+	int fd;
+	if (worker->cfg->pool == 0) return -1;
+	TAILQ_FOREACH(pooled, &worker->event->pool, next)
+	    if (pooled->state == POOL_READY) break;
+	if (pooled == NULL) {
+		log_debug("pool", "worker %u: no pooled connection ready",
+		    worker->index);
+		return -1;
+	}
+	memcpy(laddr, pooled->laddr, INET6_ADDRSTRLEN);
+	memcpy(lserv, pooled->lserv, SERVSTRLEN);
+	memcpy(raddr, pooled->raddr, INET6_ADDRSTRLEN);
+	memcpy(rserv, pooled->rserv, SERVSTRLEN);
+	fd = event_get_fd(pooled->event);
+	TAILQ_REMOVE(&worker->event->pool, pooled, next);
+	event_free(pooled->event);
+	free(pooled);
+	pool_fill(worker);
+	return fd;
+}
+
+/**
+ * Close all pooled connections of a worker.
+ */
+void
+pool_free(struct ro_worker *worker)
+{
+	struct pool_connection *pooled;
+	if (worker->event->pool_retry) {
+		event_free(worker->event->pool_retry);
+		worker->event->pool_retry = NULL;
+	}
+	while ((pooled = TAILQ_FIRST(&worker->event->pool)) != NULL)
+		pool_destroy(pooled);
+}
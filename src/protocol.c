@@ -0,0 +1,153 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Encoding of frame headers for each version of the transmission protocol.
+ *
+ * Version 1 uses a fixed header: a 16-bit serial followed by a 32-bit
+ * length. Only data frames exist.
+ *
+ * Version 2 starts with a control byte:
+ *  - bits 0-1: type of the frame
+ *  - bits 2-4: size of the value field minus 1 (1 to 8 bytes)
+ *  - bits 5-6: size of the length field minus 1 (1 to 4 bytes)
+ *  - bit 7:    reserved, must be 0
+ * The value and the length follow, network-ordered, using as few bytes as
+ * possible. For data frames, the value is the offset of the first byte of
+ * the payload in the stream. A close frame with a length of 1 only closes
+ * the connection carrying it, not the stream. A ping with a length of 2 is
+ * not echoed: with a replay buffer, the proxy sends it first on each
+ * connection to the relay, the value being the number of connections it
+ * lost so far.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+static size_t
+protocol_bytes(uint64_t value)
+{
+	size_t n = 1;
+	while (n < sizeof(value) && (value >> (8 * n)) != 0) n++;
+	return n;
+}
+
+/**
+ * Encode the header of a frame.
+ *
+ * @return the size of the header
+ */
+size_t
+frame_encode(uint8_t version, const struct ro_frame *frame,
+    char buf[static RO_HEADER_MAX])
+{
+	if (version < 2) {
+		uint16_t serial = htons(frame->seq);
+		uint32_t length = htonl(frame->length);
+		memcpy(buf, &serial, sizeof(serial));
+		memcpy(buf + sizeof(serial), &length, sizeof(length));
+		return RO_HEADER_SIZE;
+	}
+
+	size_t vbytes = protocol_bytes(frame->seq);
+	size_t lbytes = protocol_bytes(frame->length);
+	size_t i, n = 0;
+	buf[n++] = frame->type | ((vbytes - 1) << 2) | ((lbytes - 1) << 5);
+	for (i = vbytes; i > 0; i--)
+		buf[n++] = frame->seq >> (8 * (i - 1));
+	for (i = lbytes; i > 0; i--)
+		buf[n++] = frame->length >> (8 * (i - 1));
+	return n;
+}
+
+/**
+ * Tell the size of the header being received.
+ *
+ * @param len Bytes of the header received so far.
+ * @return the size of the header or the number of bytes needed to know it
+ */
+size_t
+frame_header_size(uint8_t version, const char *buf, size_t len)
+{
+	if (version < 2) return RO_HEADER_SIZE;
+	if (len == 0) return RO_HEADER_MIN;
+	uint8_t control = buf[0];
+	return 1 + ((control >> 2) & 7) + 1 + ((control >> 5) & 3) + 1;
+}
+
+/**
+ * Decode a complete header.
+ *
+ * @return -1 if the header is invalid
+ */
+int
+frame_decode(uint8_t version, const char *buf, struct ro_frame *frame)
+{
+	if (version < 2) {
+		uint16_t serial;
+		uint32_t length;
+		memcpy(&serial, buf, sizeof(serial));
+		memcpy(&length, buf + sizeof(serial), sizeof(length));
+		frame->type = FRAME_DATA;
+		frame->seq = ntohs(serial);
+		frame->length = ntohl(length);
+		return (frame->length > 0)?0:-1;
+	}
+
+	const unsigned char *p = (const unsigned char *)buf;
+	uint8_t control = *p++;
+	size_t i, vbytes = ((control >> 2) & 7) + 1, lbytes = ((control >> 5) & 3) + 1;
+	if (control & 0x80) return -1;
+	frame->type = control & 3;
+	frame->seq = 0;
+	frame->length = 0;
+	for (i = 0; i < vbytes; i++) frame->seq = (frame->seq << 8) | *p++;
+	for (i = 0; i < lbytes; i++) frame->length = (frame->length << 8) | *p++;
+	switch (frame->type) {
+	case FRAME_DATA:
+		return (frame->length > 0)?0:-1;
+	case FRAME_PING:
+		return (frame->length <= 2)?0:-1;
+	case FRAME_CLOSE:
+		return (frame->length <= 1)?0:-1;
+	default:
+		return (frame->length == 0)?0:-1;
+	}
+}
+
+/**
+ * Compute the sequence of the data frame following the given one: the next
+ * serial with version 1, the offset of the next byte with version 2.
+ */
+uint64_t
+frame_next(uint8_t version, uint64_t seq, uint32_t length)
+{
+	if (version < 2) return (uint16_t)(seq + 1);
+	return seq + length;
+}
+
+/**
+ * Sequence of the first data frame.
+ */
+uint64_t
+frame_first(uint8_t version)
+{
+	return (version < 2)?1:0;
+}
@@ -27,6 +27,7 @@ int
 main(int argc, char *argv[])
 {
 	int exitcode = EXIT_FAILURE;
+	struct ro_cfg cfg = {};
 
 	/* Common arguments */
 #define RO_COMMON_ARGS(X) \
@@ -34,28 +35,53 @@ main(int argc, char *argv[])
 	struct arg_lit *arg_ ## X ## _help  = arg_lit0("h", "help",  "display help and exit"); \
 	struct arg_lit *arg_ ## X ## _version     = arg_lit0("v", "version", "print version and exit"); \
 	struct arg_int *arg_ ## X ## _listen      = arg_intn("l", "listen", "conns", 0, 1, "listen queue length"); \
+	struct arg_int *arg_ ## X ## _workers     = arg_intn("w", "workers", "n", 0, 1, "number of worker threads"); \
+	struct arg_int *arg_ ## X ## _reorder     = arg_intn(NULL, "reorder-buffer", "bytes", 0, 1, "size of reorder buffer for each client"); \
+	struct arg_int *arg_ ## X ## _min_frame   = arg_intn(NULL, "min-frame", "bytes", 0, 1, "minimum size of a frame"); \
+	struct arg_int *arg_ ## X ## _max_frame   = arg_intn(NULL, "max-frame", "bytes", 0, 1, "maximum size of a frame"); \
+	struct arg_int *arg_ ## X ## _frame_delay = arg_intn(NULL, "frame-delay", "ms", 0, 1, "how long to hold frames smaller than minimum size"); \
+	struct arg_lit *arg_ ## X ## _io_uring    = arg_lit0(NULL, "io-uring", "batch operations with io_uring"); \
+	struct arg_str *arg_ ## X ## _engine      = arg_str0("E", "engine", "name", "how to move data (splice, copy)"); \
+	struct arg_lit *arg_ ## X ## _zerocopy    = arg_lit0(NULL, "zerocopy", "send to connections with MSG_ZEROCOPY"); \
+	struct arg_int *arg_ ## X ## _protocol    = arg_intn(NULL, "protocol", "version", 0, 1, "highest version of the protocol to use"); \
+	struct arg_int *arg_ ## X ## _max_pipe    = arg_intn(NULL, "max-pipe", "bytes", 0, 1, "maximum size of pipes for each client"); \
+	struct arg_int *arg_ ## X ## _replay      = arg_intn(NULL, "replay-buffer", "bytes", 0, 1, "unacknowledged bytes kept for each client to survive a lost connection"); \
+	struct arg_lit *arg_ ## X ## _fastopen    = arg_lit0(NULL, "fastopen", "use TCP Fast Open"); \
+	struct arg_str *arg_ ## X ## _control     = arg_str0(NULL, "control", "path|address:port", "serve metrics on a UNIX or TCP socket"); \
+	struct arg_lit *arg_ ## X ## _latency     = arg_lit0(NULL, "latency", "measure time spent by data in each stage"); \
 	struct arg_addr *arg_ ## X ## _local       = arg_addr1(NULL, NULL, "laddress:lport", "address and port to bind to", ':'); \
 	struct arg_addr *arg_ ## X ## _remote      = arg_addr1(NULL, NULL, "raddress:rport", "address and port to connect to", ':');
 #define RO_COMMON_ARGTABLE(X) \
-	    arg_ ## X ## _debug, arg_ ## X ## _help, arg_ ## X ## _version, arg_ ## X ## _listen
+	    arg_ ## X ## _debug, arg_ ## X ## _help, arg_ ## X ## _version, arg_ ## X ## _listen, \
+	    arg_ ## X ## _workers, arg_ ## X ## _reorder, \
+	    arg_ ## X ## _min_frame, arg_ ## X ## _max_frame, arg_ ## X ## _frame_delay, \
+	    arg_ ## X ## _io_uring, arg_ ## X ## _engine, arg_ ## X ## _zerocopy, \
+	    arg_ ## X ## _protocol, arg_ ## X ## _max_pipe, arg_ ## X ## _replay, \
+	    arg_ ## X ## _fastopen, arg_ ## X ## _control, arg_ ## X ## _latency
 
 	/* Proxy arguments */
 	RO_COMMON_ARGS(proxy);
 	struct arg_lit *arg_proxy       = arg_lit1("p", "proxy", "act as a proxy");
 	struct arg_int *arg_proxy_conns = arg_int0("z", "connections", "conns", "number of connections to relay");
+	struct arg_lit *arg_proxy_adaptive = arg_lit0(NULL, "adaptive", "open connections to relay only when needed");
+	struct arg_int *arg_proxy_pool  = arg_int0(NULL, "pool", "conns", "established connections to relay kept ready by each worker");
+	struct arg_lit *arg_proxy_parallel = arg_lit0(NULL, "parallel", "choose group IDs and open all connections to relay at once");
+	struct arg_str *arg_proxy_sched = arg_str0("S", "scheduler", "name", "how to spread data on connections (rr, rtt, edt)");
 	struct arg_end *arg_proxy_end   = arg_end(5);
 	void *argtable_proxy[] = { RO_COMMON_ARGTABLE(proxy),
 				   arg_proxy,
-				   arg_proxy_conns,
+				   arg_proxy_conns, arg_proxy_adaptive, arg_proxy_pool,
+				   arg_proxy_parallel, arg_proxy_sched,
 				   arg_proxy_local, arg_proxy_remote,
 				   arg_proxy_end };
 
 	/* Relay arguments */
 	RO_COMMON_ARGS(relay);
 	struct arg_lit *arg_relay     = arg_lit1("r", "relay", "act as a relay");
+	struct arg_str *arg_relay_sched = arg_str0("S", "scheduler", "name", "how to spread data on connections (rr, rtt, edt)");
 	struct arg_end *arg_relay_end = arg_end(5);
 	void *argtable_relay[] = { RO_COMMON_ARGTABLE(relay),
-				   arg_relay,
+				   arg_relay, arg_relay_sched,
 				   arg_relay_local, arg_relay_remote,
 				   arg_relay_end };
 
@@ -66,7 +92,18 @@ main(int argc, char *argv[])
 	}
 
 	arg_proxy_conns->ival[0] = RO_CONNECTION_NUMBER;
+	arg_proxy_pool->ival[0] = RO_POOL;
+	arg_proxy_sched->sval[0] = arg_relay_sched->sval[0] = RO_SCHEDULER;
+	arg_proxy_engine->sval[0] = arg_relay_engine->sval[0] = RO_ENGINE;
 	arg_proxy_listen->ival[0] = arg_relay_listen->ival[0] = RO_LISTEN_QUEUE;
+	arg_proxy_workers->ival[0] = arg_relay_workers->ival[0] = RO_WORKER_NUMBER;
+	arg_proxy_reorder->ival[0] = arg_relay_reorder->ival[0] = RO_REORDER_BUFFER;
+	arg_proxy_min_frame->ival[0] = arg_relay_min_frame->ival[0] = RO_MIN_FRAME;
+	arg_proxy_max_frame->ival[0] = arg_relay_max_frame->ival[0] = RO_MAX_FRAME;
+	arg_proxy_frame_delay->ival[0] = arg_relay_frame_delay->ival[0] = RO_FRAME_DELAY;
+	arg_proxy_protocol->ival[0] = arg_relay_protocol->ival[0] = RO_PROTOCOL;
+	arg_proxy_max_pipe->ival[0] = arg_relay_max_pipe->ival[0] = RO_PIPE_MAX;
+	arg_proxy_replay->ival[0] = arg_relay_replay->ival[0] = RO_REPLAY_BUFFER;
 
 	int nerrors_proxy, nerrors_relay;
 	nerrors_proxy = arg_parse(argc, argv, argtable_proxy);
@@ -104,14 +141,100 @@ main(int argc, char *argv[])
 
 	log_init(debug, __progname);
 
-	struct ro_cfg cfg = {
-		.role = (!nerrors_proxy)?ROLE_PROXY:ROLE_RELAY,
-		.local = (!nerrors_proxy)?arg_proxy_local->info:arg_relay_local->info,
-		.remote = (!nerrors_proxy)?arg_proxy_remote->info:arg_relay_remote->info,
-		.backlog = (!nerrors_proxy)?arg_proxy_listen->ival[0]:arg_relay_listen->ival[0],
-		.conns = (!nerrors_proxy)?arg_proxy_conns->ival[0]:0
-	};
-	TAILQ_INIT(&cfg.locals);
+	cfg.role = (!nerrors_proxy)?ROLE_PROXY:ROLE_RELAY;
+	cfg.local = (!nerrors_proxy)?arg_proxy_local->info:arg_relay_local->info;
+	cfg.remote = (!nerrors_proxy)?arg_proxy_remote->info:arg_relay_remote->info;
+	cfg.backlog = (!nerrors_proxy)?arg_proxy_listen->ival[0]:arg_relay_listen->ival[0];
+	cfg.conns = (!nerrors_proxy)?arg_proxy_conns->ival[0]:0;
+	cfg.adaptive = (!nerrors_proxy)?(arg_proxy_adaptive->count > 0):false;
+	cfg.workers = (!nerrors_proxy)?arg_proxy_workers->ival[0]:arg_relay_workers->ival[0];
+	int reorder = (!nerrors_proxy)?arg_proxy_reorder->ival[0]:arg_relay_reorder->ival[0];
+	if (reorder < 0) {
+		log_crit("main", "size of reorder buffer should be positive");
+		goto exit;
+	}
+	cfg.reorder = reorder;
+	int min_frame = (!nerrors_proxy)?arg_proxy_min_frame->ival[0]:arg_relay_min_frame->ival[0];
+	int max_frame = (!nerrors_proxy)?arg_proxy_max_frame->ival[0]:arg_relay_max_frame->ival[0];
+	int frame_delay = (!nerrors_proxy)?arg_proxy_frame_delay->ival[0]:arg_relay_frame_delay->ival[0];
+	if (min_frame < 0 || max_frame < 0 || frame_delay < 0 ||
+	    (max_frame > 0 && max_frame < min_frame)) {
+		log_crit("main", "invalid frame sizes or delay");
+		goto exit;
+	}
+	cfg.min_frame = min_frame;
+	cfg.max_frame = max_frame;
+	cfg.frame_delay = frame_delay;
+	cfg.io_uring = (!nerrors_proxy)?
+	    (arg_proxy_io_uring->count > 0):(arg_relay_io_uring->count > 0);
+	const char *scheduler = (!nerrors_proxy)?arg_proxy_sched->sval[0]:arg_relay_sched->sval[0];
+	if ((cfg.scheduler = scheduler_get(scheduler)) == NULL) {
+		log_crit("main", "unknown scheduler %s", scheduler);
+		goto exit;
+	}
+	const char *engine = (!nerrors_proxy)?arg_proxy_engine->sval[0]:arg_relay_engine->sval[0];
+	if ((cfg.engine = engine_get(engine)) == NULL) {
+		log_crit("main", "unknown engine %s", engine);
+		goto exit;
+	}
+	cfg.zerocopy = (!nerrors_proxy)?
+	    (arg_proxy_zerocopy->count > 0):(arg_relay_zerocopy->count > 0);
+	if (cfg.zerocopy && cfg.engine->zerocopy == NULL)
+		log_warnx("main", "zerocopy is only used with the copy engine");
+	cfg.fastopen = (!nerrors_proxy)?
+	    (arg_proxy_fastopen->count > 0):(arg_relay_fastopen->count > 0);
+	if (cfg.fastopen) connection_fastopen(&cfg);
+	struct arg_str *control = (!nerrors_proxy)?arg_proxy_control:arg_relay_control;
+	cfg.control = (control->count > 0)?control->sval[0]:NULL;
+	cfg.latency = (!nerrors_proxy)?
+	    (arg_proxy_latency->count > 0):(arg_relay_latency->count > 0);
+	int protocol = (!nerrors_proxy)?arg_proxy_protocol->ival[0]:arg_relay_protocol->ival[0];
+	if (protocol < 1 || protocol > RO_PROTOCOL) {
+		log_crit("main", "version of the protocol should be between 1 and %d",
+		    RO_PROTOCOL);
+		goto exit;
+	}
+	cfg.protocol = protocol;
+	int max_pipe = (!nerrors_proxy)?arg_proxy_max_pipe->ival[0]:arg_relay_max_pipe->ival[0];
+	if (max_pipe != 0 && max_pipe < RO_PIPE_MIN) {
+		log_crit("main", "maximum size of pipes should be 0 or at least %d",
+		    RO_PIPE_MIN);
+		goto exit;
+	}
+	if (max_pipe > 0 && cfg.engine->resize)
+		cfg.max_pipe = sizing_limit(max_pipe);
+	int replay = (!nerrors_proxy)?arg_proxy_replay->ival[0]:arg_relay_replay->ival[0];
+	if (replay < 0) {
+		log_crit("main", "size of replay buffer should be positive");
+		goto exit;
+	}
+	if (replay > 0 && cfg.protocol < 2)
+		log_warnx("main", "replay buffer needs version 2 of the protocol");
+	else if (replay > 0 && cfg.io_uring) {
+		log_warnx("main", "io_uring is not used with a replay buffer");
+		cfg.io_uring = false;
+	}
+	if (cfg.protocol >= 2)
+		cfg.replay = replay;
+	int pool = (!nerrors_proxy)?arg_proxy_pool->ival[0]:0;
+	if (pool < 0) {
+		log_crit("main", "size of pool should be positive");
+		goto exit;
+	}
+	if (pool > 0 && cfg.protocol < 2)
+		log_warnx("main", "pool of connections needs version 2 of the protocol");
+	else
+		cfg.pool = pool;
+	bool parallel = (!nerrors_proxy)?(arg_proxy_parallel->count > 0):false;
+	if (parallel && cfg.protocol < 2)
+		log_warnx("main", "parallel establishment needs version 2 of the protocol");
+	else
+		cfg.parallel = parallel;
+	if (cfg.workers < 1 || cfg.workers > RO_MAX_WORKERS) {
+		log_crit("main", "number of workers should be between 1 and %d",
+		    RO_MAX_WORKERS);
+		goto exit;
+	}
 	if (event_configure(&cfg) == -1) {
 		log_crit("main", "unable to configure libevent");
 		goto exit;
@@ -124,6 +247,8 @@ main(int argc, char *argv[])
 			goto exit;
 		}
 	}
+	if (log_async() == -1)
+		log_warnx("main", "unable to start log writer, log directly");
 
 	if (event_loop(&cfg) == -1) {
 		log_crit("main", "unable to run libevent loop");
@@ -133,6 +258,7 @@ main(int argc, char *argv[])
 	exitcode = EXIT_SUCCESS;
 exit:
 	event_shutdown(&cfg);
+	log_flush();
 	if (arg_proxy_remote && arg_proxy_remote->info) freeaddrinfo(arg_proxy_remote->info);
 	if (arg_proxy_local && arg_proxy_local->info) freeaddrinfo(arg_proxy_local->info);
 	if (arg_relay_remote && arg_relay_remote->info) freeaddrinfo(arg_relay_remote->info);
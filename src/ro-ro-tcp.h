@@ -37,9 +37,62 @@
 #define SERVSTRLEN 6
 
 #define RO_LISTEN_QUEUE 20
+#define RO_FASTOPEN_QUEUE 256	/* pending TCP Fast Open requests */
 #define RO_CONNECTION_NUMBER 4
+#define RO_WORKER_NUMBER 1
+#define RO_REORDER_BUFFER (4 << 20)
+#define RO_SCHEDULER "rr"
+#define RO_SAMPLE_INTERVAL 100	/* ms */
+#define RO_MIN_FRAME (16 << 10)
+#define RO_MAX_FRAME (256 << 10)
+#define RO_FRAME_DELAY 0	/* ms */
+#define RO_ENGINE "splice"
+#define RO_COPY_BUFFER (256 << 10)
+#define RO_PIPE_MIN (64 << 10)	/* default size of a pipe */
+#define RO_PIPE_MAX (16 << 20)
+#define RO_SIZING_INTERVAL 250	/* ms */
+#define RO_ADAPT_INTERVAL 500	/* ms */
+#define RO_ADAPT_BUSY 2		/* busy intervals before opening a connection */
+#define RO_ADAPT_IDLE 20	/* idle intervals before closing a connection */
+#define RO_REPLAY_BUFFER 0	/* no replay by default */
+#define RO_REPLAY_ATTEMPTS 3	/* replacements without progress */
+#define RO_REPLAY_TIMEOUT 30	/* s, relay waits for a replacement */
+#define RO_ACK_BYTES (64 << 10)	/* acknowledge after this many bytes */
+#define RO_ACK_DELAY 20		/* ms, or after this delay */
+#define RO_ZEROCOPY_MIN (16 << 10)	/* smaller sends are copied */
+#define RO_ZEROCOPY_LINGER 100	/* ms between checks of closed sockets */
+#define RO_URING_BATCH 32	/* frames */
+#define RO_URING_ENTRIES (2 * RO_URING_BATCH)
+#define RO_POOL 0		/* no pool of connections by default */
+#define RO_POOL_RETRY 1		/* s, before filling the pool after an error */
+#define RO_POOL_IDLE 60		/* s, relay closes idle pooled connections */
+#define RO_PROTOCOL 2		/* latest version of the protocol */
+#define RO_MAGIC 0x526f5254	/* "RoRT", starts a version 2 handshake */
+#define RO_MAGIC_KEY 0x526f524b	/* "RoRK", same with a group key */
+
+/* The owning worker is encoded in the lowest bits of a group ID */
+#define RO_WORKER_BITS 8
+#define RO_MAX_WORKERS (1 << RO_WORKER_BITS)
+#define RO_GROUP_WORKER(id) ((id) & (RO_MAX_WORKERS - 1))
+#define RO_POOL_GROUP 0xffffffff /* Hello of a pooled connection, never allocated */
+
+/* A group key is a random 128-bit group ID chosen by the proxy. The owning
+ * worker is derived from it. */
+#define RO_KEY_WORDS 2
+#define RO_KEY_WORKER(key, workers) ((key)[0] % (workers))
+#define RO_GROUP_BITS 6		/* initial number of buckets (log2) to find groups */
+#define RO_GROUP_RETIRED 256	/* group keys remembered after the end of their session */
+#define RO_SLAB_CACHED 256	/* free objects of each type kept by a worker */
+#define RO_PIPE_CACHED 32	/* empty pipes kept by a worker */
+#define RO_HISTOGRAM_BUCKETS 26	/* values up to 2^25 */
+#define RO_CONTROL_TIMEOUT 10	/* s, to receive a request on the control socket */
+#define RO_CONTROL_REQUEST 8192	/* maximum size of a request */
+#define RO_CONTROL_BATCH 256	/* sessions examined by a worker at once */
+#define RO_CONTROL_WATERMARK (64 << 10) /* bytes waiting before pausing a dump */
+#define RO_CONTROL_RETRY 100	/* ms before giving a dump to a worker again */
 
 struct ro_cfg;
+struct ro_worker;
 struct ro_local;
 struct ro_remote;
 
@@ -55,20 +108,24 @@ struct arg_addr *arg_addr1(const char *, const char *,
 
 /* event.c */
 struct event_private;
-struct event_remote_private;
+struct worker_private;
 int  event_configure(struct ro_cfg *);
 int  event_loop(struct ro_cfg *);
 void event_shutdown(struct ro_cfg *);
+int  event_handoff(struct ro_worker *, int, uint32_t, const uint64_t *,
+    uint8_t, bool, char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN]);
+struct control_dump;
+int  event_dump(struct ro_worker *, struct control_dump *, bool);
 
 /* endpoint.c */
-struct ro_local *local_init(struct ro_cfg *, int,
+struct ro_local *local_init(struct ro_worker *, int,
     char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN]);
 struct ro_remote *remote_init(struct ro_cfg *, struct ro_local *, int,
     char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN],
     char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN]);
 void remote_destroy(struct ro_remote *);
 void local_destroy(struct ro_local *);
-int  endpoint_connect(struct addrinfo *,
+int  endpoint_connect(struct addrinfo *, bool,
     char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN],
     char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN]);
 void remote_debug(struct ro_remote *);
@@ -77,12 +134,217 @@ void local_debug(struct ro_local *);
 /* connection.c */
 struct local_private;
 struct remote_private;
-int connection_listen(struct ro_cfg *);
-void connection_established(struct ro_local *, struct ro_remote *);
+int connection_listen(struct ro_worker *);
+void connection_attach(struct ro_worker *, int, uint32_t, const uint64_t *,
+    uint8_t, bool, char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN]);
+int  connection_open(struct ro_cfg *, struct ro_local *);
+int  connection_established(struct ro_local *, struct ro_remote *);
+void connection_adapt_cb(evutil_socket_t, short, void *);
+int  connection_send_group(struct ro_remote *);
+int  connection_receive_group(struct ro_remote *);
+void connection_debug(struct ro_worker *);
+void connection_fastopen(struct ro_cfg *);
+
+/* group.c */
+int  group_insert(struct ro_worker *, struct ro_local *);
+void group_remove(struct ro_local *);
+struct ro_local *group_find(struct ro_worker *, uint32_t);
+struct ro_local *group_find_key(struct ro_worker *, const uint64_t[static RO_KEY_WORDS]);
+bool group_retired(struct ro_worker *, const uint64_t[static RO_KEY_WORDS]);
+uint32_t group_new(struct ro_worker *);
+void group_free(struct ro_worker *);
+
+/* pool.c */
+struct pool_connection;
+int  pool_start(struct ro_worker *);
+int  pool_claim(struct ro_worker *,
+    char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN],
+    char[static INET6_ADDRSTRLEN], char[static SERVSTRLEN]);
+void pool_free(struct ro_worker *);
+
+/* slab.c */
+enum ro_slab_type {
+	SLAB_LOCAL=0,		/* struct ro_local */
+	SLAB_LOCAL_PRIVATE,	/* struct local_private */
+	SLAB_REMOTE,		/* struct ro_remote */
+	SLAB_REMOTE_PRIVATE,	/* struct remote_private */
+	SLAB_EVENT,		/* struct event */
+	SLAB_PIPE,		/* pipes of the splice engine */
+	SLAB_MAX
+};
+struct ro_slab {
+	void *free;		/* free objects, linked through their first bytes */
+	size_t cached;		/* free objects kept */
+	size_t used;		/* objects in use */
+	size_t high;		/* high-water mark of objects in use */
+	uint64_t hits;		/* requests served with a free object */
+	uint64_t misses;	/* requests served by the system */
+};
+struct ro_buffer;
+void *slab_get(struct ro_worker *, enum ro_slab_type);
+void  slab_put(struct ro_worker *, enum ro_slab_type, void *);
+struct event *slab_event_new(struct ro_worker *, evutil_socket_t, short,
+    event_callback_fn, void *);
+void  slab_event_free(struct ro_worker *, struct event *);
+int   slab_buffer_init(struct ro_worker *, struct ro_buffer *, size_t);
+void  slab_buffer_free(struct ro_worker *, struct ro_buffer *);
+void  slab_debug(struct ro_worker *);
+void  slab_free(struct ro_worker *);
+
+/* latency.c */
+enum ro_stage {
+	STAGE_READ=0,		/* read from local endpoint, up to cut in a frame */
+	STAGE_SEND,		/* frame cut, up to written to its remote */
+	STAGE_RECEIVE,		/* header received, up to frame in write pipe */
+	STAGE_WRITE,		/* in write pipe, up to written to local endpoint */
+	STAGE_MAX
+};
+#define RO_LATENCY_SUB 3	/* 2^3 buckets for each power of two */
+#define RO_LATENCY_MAX 24	/* larger values (µs) are counted as 2^24 - 1 */
+#define RO_LATENCY_BUCKETS ((RO_LATENCY_MAX - RO_LATENCY_SUB + 1) << RO_LATENCY_SUB)
+#define RO_LATENCY_MARKS 16	/* timestamps kept for bytes not moved yet */
+struct ro_latency_marks {
+	struct {
+		uint64_t end;	/* offset following the bytes */
+		uint64_t at;	/* when they came in (µs) */
+	} marks[RO_LATENCY_MARKS];
+	unsigned first, count;
+	uint64_t in;		/* bytes in */
+	uint64_t out;		/* bytes out */
+};
+struct ro_latency {
+	uint32_t buckets[STAGE_MAX][RO_LATENCY_BUCKETS];
+	uint64_t max[STAGE_MAX];
+	struct ro_latency_marks read;  /* read pipe */
+	struct ro_latency_marks write; /* write pipe */
+};
+uint64_t latency_now(void);
+void latency_observe(struct ro_local *, enum ro_stage, uint64_t);
+void latency_in(struct ro_latency_marks *, size_t);
+void latency_out(struct ro_local *, enum ro_stage, struct ro_latency_marks *,
+    size_t);
+struct evbuffer;
+void latency_metrics(struct ro_cfg *, struct evbuffer *);
+void latency_json(struct evbuffer *, struct ro_local *);
+void latency_debug(struct ro_local *);
+
+/* metrics.c */
+struct ro_histogram {
+	uint64_t buckets[RO_HISTOGRAM_BUCKETS]; /* bucket i: values up to 2^i */
+	uint64_t count;		/* all values, including larger ones */
+	uint64_t sum;
+};
+struct ro_metrics {
+	uint64_t bytes[2];	/* read from (0) and written to (1) local endpoints */
+	uint64_t frames[2];	/* data frames sent (0) and received (1) */
+	uint64_t eagain[2];	/* reads (0) and writes (1) which would block */
+	uint64_t reorder_stalls; /* remotes stopped by a full reorder buffer */
+	struct ro_histogram frame_size;	  /* data frames sent (bytes) */
+	struct ro_histogram handshake[2]; /* without and with TCP Fast Open (µs) */
+	uint64_t latency[STAGE_MAX][RO_LATENCY_BUCKETS]; /* see `latency.c` */
+	uint64_t latency_sum[STAGE_MAX];
+};
+/* Metrics are only updated by their worker and read by the first one */
+#define METRIC_ADD(metric, n) \
+	__atomic_store_n(&(metric), (metric) + (n), __ATOMIC_RELAXED)
+#define METRIC_GET(metric) __atomic_load_n(&(metric), __ATOMIC_RELAXED)
+void metrics_observe(struct ro_histogram *, uint64_t);
+void metrics_write(struct ro_cfg *, struct evbuffer *);
+
+/* control.c */
+struct control_dump;
+int  control_listen(struct ro_cfg *);
+void control_dump_run(struct ro_worker *, struct control_dump *);
+void control_dump_ready(struct ro_cfg *, struct control_dump *);
+void control_forget(struct ro_worker *, struct ro_local *);
+void control_free(struct ro_cfg *);
+
+/* engine.c */
+struct ro_buffer;
+struct ro_engine {
+	const char *name;
+	bool pipes;		/* Buffers are pipes */
+	bool staged;		/* Data from remotes is read in bulk */
+	int (*init)(struct ro_buffer *, size_t);
+	void (*free)(struct ro_buffer *);
+	size_t (*capacity)(struct ro_buffer *);
+	/* Read-in: from a socket to a buffer */
+	ssize_t (*read_in)(int, struct ro_buffer *, size_t);
+	/* Write-out: from a buffer to a socket */
+	ssize_t (*write_out)(struct ro_buffer *, int, size_t);
+	/* Frames are moved between buffers and their headers are put or
+	 * got from them. */
+	ssize_t (*move)(struct ro_buffer *, struct ro_buffer *, size_t);
+	ssize_t (*put)(struct ro_buffer *, const void *, size_t);
+	ssize_t (*get)(struct ro_buffer *, void *, size_t);
+	/* Copy data between buffers without consuming it, or drop it */
+	ssize_t (*tee)(struct ro_buffer *, struct ro_buffer *, size_t);
+	ssize_t (*discard)(struct ro_buffer *, size_t);
+	/* Send from a buffer to a socket with MSG_ZEROCOPY (optional). The
+	 * memory is reused once the kernel has reported its completion. */
+	int (*zerocopy)(struct ro_buffer *, int);
+	void (*reclaim)(struct ro_buffer *);
+	/* Change the size of a buffer (optional), return the new size */
+	ssize_t (*resize)(struct ro_buffer *, size_t);
+};
+const struct ro_engine *engine_get(const char *);
+bool zerocopy_linger(struct ro_worker *, struct ro_buffer *);
+void zerocopy_linger_free(struct ro_worker *);
+
+/* protocol.c */
+#define RO_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t)) /* version 1 */
+#define RO_HEADER_MIN 3		/* version 2: control byte, value and length */
+#define RO_HEADER_MAX 13
+enum ro_frame_type {
+	FRAME_DATA=0,		/* Payload at the given offset */
+	FRAME_PING,		/* Echoed back (length is 0), echo (1), or
+				 * losses of the proxy on a new connection (2) */
+	FRAME_WINDOW,		/* Bytes delivered so far */
+	FRAME_CLOSE		/* No data after the given offset (length is 0),
+				 * or no frame after this one on this
+				 * connection (1) */
+};
+struct ro_frame {
+	enum ro_frame_type type;
+	uint64_t seq;		/* Serial (version 1), offset or value */
+	uint32_t length;
+};
+size_t frame_encode(uint8_t, const struct ro_frame *, char[static RO_HEADER_MAX]);
+size_t frame_header_size(uint8_t, const char *, size_t);
+int frame_decode(uint8_t, const char *, struct ro_frame *);
+uint64_t frame_next(uint8_t, uint64_t, uint32_t);
+uint64_t frame_first(uint8_t);
+
+/* uring.c */
+struct ro_uring;
+struct ro_uring *uring_init(unsigned);
+void uring_free(struct ro_uring *);
+int uring_splice(struct ro_uring *, int, int, size_t, unsigned, bool, uint64_t);
+int uring_write(struct ro_uring *, int, const void *, size_t, bool, uint64_t);
+int uring_submit(struct ro_uring *, void (*)(uint64_t, int, void *), void *);
+
+/* scheduler.c */
+struct ro_scheduler {
+	const char *name;
+	bool sampling;		/* Needs samples of TCP state */
+	struct ro_remote *(*select)(struct ro_local *, size_t);
+};
+const struct ro_scheduler *scheduler_get(const char *);
+void scheduler_sample_remote(struct ro_remote *);
+void scheduler_sample_cb(evutil_socket_t, short, void *);
+
+/* sizing.c */
+size_t sizing_limit(size_t);
+void sizing_cb(evutil_socket_t, short, void *);
 
 /* forward.c */
 void remote_data_cb(evutil_socket_t, short, void *);
 void local_data_cb(evutil_socket_t, short, void *);
+void local_hold_cb(evutil_socket_t, short, void *);
+int  remote_retire(struct ro_remote *);
+void remote_send_release(struct ro_remote *);
+struct ro_replay;
+void replay_free(struct ro_worker *, struct ro_replay *);
 
 /* General */
 enum ro_role {
@@ -111,6 +373,16 @@ struct ro_remote {
 		size_t out;	/* output bytes */
 	} stats;
 
+	/* Last sample of TCP state, for schedulers */
+	struct {
+		bool valid;
+		uint32_t rtt;		/* smoothed RTT (µs) */
+		uint32_t cwnd;		/* congestion window (segments) */
+		uint32_t unacked;	/* segments in flight */
+		uint32_t mss;		/* sender MSS */
+		uint32_t notsent;	/* bytes not sent yet */
+	} path;
+
 	struct remote_private *event;
 };
 
@@ -119,8 +391,10 @@ struct ro_remote {
  */
 struct ro_local {
 	TAILQ_ENTRY(ro_local) next;
+	LIST_ENTRY(ro_local) hash; /* In the index of groups (relay only) */
 
 	struct ro_cfg *cfg;
+	struct ro_worker *worker; /* Worker owning this endpoint */
 	bool connected;
 
 	/* To display messages about this local endpoint */
@@ -128,30 +402,95 @@ struct ro_local {
 	char serv[SERVSTRLEN];
 
 	uint32_t group_id;	/* Group ID */
+	bool keyed;		/* The group is identified by a key instead */
+	uint64_t group_key[RO_KEY_WORDS]; /* Group key */
 
 	struct {
 		size_t in;	/* input bytes */
 		size_t out;	/* output bytes */
+		size_t reordered;	/* frames which waited in reorder buffer */
+		size_t reorder_full;	/* times reorder buffer was full */
+		size_t busy;		/* times all remotes were busy */
+		size_t lost;		/* remotes lost and replayed */
+		uint64_t reorder_wait;	/* total waiting time in reorder buffer (µs) */
+		uint64_t reorder_max;	/* maximum waiting time in reorder buffer (µs) */
 	} stats;
 
+	/* Time spent by data in each stage (optional) */
+	struct ro_latency *latency;
+
 	/* Where data should be forwarded to */
 	TAILQ_HEAD(, ro_remote) remotes;
 
 	struct local_private *event;
 };
 
+/**
+ * Describe one worker. Each worker runs its own event loop in its own thread
+ * and owns its listening socket and its local endpoints. Nothing is shared
+ * between workers on the data path.
+ */
+struct ro_worker {
+	struct ro_cfg *cfg;
+	unsigned index;		/* Worker number */
+
+	uint32_t last_group_id;	/* Last group we provided */
+
+	/* Connections to relay established without and with TCP Fast Open
+	 * (proxy only), up to the reply to the hello */
+	struct {
+		size_t connects[2];	  /* number of connections */
+		uint64_t connect_total[2]; /* total time to establish them (µs) */
+		uint64_t connect_max[2];   /* maximum time (µs) */
+	} stats;
+
+	/* List of local endpoints */
+	TAILQ_HEAD(, ro_local) locals;
+
+	/* Local endpoints by group ID or group key, see `group.c` */
+	struct {
+		LIST_HEAD(group_bucket, ro_local) *buckets;
+		unsigned bits;	/* 2^bits buckets */
+		size_t count;	/* indexed local endpoints */
+		uint64_t retired[RO_GROUP_RETIRED][RO_KEY_WORDS];
+		unsigned next_retired;
+	} groups;
+
+	/* Objects kept for reuse, see `slab.c` */
+	struct ro_slab slabs[SLAB_MAX];
+
+	/* Exported on the control socket, see `metrics.c` */
+	struct ro_metrics metrics;
+
+	struct worker_private *event; /* private data for libevent */
+};
+
 struct ro_cfg {
 	enum ro_role role;	 /* role */
 	struct addrinfo *local;	 /* bind to */
 	struct addrinfo *remote; /* connect to */
 	int backlog;		 /* listen queue for local socket */
 	int conns;		 /* number of connections to open to remote */
+	bool adaptive;		 /* open connections only when needed */
+	int pool;		 /* established connections kept ready by each worker */
+	bool parallel;		 /* choose group keys and open all connections at once */
+	bool fastopen;		 /* use TCP Fast Open with relay and on listeners */
+	int workers;		 /* number of worker threads */
+	size_t reorder;		 /* size of reorder buffer for each local endpoint */
+	const struct ro_scheduler *scheduler; /* how to select a remote */
+	const struct ro_engine *engine;	      /* how to move data */
+	size_t min_frame;	 /* don't cut frames smaller than this */
+	size_t max_frame;	 /* don't send frames larger than this */
+	int frame_delay;	 /* how long to hold frames smaller than min_frame (ms) */
+	bool io_uring;		 /* batch operations with io_uring */
+	bool zerocopy;		 /* send to remotes with MSG_ZEROCOPY */
+	uint8_t protocol;	 /* highest version of the protocol to use */
+	size_t max_pipe;	 /* pipes of a local endpoint grow up to this size */
+	size_t replay;		 /* unacknowledged bytes kept for each local endpoint */
+	const char *control;	 /* UNIX socket or address for the control socket */
+	bool latency;		 /* measure time spent by data in each stage */
 
-	uint32_t last_group_id;	/* Last group we provided */
-
-	/* List of local endpoints */
-	TAILQ_HEAD(, ro_local) locals;
-
+	struct ro_worker *worker;    /* array of workers */
 	struct event_private *event; /* private data for libevent */
 };
 
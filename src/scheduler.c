@@ -0,0 +1,176 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+
+/* Schedulers select the remote which should send the next frame among the
+ * remotes without a pending frame. */
+
+/**
+ * Round-robin: select the next available remote.
+ */
+static struct ro_remote *
+scheduler_rr(struct ro_local *local, size_t bytes)
+{
+	struct ro_remote *start = local->event->last_send_remote;
+	struct ro_remote *remote = start;
+	do {
+		if (remote == NULL || (remote = TAILQ_NEXT(remote, next)) == NULL)
+			remote = TAILQ_FIRST(&local->remotes);
+		if (remote == NULL) return NULL;
+		if (remote_available(remote))
+			return remote;
+	} while (remote != start && start != NULL);
+	return NULL;
+}
+
+/**
+ * Select the available remote minimizing the provided cost. Remotes are
+ * examined in round-robin order to break ties. When no remote has been
+ * sampled yet, this is the same as round-robin.
+ */
+static struct ro_remote *
+scheduler_min(struct ro_local *local, size_t bytes,
+    uint64_t (*cost)(struct ro_remote *, size_t))
+{
+	struct ro_remote *start = local->event->last_send_remote;
+	struct ro_remote *remote = start, *best = NULL;
+	uint64_t best_cost = 0;
+	do {
+		if (remote == NULL || (remote = TAILQ_NEXT(remote, next)) == NULL)
+			remote = TAILQ_FIRST(&local->remotes);
+		if (remote == NULL) return NULL;
+		if (!remote_available(remote)) continue;
+		if (!remote->path.valid) {
+			/* Not sampled yet, use it to get samples */
+			return remote;
+		}
+		uint64_t c = cost(remote, bytes);
+		if (best == NULL || c < best_cost) {
+			best = remote;
+			best_cost = c;
+		}
+	} while (remote != start && start != NULL);
+	return best;
+}
+
+static uint64_t
+cost_rtt(struct ro_remote *remote, size_t bytes)
+{
+	return remote->path.rtt;
+}
+
+/**
+ * Estimate when the last byte of a frame would be delivered by a remote, in
+ * µs. The bytes not sent yet and the new frame are sent as soon as the
+ * congestion window allows it. Each additional window costs one RTT.
+ */
+static uint64_t
+cost_edt(struct ro_remote *remote, size_t bytes)
+{
+	uint64_t mss = remote->path.mss ? remote->path.mss : 1448;
+	uint64_t window = (remote->path.cwnd ? remote->path.cwnd : 1) * mss;
+	uint64_t inflight = remote->path.unacked * mss;
+	uint64_t room = (window > inflight) ? window - inflight : 0;
+	uint64_t queued = remote->path.notsent + bytes;
+	uint64_t rounds = 0;
+	if (queued > room)
+		rounds = (queued - room + window - 1) / window;
+	return remote->path.rtt / 2 + rounds * remote->path.rtt;
+}
+
+static struct ro_remote *
+scheduler_rtt(struct ro_local *local, size_t bytes)
+{
+	return scheduler_min(local, bytes, cost_rtt);
+}
+
+static struct ro_remote *
+scheduler_edt(struct ro_local *local, size_t bytes)
+{
+	return scheduler_min(local, bytes, cost_edt);
+}
+
+static const struct ro_scheduler schedulers[] = {
+	{ "rr",  false, scheduler_rr },
+	{ "rtt", true,  scheduler_rtt },
+	{ "edt", true,  scheduler_edt },
+	{ NULL }
+};
+
+/**
+ * Get a scheduler from its name.
+ *
+ * @return the scheduler or NULL if there is no scheduler with this name
+ */
+const struct ro_scheduler *
+scheduler_get(const char *name)
+{
+	for (const struct ro_scheduler *s = schedulers; s->name; s++)
+		if (!strcmp(s->name, name)) return s;
+	return NULL;
+}
+
+/**
+ * Sample the state of the TCP connection of a remote.
+ */
+void
+scheduler_sample_remote(struct ro_remote *remote)
+{
+	int fd = event_get_fd(remote->event->write);
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int notsent = 0;
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		log_debug("scheduler", "unable to get TCP info for [%s]:%s <-> [%s]:%s: %s",
+		    remote->laddr, remote->lserv,
+		    remote->raddr, remote->rserv,
+		    strerror(errno));
+		return;
+	}
+#ifdef SIOCOUTQNSD
+	if (ioctl(fd, SIOCOUTQNSD, &notsent) == -1) notsent = 0;
+#endif
+	remote->path.rtt = info.tcpi_rtt;
+	remote->path.cwnd = info.tcpi_snd_cwnd;
+	remote->path.unacked = info.tcpi_unacked;
+	remote->path.mss = info.tcpi_snd_mss;
+	remote->path.notsent = notsent;
+	remote->path.valid = true;
+}
+
+/**
+ * Periodically sample the remotes of a local endpoint.
+ */
+void
+scheduler_sample_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_local *local = arg;
+	struct ro_remote *remote;
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (remote->connected)
+			scheduler_sample_remote(remote);
+	}
+}
@@ -0,0 +1,124 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* The pipes of a local endpoint sit between the local connection and the
+ * remotes. With the default size (64 KiB), they limit the throughput to
+ * 64 KiB per round-trip. They are periodically resized to twice the bytes
+ * moved during the slowest round-trip of the remotes: when the pipe is the
+ * bottleneck, it doubles at each period until it is not anymore. Pipes
+ * shrink back when the throughput drops well below their size or when the
+ * local endpoint is idle. Empty reorder pipes and send pipes of idle remotes
+ * are released at each period. */
+
+/**
+ * Get the maximum size of pipes, taking the limit of the system into
+ * account.
+ */
+size_t
+sizing_limit(size_t max)
+{
+	FILE *f;
+	unsigned long limit;
+	if ((f = fopen("/proc/sys/fs/pipe-max-size", "r")) == NULL)
+		return max;
+	if (fscanf(f, "%lu", &limit) == 1 && limit < max) {
+		log_info("sizing", "pipes are limited to %lu bytes by the system",
+		    limit);
+		max = limit;
+	}
+	fclose(f);
+	return max;
+}
+
+/**
+ * Adapt the size of one pipe.
+ *
+ * @param bytes Bytes moved through the pipe since the last period.
+ * @param used  Bytes currently in the pipe.
+ * @param rtt   Largest RTT of the remotes (µs).
+ */
+static void
+sizing_pipe(struct ro_local *local, const char *name, struct ro_buffer *pipe,
+    size_t bytes, size_t used, uint32_t rtt)
+{
+	const struct ro_engine *engine = local->cfg->engine;
+	size_t max = local->cfg->max_pipe;
+	uint64_t bdp = (uint64_t)bytes * rtt / (RO_SIZING_INTERVAL * 1000);
+	size_t target = RO_PIPE_MIN;
+	while (target < 2 * bdp && target < max) target <<= 1;
+	if (target > max) target = max;
+
+	size_t current = engine->capacity(pipe);
+	if (target == current) return;
+	if (target < current) {
+		/* Only shrink when idle or well oversized. The kernel
+		 * refuses to drop buffered data. */
+		if (bytes > 0 && target > current / 4) return;
+		if (used > target) return;
+	}
+	if (engine->resize(pipe, target) == -1) {
+		log_debug("sizing", "[%s]:%s: unable to resize %s pipe to %zu bytes: %s",
+		    local->addr, local->serv, name, target, strerror(errno));
+		return;
+	}
+	log_debug("sizing", "[%s]:%s: %s pipe resized from %zu to %zu bytes (%" PRIu64 " bytes per RTT)",
+	    local->addr, local->serv, name, current, engine->capacity(pipe), bdp);
+}
+
+/**
+ * Periodically adapt the size of the pipes of a local endpoint.
+ */
+void
+sizing_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct ro_local *local = arg;
+	struct ro_remote *remote;
+	uint32_t rtt = 0;
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (!remote->connected) continue;
+		if (!local->cfg->scheduler->sampling)
+			scheduler_sample_remote(remote);
+		if (remote->path.valid && remote->path.rtt > rtt)
+			rtt = remote->path.rtt;
+	}
+
+	struct local_private *event = local->event;
+	sizing_pipe(local, "read", &event->pipe.read,
+	    local->stats.out - event->pipe.last_out, event->pipe.nr, rtt);
+	sizing_pipe(local, "write", &event->pipe.write,
+	    local->stats.in - event->pipe.last_in, event->pipe.nw, rtt);
+	event->pipe.last_out = local->stats.out;
+	event->pipe.last_in = local->stats.in;
+
+	/* Reorder pipes are only needed while frames are received out of
+	 * order, give the empty ones back to the worker, like the send
+	 * pipes of idle remotes */
+	TAILQ_FOREACH(remote, &local->remotes, next) {
+		if (remote->event->park.ready &&
+		    TAILQ_EMPTY(&remote->event->frames))
+			slab_buffer_free(local->worker, &remote->event->park);
+		remote_send_release(remote);
+	}
+}
@@ -0,0 +1,233 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Objects of a session kept for reuse by each worker: local and remote
+ * endpoints, their private data and their events are put on a free list
+ * (up to RO_SLAB_CACHED of each type) instead of being freed. With the
+ * splice engine, pipes are emptied and kept as well (up to RO_PIPE_CACHED),
+ * which saves the pipe() and fcntl() calls of a new session. Objects never
+ * move between workers, no locking is needed.
+ */
+
+#include "ro-ro-tcp.h"
+#include "event.h"
+
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+
+static const char *slab_names[SLAB_MAX] = {
+	[SLAB_LOCAL] = "local",
+	[SLAB_LOCAL_PRIVATE] = "local private",
+	[SLAB_REMOTE] = "remote",
+	[SLAB_REMOTE_PRIVATE] = "remote private",
+	[SLAB_EVENT] = "event",
+	[SLAB_PIPE] = "pipe"
+};
+
+static size_t
+slab_size(enum ro_slab_type type)
+{
+	switch (type) {
+	case SLAB_LOCAL: return sizeof(struct ro_local);
+	case SLAB_LOCAL_PRIVATE: return sizeof(struct local_private);
+	case SLAB_REMOTE: return sizeof(struct ro_remote);
+	case SLAB_REMOTE_PRIVATE: return sizeof(struct remote_private);
+	case SLAB_EVENT: return event_get_struct_event_size();
+	default: return 0;
+	}
+}
+
+static void
+slab_used(struct ro_slab *slab)
+{
+	METRIC_ADD(slab->used, 1);
+	if (slab->used > slab->high) slab->high = slab->used;
+}
+
+/**
+ * Get a zeroed object, like `calloc()`.
+ *
+ * @return the object or NULL if there is no memory left
+ */
+void *
+slab_get(struct ro_worker *worker, enum ro_slab_type type)
+{
+	struct ro_slab *slab = &worker->slabs[type];
+	size_t size = slab_size(type);
+	void *object = slab->free;
+	if (object != NULL) {
+		memcpy(&slab->free, object, sizeof(void *));
+		slab->cached--;
+		slab->hits++;
+		memset(object, 0, size);
+	} else {
+		if ((object = calloc(1, size)) == NULL) return NULL;
+		slab->misses++;
+	}
+	slab_used(slab);
+	return object;
+}
+
+/**
+ * Give back an object obtained with `slab_get()`.
+ */
+void
+slab_put(struct ro_worker *worker, enum ro_slab_type type, void *object)
+{
+	struct ro_slab *slab = &worker->slabs[type];
+	if (object == NULL) return;
+	METRIC_ADD(slab->used, -1);
+	if (slab->cached >= RO_SLAB_CACHED) {
+		free(object);
+		return;
+	}
+	memcpy(object, &slab->free, sizeof(void *));
+	slab->free = object;
+	slab->cached++;
+}
+
+/**
+ * Same as `event_new()` with the base of the worker.
+ */
+struct event *
+slab_event_new(struct ro_worker *worker, evutil_socket_t fd, short what,
+    event_callback_fn cb, void *arg)
+{
+	struct event *event = slab_get(worker, SLAB_EVENT);
+	if (event == NULL) return NULL;
+	if (event_assign(event, worker->event->base, fd, what, cb, arg) == -1) {
+		slab_put(worker, SLAB_EVENT, event);
+		return NULL;
+	}
+	return event;
+}
+
+/**
+ * Same as `event_free()` for an event obtained with `slab_event_new()`.
+ */
+void
+slab_event_free(struct ro_worker *worker, struct event *event)
+{
+	if (event == NULL) return;
+	event_del(event);
+	slab_put(worker, SLAB_EVENT, event);
+}
+
+/**
+ * Initialize a buffer with the engine. With pipes, an empty pipe kept by
+ * the worker is used if there is one. Its size is adjusted on a best
+ * effort basis, like a new one.
+ *
+ * @return 0 on success, -1 on error
+ */
+int
+slab_buffer_init(struct ro_worker *worker, struct ro_buffer *buffer,
+    size_t size)
+{
+	const struct ro_engine *engine = worker->cfg->engine;
+	struct ro_slab *slab = &worker->slabs[SLAB_PIPE];
+	if (!engine->pipes) return engine->init(buffer, size);
+	if (slab->cached == 0) {
+		if (engine->init(buffer, size) == -1) return -1;
+		slab->misses++;
+		slab_used(slab);
+		return 0;
+	}
+	*buffer = worker->event->pipes[--slab->cached];
+	if (size > 0 && size != buffer->size && engine->resize &&
+	    engine->resize(buffer, size) == -1)
+		log_debug("engine", "unable to resize pipe to %zu bytes", size);
+	slab->hits++;
+	slab_used(slab);
+	return 0;
+}
+
+/**
+ * Free a buffer initialized with `slab_buffer_init()`. A pipe is kept if
+ * it can be emptied. It is shrunk to the default size to not hold on to
+ * the pipe quota of the user.
+ */
+void
+slab_buffer_free(struct ro_worker *worker, struct ro_buffer *buffer)
+{
+	const struct ro_engine *engine = worker->cfg->engine;
+	struct ro_slab *slab = &worker->slabs[SLAB_PIPE];
+	int pending = 0;
+	if (!engine->pipes) {
+		engine->free(buffer);
+		return;
+	}
+	if (!buffer->ready) return;
+	METRIC_ADD(slab->used, -1);
+	if (slab->cached >= RO_PIPE_CACHED) goto close;
+	while (ioctl(buffer->pipe[0], FIONREAD, &pending) == 0 && pending > 0)
+		if (engine->discard(buffer, pending) <= 0) goto close;
+	if (pending != 0) goto close;
+	if (buffer->size > RO_PIPE_MIN &&
+	    (!engine->resize || engine->resize(buffer, RO_PIPE_MIN) == -1))
+		goto close;
+	worker->event->pipes[slab->cached++] = *buffer;
+	buffer->ready = false;
+	return;
+close:
+	engine->free(buffer);
+}
+
+/**
+ * Log use of the objects kept by a worker.
+ */
+void
+slab_debug(struct ro_worker *worker)
+{
+	for (int i = 0; i < SLAB_MAX; i++) {
+		struct ro_slab *slab = &worker->slabs[i];
+		uint64_t requests = slab->hits + slab->misses;
+		if (requests == 0) continue;
+		log_info("slab",
+		    "worker %u: %s: %zu in use (max %zu), %zu kept, %" PRIu64
+		    " requests, %" PRIu64 "%% served with a kept one",
+		    worker->index, slab_names[i],
+		    slab->used, slab->high, slab->cached, requests,
+		    slab->hits * 100 / requests);
+	}
+}
+
+/**
+ * Free all objects kept by a worker.
+ */
+void
+slab_free(struct ro_worker *worker)
+{
+	const struct ro_engine *engine = worker->cfg->engine;
+	for (int i = 0; i < SLAB_MAX; i++) {
+		struct ro_slab *slab = &worker->slabs[i];
+		void *object;
+		if (i == SLAB_PIPE) {
+			while (slab->cached > 0)
+				engine->free(&worker->event->pipes[--slab->cached]);
+			continue;
+		}
+		while ((object = slab->free) != NULL) {
+			memcpy(&slab->free, object, sizeof(void *));
+			free(object);
+		}
+		slab->cached = 0;
+	}
+}
@@ -0,0 +1,127 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check the number of file descriptors used by a client. An echo server,
+ * a relay and a proxy are started on the loopback interface. Some clients
+ * send data through them and, while they are still connected, the file
+ * descriptors of the proxy and of the relay are counted. With the splice
+ * engine, a client should use about 5 + N descriptors on each side, N
+ * being the number of connections between the proxy and the relay (see
+ * README.md), and in any case less than the 6 + 2N it used to need.
+ */
+
+#include "loopback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#define TEST_CLIENTS 8
+#define TEST_CONNS "4"
+#define TEST_BYTES (1 << 20)
+#define TEST_WINDOW (16 << 10)	/* few frames in flight, few pipes kept for reuse */
+#define TEST_MAX(conns) (6 + 2 * (conns))	/* exclusive */
+
+static int
+test_count(pid_t pid)
+{
+	char path[64];
+	struct dirent *entry;
+	DIR *dir;
+	int count = 0;
+	snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+	if ((dir = opendir(path)) == NULL) return -1;
+	while ((entry = readdir(dir)) != NULL)
+		if (entry->d_name[0] != '.') count++;
+	closedir(dir);
+	return count;
+}
+
+/* The connection is kept open while descriptors are counted */
+static int
+test_client(int port, char *data)
+{
+	int fd = loopback_connect(port);
+	if (fd == -1) {
+		perror("unable to connect to proxy");
+		exit(1);
+	}
+	if (loopback_exchange(fd, data, TEST_BYTES, TEST_WINDOW) == -1)
+		exit(1);
+	return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int lfd, fds[TEST_CLIENTS], rc = 0;
+	int echo = loopback_port(&lfd), rport = loopback_port(NULL), pport = loopback_port(NULL);
+	int conns = atoi(TEST_CONNS);
+	char server[32], relayed[32], proxied[32];
+	char *data;
+
+	if (access("/proc/self/fd", R_OK) == -1) {
+		fprintf(stderr, "no /proc, skip\n");
+		return 77;
+	}
+	if (loopback_echo(lfd) == -1)
+		return 1;
+	snprintf(server, sizeof(server), "127.0.0.1:%d", echo);
+	snprintf(relayed, sizeof(relayed), "127.0.0.1:%d", rport);
+	snprintf(proxied, sizeof(proxied), "127.0.0.1:%d", pport);
+	pid_t relay = loopback_spawn("./ro-ro-tcp", (char *[]){
+		"ro-ro-tcp", "-d", "-r", server, relayed, NULL });
+	pid_t proxy = loopback_spawn("./ro-ro-tcp", (char *[]){
+		"ro-ro-tcp", "-d", "-z", TEST_CONNS, "-p", proxied, relayed, NULL });
+	if (loopback_listening(rport) == -1 || loopback_listening(pport) == -1) {
+		fprintf(stderr, "proxy or relay did not start\n");
+		rc = 1;
+		goto end;
+	}
+
+	int before[2] = { test_count(proxy), test_count(relay) };
+	if ((data = malloc(TEST_BYTES)) == NULL) {
+		rc = 1;
+		goto end;
+	}
+	for (size_t i = 0; i < TEST_BYTES; i++) data[i] = random();
+	for (int i = 0; i < TEST_CLIENTS; i++)
+		fds[i] = test_client(pport, data);
+	usleep(600000);		/* Let the reorder pipes be released */
+	int after[2] = { test_count(proxy), test_count(relay) };
+
+	for (int i = 0; i < 2; i++) {
+		double used = (double)(after[i] - before[i]) / TEST_CLIENTS;
+		printf("%s: %.1f file descriptors per client with %d connections (less than %d)\n",
+		    i?"relay":"proxy", used, conns, TEST_MAX(conns));
+		if (before[i] == -1 || after[i] == -1 || used >= TEST_MAX(conns))
+			rc = 1;
+	}
+	for (int i = 0; i < TEST_CLIENTS; i++) close(fds[i]);
+	free(data);
+
+end:
+	kill(proxy, SIGTERM);
+	kill(relay, SIGTERM);
+	waitpid(proxy, NULL, 0);
+	waitpid(relay, NULL, 0);
+	return rc;
+}
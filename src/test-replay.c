@@ -0,0 +1,145 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Check that clients survive the loss of a connection with a replay
+ * buffer. An echo server, a relay and a proxy are started on the loopback
+ * interface, with ro-ro-impair between the proxy and the relay resetting
+ * the last connection of each client while data is flowing. Either end
+ * may notice the loss first. All the data should be echoed back in time.
+ */
+
+#include "loopback.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#define TEST_CLIENTS 2
+#define TEST_CONNS "4"
+#define TEST_REPLAY "16777216"
+#define TEST_BYTES (8 << 20)
+#define TEST_TIMEOUT 60		/* seconds */
+
+static char *data;
+static int pport;
+static pid_t pids[3] = { -1, -1, -1 };	/* relay, impairment relay, proxy */
+
+static void
+test_stop(void)
+{
+	for (int i = 2; i >= 0; i--) {
+		if (pids[i] == -1) continue;
+		kill(pids[i], SIGTERM);
+		waitpid(pids[i], NULL, 0);
+		pids[i] = -1;
+	}
+}
+
+/* Stuck clients then get the end of the stream and fail */
+static void
+test_timeout(int sig)
+{
+	test_stop();
+}
+
+/* Send the data and read it back at the same time */
+static void *
+test_client(void *arg)
+{
+	int fd = loopback_connect(pport);
+	if (fd == -1) {
+		perror("unable to connect to proxy");
+		return (void *)1;
+	}
+	int rc = loopback_exchange(fd, data, TEST_BYTES, TEST_BYTES);
+	close(fd);
+	return (rc == -1)?(void *)1:NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int lfd, rc = 0;
+	int echo = loopback_port(&lfd), rport = loopback_port(NULL),
+	    iport = loopback_port(NULL);
+	char server[32], relayed[32], impaired[32], proxied[32];
+	pthread_t threads[TEST_CLIENTS];
+
+	if (access("./ro-ro-impair", X_OK) == -1) {
+		fprintf(stderr, "no ro-ro-impair, skip\n");
+		return 77;
+	}
+	if (loopback_echo(lfd) == -1)
+		return 1;
+	pport = loopback_port(NULL);
+	snprintf(server, sizeof(server), "127.0.0.1:%d", echo);
+	snprintf(relayed, sizeof(relayed), "127.0.0.1:%d", rport);
+	snprintf(impaired, sizeof(impaired), "127.0.0.1:%d", iport);
+	snprintf(proxied, sizeof(proxied), "127.0.0.1:%d", pport);
+
+	/* The fourth connection of each client is reset after 300 ms */
+	pids[0] = loopback_spawn("./ro-ro-tcp", (char *[]){
+		"ro-ro-tcp", "-d", "-Esplice", "--replay-buffer", TEST_REPLAY,
+		"-r", server, relayed, NULL });
+	pids[1] = loopback_spawn("./ro-ro-impair", (char *[]){
+		"ro-ro-impair", "-i", "rate=2m", "-i", "rate=2m",
+		"-i", "rate=2m", "-i", "rate=2m,reset=300",
+		impaired, relayed, NULL });
+	pids[2] = loopback_spawn("./ro-ro-tcp", (char *[]){
+		"ro-ro-tcp", "-d", "-Esplice", "-z", TEST_CONNS,
+		"--replay-buffer", TEST_REPLAY,
+		"-p", proxied, impaired, NULL });
+	if (loopback_listening(rport) == -1 ||
+	    loopback_listening(iport) == -1 ||
+	    loopback_listening(pport) == -1) {
+		fprintf(stderr, "proxy, relay or impairment relay did not start\n");
+		rc = 1;
+		goto end;
+	}
+
+	if ((data = malloc(TEST_BYTES)) == NULL) {
+		rc = 1;
+		goto end;
+	}
+	for (size_t i = 0; i < TEST_BYTES; i++) data[i] = random();
+	signal(SIGALRM, test_timeout);
+	alarm(TEST_TIMEOUT);
+	for (int i = 0; i < TEST_CLIENTS; i++)
+		if (pthread_create(&threads[i], NULL, test_client, NULL) != 0) {
+			perror("unable to start client");
+			rc = 1;
+			goto end;
+		}
+	for (int i = 0; i < TEST_CLIENTS; i++) {
+		void *failed;
+		pthread_join(threads[i], &failed);
+		if (failed) rc = 1;
+	}
+	if (rc == 0)
+		printf("%d clients echoed %d bytes with a connection reset each\n",
+		    TEST_CLIENTS, TEST_BYTES);
+	free(data);
+
+end:
+	alarm(0);
+	test_stop();
+	return rc;
+}
@@ -0,0 +1,276 @@
+/* -*- mode: c; c-file-style: "openbsd" -*- */
+/*
+ * Copyright (c) 2013 Vincent Bernat <vbe@deezer.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Minimal io_uring support, used to submit several operations with a single
+ * system call. We don't depend on liburing: only the few bits we need are
+ * implemented on top of the raw system calls.
+ *
+ * Operations are queued with `uring_splice()` and `uring_write()`, then
+ * `uring_submit()` submits them and waits for all of them to complete. This
+ * keeps the synchronous semantic of the remaining of the code.
+ */
+
+#include "ro-ro-tcp.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef ENABLE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+struct ro_uring {
+	int fd;
+	unsigned queued;	/* Operations queued but not submitted yet */
+
+	/* Submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	/* Completion queue */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/**
+ * Setup a new ring.
+ *
+ * @param entries Number of operations which can be queued at once.
+ * @return the ring or NULL if io_uring is not available
+ */
+struct ro_uring *
+uring_init(unsigned entries)
+{
+	struct ro_uring *ring;
+	struct io_uring_params p = {};
+
+	if ((ring = calloc(1, sizeof(struct ro_uring))) == NULL) {
+		log_warn("uring", "unable to allocate ring");
+		return NULL;
+	}
+	ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+	if ((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1) {
+		log_warn("uring", "unable to setup io_uring");
+		goto error;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	if ((ring->sq_ring = mmap(NULL, ring->sq_ring_size,
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+		log_warn("uring", "unable to map submission queue");
+		goto error;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ring = ring->sq_ring;
+	else if ((ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		log_warn("uring", "unable to map completion queue");
+		goto error;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((ring->sqes = mmap(NULL, ring->sqes_size,
+		    PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    ring->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+		log_warn("uring", "unable to map submission entries");
+		goto error;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_entries = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_entries);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+	log_debug("uring", "io_uring setup with %u entries", p.sq_entries);
+	return ring;
+
+error:
+	uring_free(ring);
+	return NULL;
+}
+
+void
+uring_free(struct ro_uring *ring)
+{
+	if (ring == NULL) return;
+	if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd != -1) close(ring->fd);
+	free(ring);
+}
+
+static struct io_uring_sqe *
+uring_get_sqe(struct ro_uring *ring)
+{
+	if (ring->queued == *ring->sq_entries) return NULL;
+	unsigned tail = *ring->sq_tail + ring->queued;
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->queued++;
+	return sqe;
+}
+
+/**
+ * Queue a splice operation.
+ *
+ * @param link When true, the next operation is only executed if this one
+ *             completes fully.
+ * @param data Opaque data given back on completion.
+ * @return -1 if the ring is full
+ */
+int
+uring_splice(struct ro_uring *ring, int in, int out, size_t len,
+    unsigned flags, bool link, uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe == NULL) return -1;
+	sqe->opcode = IORING_OP_SPLICE;
+	sqe->fd = out;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->splice_off_in = (uint64_t)-1;
+	sqe->splice_fd_in = in;
+	sqe->splice_flags = flags;
+	sqe->flags = link?IOSQE_IO_LINK:0;
+	sqe->user_data = data;
+	return 0;
+}
+
+/**
+ * Queue a write operation. The buffer should stay valid until submission.
+ *
+ * @return -1 if the ring is full
+ */
+int
+uring_write(struct ro_uring *ring, int fd, const void *buf, size_t len,
+    bool link, uint64_t data)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe == NULL) return -1;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	sqe->flags = link?IOSQE_IO_LINK:0;
+	sqe->user_data = data;
+	return 0;
+}
+
+/**
+ * Submit queued operations and wait for their completion. The provided
+ * callback is invoked for each of them with the opaque data and the result
+ * of the operation (a negative errno on error).
+ *
+ * @return -1 on error
+ */
+int
+uring_submit(struct ro_uring *ring,
+    void (*cb)(uint64_t, int, void *), void *arg)
+{
+	unsigned submit = ring->queued, pending = ring->queued;
+	if (pending == 0) return 0;
+
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + submit,
+	    __ATOMIC_RELEASE);
+	ring->queued = 0;
+	while (pending > 0) {
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			/* Submit (if not done yet) and wait for completions */
+			int n = syscall(__NR_io_uring_enter, ring->fd,
+			    submit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (n == -1) {
+				if (errno == EINTR) continue;
+				log_warn("uring", "unable to submit operations");
+				return -1;
+			}
+			submit -= n;
+			continue;
+		}
+		while (head != tail && pending > 0) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			cb(cqe->user_data, cqe->res, arg);
+			head++;
+			pending--;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+#else
+
+struct ro_uring *
+uring_init(unsigned entries)
+{
+	log_warnx("uring", "io_uring support not compiled in");
+	return NULL;
+}
+
+void
+uring_free(struct ro_uring *ring)
+{
+}
+
+int
+uring_splice(struct ro_uring *ring, int in, int out, size_t len,
+    unsigned flags, bool link, uint64_t data)
+{
+	return -1;
+}
+
+int
+uring_write(struct ro_uring *ring, int fd, const void *buf, size_t len,
+    bool link, uint64_t data)
+{
+	return -1;
+}
+
+int
+uring_submit(struct ro_uring *ring,
+    void (*cb)(uint64_t, int, void *), void *arg)
+{
+	return -1;
+}
+
+#endif